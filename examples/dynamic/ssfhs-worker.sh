@@ -0,0 +1,58 @@
+#!/bin/bash
+# SSFHS persistent dynamic worker
+#
+# Reads jobs from stdin and answers on stdout, see src/dynworker.c for the
+# protocol. Every command is evaluated in a subshell of this long lived shell,
+# so there's a fork per tag but no exec and no shell startup. Whatever the
+# command changes (variables, functions, options, traps, the directory, even an
+# `exit`) dies with the subshell and never reaches the next request. The
+# commands are run by bash in POSIX mode, which takes everything /bin/sh does
+# but also the bash extensions.
+
+export LC_ALL=C
+vars=()
+
+# The output is captured in two scratch files instead of $(...), which would
+# drop the trailing newlines and can't keep stderr apart. They are unlinked right away and opened
+# again through /proc, so nothing is left behind when the worker is killed.
+out_file=$(mktemp)
+err_file=$(mktemp)
+exec 3<"$out_file" 4<"$err_file"
+rm -f "$out_file" "$err_file"
+out_file=/proc/$$/fd/3
+err_file=/proc/$$/fd/4
+
+while read -r keyword len; do
+    case "$keyword" in
+        CMD)
+            IFS= read -r -N "$len" cmd
+            read -r
+            ;;
+        ENV)
+            IFS= read -r -N "$len" var
+            read -r
+            vars+=("$var")
+            ;;
+        RUN)
+            # Only the request variables are passed on, the state of this
+            #  script isn't. stdin is the job socket, the command mustn't read it
+            (
+                set -o posix
+                [ "${#vars[@]}" -eq 0 ] || export "${vars[@]}"
+                eval "unset vars var cmd keyword len out_file err_file out err rc; $cmd"
+            ) >"$out_file" 2>"$err_file" </dev/null
+            rc=$?
+            vars=()
+
+            IFS= read -r -d '' out <"$out_file"
+            IFS= read -r -d '' err <"$err_file"
+            if [ -n "$err" ]; then
+                printf 'ERR %d\n%s\n' "${#err}" "$err"
+            fi
+            printf 'OUT %d\n%s\nEXIT %d\n' "${#out}" "$out" "$rc"
+            ;;
+        *)
+            exit 1
+            ;;
+    esac
+done
@@ -0,0 +1,22 @@
+#!/bin/sh
+# Compares the plugin handler with the same page built from shell commands
+# Usage: ./bench.sh [host:port] [requests]
+
+HOST=${1:-localhost:8080}
+COUNT=${2:-200}
+
+bench()
+{
+    # One curl process for all the requests, so its startup isn't measured
+    urls=""
+    i=0
+    while [ $i -lt $COUNT ]; do
+        urls="$urls -o /dev/null http://$HOST$1"
+        i=$((i + 1))
+    done
+    curl -s -w "%{time_total}\n" $urls | \
+        awk -v url="$1" '{ sum += $1 } END { printf "%-24s %d requests, avg %.3fms\n", url, NR, sum / NR * 1000 }'
+}
+
+bench /api/status.json
+bench /api/shell-status.json
@@ -0,0 +1,126 @@
+/**
+ * @file status.c
+ * @author epsiii
+ * @brief Example SSFHS plugin, the server status page without the shell
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * Build with `make plugins`, see ssfhs.conf for how it's wired up.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "ssfhs_plugin.h"
+
+const int ssfhs_plugin_api_version = SSFHS_PLUGIN_API_VERSION;
+
+// Doesn't change while running, read once on load
+static char cpu_model[256] = "unknown";
+
+int ssfhs_plugin_init(void)
+{
+    FILE *fp = fopen("/proc/cpuinfo", "r");
+    if (!fp) { return 0; }
+
+    char line[512];
+    while (fgets(line, sizeof(line), fp))
+    {
+        char *value = strchr(line, ':');
+        if (strncmp(line, "model name", 10) != 0 || !value) { continue; }
+
+        value += 1 + strspn(value + 1, " \t");
+        value[strcspn(value, "\n")] = '\0';
+        snprintf(cpu_model, sizeof(cpu_model), "%s", value);
+        break;
+    }
+    fclose(fp);
+    return 0;
+}
+
+static long read_meminfo(const char *key)
+{
+    FILE *fp = fopen("/proc/meminfo", "r");
+    if (!fp) { return 0; }
+
+    char line[256];
+    long value = 0;
+    size_t key_len = strlen(key);
+    while (fgets(line, sizeof(line), fp))
+    {
+        if (strncmp(line, key, key_len) == 0 && line[key_len] == ':')
+        {
+            sscanf(line + key_len + 1, "%ld", &value);
+            break;
+        }
+    }
+    fclose(fp);
+    return value;
+}
+
+static double read_uptime(void)
+{
+    double uptime = 0;
+    FILE *fp = fopen("/proc/uptime", "r");
+    if (fp)
+    {
+        if (fscanf(fp, "%lf", &uptime) != 1) { uptime = 0; }
+        fclose(fp);
+    }
+    return uptime;
+}
+
+// PLUGIN_URL handler, same output as api/shell-status.json
+static int server_status(const SsfhsRequest *request, SsfhsWriter *writer)
+{
+    long total = read_meminfo("MemTotal");
+    long available = read_meminfo("MemAvailable");
+    long uptime = (long)read_uptime();
+
+    char now[16];
+    struct tm tm;
+    time_t t = time(NULL);
+    strftime(now, sizeof(now), "%H:%M:%S", localtime_r(&t, &tm));
+
+    char buffer[1024];
+    int len = snprintf(buffer, sizeof(buffer),
+        "{\n"
+        "  \"cpuType\": \"%s\",\n"
+        "  \"memoryUsage\": \"Server RAM: %.1f/%.1fGB\",\n"
+        "  \"requestId\": \"%d\",\n"
+        "  \"uptime\": \"up %ld hours, %ld minutes\",\n"
+        "  \"serverTime\": \"%s\"\n"
+        "}\n",
+        cpu_model,
+        (double)(total - available) / 1024 / 1024, (double)total / 1024 / 1024,
+        request->request_id, uptime / 3600, uptime / 60 % 60, now);
+    if (len < 0 || (size_t)len >= sizeof(buffer)) { return 1; }
+
+    writer->content_type = "application/json";
+    return writer->write(writer, buffer, (size_t)len);
+}
+
+// Template handler, <ssfhs-plugin name="request_summary"/>
+static int request_summary(const SsfhsRequest *request, SsfhsWriter *writer)
+{
+    char buffer[512];
+    int len = snprintf(buffer, sizeof(buffer),
+        "Request %d: %s %s from %s with %zu headers",
+        request->request_id, request->method, request->url,
+        request->remote_addr, request->header_count);
+    if (len < 0) { return 1; }
+    if ((size_t)len >= sizeof(buffer)) { len = sizeof(buffer) - 1; }
+
+    // Everything else in the page is static, so escape the only untrusted part
+    for (int i = 0; i < len; i++)
+    {
+        if (buffer[i] == '<' || buffer[i] == '>' || buffer[i] == '&') { buffer[i] = '?'; }
+    }
+    return writer->write(writer, buffer, (size_t)len);
+}
+
+const SsfhsHandlerEntry ssfhs_plugin_handlers[] = {
+    { "server_status", server_status },
+    { "request_summary", request_summary },
+    { NULL, NULL }
+};
@@ -0,0 +1,171 @@
+/**
+ * @file arena.c
+ * @author epsiii
+ * @brief Request scoped bump allocator for SSFHS
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "ssfhs.h"
+
+// Every block handed out is aligned to this
+#define ARENA_ALIGNMENT _Alignof(max_align_t)
+
+struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;
+    size_t used;
+    _Alignas(max_align_t) char data[];
+};
+
+struct ArenaCleanup {
+    struct ArenaCleanup *next;
+    void (*fn)(void *arg);
+    void *arg;
+};
+
+// Server wide counters, updated when an arena is reset
+static _Atomic size_t   stats_high_water = 0;
+static _Atomic uint64_t stats_resets = 0;
+static _Atomic uint64_t stats_chunk_allocs = 0;
+static _Atomic uint64_t stats_large_allocs = 0;
+
+static size_t arena_align(size_t size)
+{
+    return (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+}
+
+static ArenaChunk* arena_chunk_new(size_t size)
+{
+    ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + size);
+    if (!chunk) { return NULL; }
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+void arena_init(Arena *arena)
+{
+    arena->chunks = arena_chunk_new(ARENA_CHUNK_SIZE);
+    arena->cleanups = NULL;
+    arena->used = 0;
+    arena->high_water = 0;
+}
+
+// Registers a function that will be called on the next reset (in reverse order)
+int arena_defer(Arena *arena, void (*fn)(void *arg), void *arg)
+{
+    ArenaCleanup *node = arena_alloc(arena, sizeof(ArenaCleanup));
+    if (!node) { return 1; }
+    node->fn = fn;
+    node->arg = arg;
+    node->next = arena->cleanups;
+    arena->cleanups = node;
+    return 0;
+}
+
+// Registers a heap block that will be released on the next reset
+int arena_adopt(Arena *arena, void *ptr)
+{
+    return arena_defer(arena, free, ptr);
+}
+
+void* arena_alloc(Arena *arena, size_t size)
+{
+    size = arena_align(size ? size : 1);
+    arena->used += size;
+
+    // Oversized blocks go straight to the heap
+    if (size > ARENA_LARGE_BLOCK)
+    {
+        void *ptr = malloc(size);
+        if (!ptr) { return NULL; }
+        if (arena_adopt(arena, ptr))
+        {
+            free(ptr);
+            return NULL;
+        }
+        atomic_fetch_add_explicit(&stats_large_allocs, 1, memory_order_relaxed);
+        return ptr;
+    }
+
+    // Get a new chunk if the current one is full
+    ArenaChunk *chunk = arena->chunks;
+    if (!chunk || chunk->used + size > chunk->size)
+    {
+        chunk = arena_chunk_new(ARENA_CHUNK_SIZE);
+        if (!chunk) { return NULL; }
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        atomic_fetch_add_explicit(&stats_chunk_allocs, 1, memory_order_relaxed);
+    }
+
+    void *ptr = &chunk->data[chunk->used];
+    chunk->used += size;
+    return ptr;
+}
+
+char* arena_strndup(Arena *arena, const char *str, size_t len)
+{
+    char *copy = arena_alloc(arena, len + 1);
+    if (!copy) { return NULL; }
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+char* arena_strdup(Arena *arena, const char *str)
+{
+    return arena_strndup(arena, str, strlen(str));
+}
+
+// Releases everything allocated since the last reset, the oldest chunk is kept
+//  so the next request can start allocating without touching the heap
+void arena_reset(Arena *arena)
+{
+    // Update the statistics
+    if (arena->used > arena->high_water) { arena->high_water = arena->used; }
+    size_t seen = atomic_load_explicit(&stats_high_water, memory_order_relaxed);
+    while (arena->used > seen &&
+        !atomic_compare_exchange_weak(&stats_high_water, &seen, arena->used)) { }
+    atomic_fetch_add_explicit(&stats_resets, 1, memory_order_relaxed);
+
+    // Run the cleanups and free the heap blocks (the nodes themselves live in the chunks)
+    for (ArenaCleanup *node = arena->cleanups; node; node = node->next)
+    {
+        node->fn(node->arg);
+    }
+    arena->cleanups = NULL;
+
+    // Free all the chunks except the first one
+    ArenaChunk *chunk = arena->chunks;
+    while (chunk && chunk->next)
+    {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->chunks = chunk;
+    if (chunk) { chunk->used = 0; }
+    arena->used = 0;
+}
+
+void arena_free(Arena *arena)
+{
+    arena_reset(arena);
+    free(arena->chunks);
+    arena->chunks = NULL;
+}
+
+void arena_get_stats(ArenaStats *stats)
+{
+    stats->high_water = atomic_load(&stats_high_water);
+    stats->resets = atomic_load(&stats_resets);
+    stats->chunk_allocs = atomic_load(&stats_chunk_allocs);
+    stats->large_allocs = atomic_load(&stats_large_allocs);
+}
@@ -24,6 +24,8 @@ static void print_help_and_exit(const char *prog_name)
     printf("  -l, --log-file [FILE]         File for storing logs (default: ssfhs.log).\n");
     printf("  -c, --config-file [FILE]      Server config file (default: ssfhs.conf).\n");
     printf("  -d, --debug                   Enable debug logs.\n");
+    printf("  -s, --snapshot                Index the root directory once (SIGHUP rebuilds it).\n");
+    printf("  -a, --archive [FILE]          Serve a site archive made by ssfhs-pack (SIGHUP reloads it).\n");
 
     exit(EXIT_SUCCESS);
 }
@@ -36,9 +38,9 @@ void cli_args_parse(ServerConfig *config, int argc, const char **argv)
     // Set default parameters
     config->debug = false;
     config->port = 8080;
-    config->config_file = "./ssfhs.conf";
-    config->log_file = "./ssfhs.log";
-    config->root_dir = ".";
+    config->config_file = strdup("./ssfhs.conf");
+    config->log_file = strdup("./ssfhs.log");
+    config->root_dir = strdup(".");
 
     // Parse the arguments
     int arg_index = 1;
@@ -81,6 +83,7 @@ void cli_args_parse(ServerConfig *config, int argc, const char **argv)
                 exit(EXIT_FAILURE);
             }
 
+            free(config->log_file);
             config->log_file = strdup(argv[arg_index + 1]);
             arg_index += 2;
         }
@@ -94,6 +97,7 @@ void cli_args_parse(ServerConfig *config, int argc, const char **argv)
                 exit(EXIT_FAILURE);
             }
 
+            free(config->config_file);
             config->config_file = strdup(argv[arg_index + 1]);
             arg_index += 2;
 
@@ -114,6 +118,7 @@ void cli_args_parse(ServerConfig *config, int argc, const char **argv)
                 exit(EXIT_FAILURE);
             }
 
+            free(config->root_dir);
             config->root_dir = realpath(argv[arg_index + 1], NULL);
             if (!config->root_dir)
             {
@@ -130,6 +135,33 @@ void cli_args_parse(ServerConfig *config, int argc, const char **argv)
             arg_index += 1;
         }
 
+        // Snapshot of the root
+        else if (strcmp(arg, "--snapshot") == 0 || strcmp(arg, "-s") == 0) 
+        {
+            config->snapshot = true;
+            arg_index += 1;
+        }
+
+        // Site archive, served from the snapshot
+        else if (strcmp(arg, "--archive") == 0 || strcmp(arg, "-a") == 0) 
+        {
+            if (arg_index == argc - 1)
+            {
+                fprintf(stderr, "Missing argument for --archive\n");
+                exit(EXIT_FAILURE);
+            }
+
+            free(config->archive_file);
+            config->archive_file = realpath(argv[arg_index + 1], NULL);
+            if (!config->archive_file)
+            {
+                fprintf(stderr, "Could not open archive: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            config->snapshot = true;
+            arg_index += 2;
+        }
+
         else 
         {
             fprintf(stderr, "Unknown argument: %s\n", arg);
@@ -0,0 +1,348 @@
+/**
+ * @file compress.c
+ * @author epsiii
+ * @brief On the fly response compression and the cache of compressed static files
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * The encoders are optional, gzip needs zlib (SSFHS_WITH_ZLIB) and br needs
+ * libbrotlienc (SSFHS_WITH_BROTLI). Without either, compression is never
+ * selected. Static files are compressed once per path, encoding and mtime,
+ * the results are kept in a cache of at most COMPRESSION_CACHE_SIZE bytes
+ * and the least recently used ones are evicted first.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "ssfhs.h"
+
+#ifdef SSFHS_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef SSFHS_WITH_BROTLI
+#include <brotli/encode.h>
+#endif
+
+// Supported encodings, in the order of preference on a tie
+static const char *encodings[] =
+{
+#ifdef SSFHS_WITH_BROTLI
+    "br",
+#endif
+#ifdef SSFHS_WITH_ZLIB
+    "gzip",
+#endif
+    NULL
+};
+
+// Whether responses of the type are compressed at all (they have to be marked with Vary then)
+bool compression_is_compressible(const char *content_type)
+{
+    if (!g_server_config.compression || !encodings[0] || !content_type) { return false; }
+
+    const char *types[] =
+    {
+        "application/javascript",
+        "application/json",
+        "image/svg+xml",
+        "image/x-icon",
+        "image/bmp",
+    };
+
+    if (strncmp(content_type, "text/", 5) == 0) { return true; }
+    for (size_t i = 0; i < sizeof(types) / sizeof(*types); i++)
+    {
+        if (strcmp(content_type, types[i]) == 0) { return true; }
+    }
+    return false;
+}
+
+// The best encoding the client accepts, NULL if the response should go as is
+const char *compression_select_encoding(const char *accept_encoding)
+{
+    if (!accept_encoding) { return NULL; }
+
+    const char *best = NULL;
+    double best_quality = 0.0;
+    for (int i = 0; encodings[i]; i++)
+    {
+        double quality = http_accept_quality(accept_encoding, encodings[i]);
+        if (quality > best_quality)
+        {
+            best = encodings[i];
+            best_quality = quality;
+        }
+    }
+    return best;
+}
+
+#ifdef SSFHS_WITH_ZLIB
+static size_t compression_gzip(const struct iovec *in, int count, void *out, size_t out_cap)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+
+    // 15 bits window, +16 for the gzip wrapper
+    int level = (g_server_config.compression_level > 9) ? 9 : g_server_config.compression_level;
+    if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) { return 0; }
+
+    stream.next_out = out;
+    stream.avail_out = out_cap;
+    int result = Z_OK;
+    for (int i = 0; i < count && result == Z_OK; i++)
+    {
+        stream.next_in = in[i].iov_base;
+        stream.avail_in = in[i].iov_len;
+        result = deflate(&stream, (i == count - 1) ? Z_FINISH : Z_NO_FLUSH);
+
+        // Whatever is left didn't fit into the output
+        if (result == Z_OK && stream.avail_in) { result = Z_BUF_ERROR; }
+    }
+    size_t len = (result == Z_STREAM_END) ? stream.total_out : 0;
+    deflateEnd(&stream);
+
+    return len;
+}
+#endif
+
+#ifdef SSFHS_WITH_BROTLI
+static size_t compression_brotli(const struct iovec *in, int count, size_t in_len, void *out, size_t out_cap)
+{
+    BrotliEncoderState *state = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+    if (!state) { return 0; }
+    BrotliEncoderSetParameter(state, BROTLI_PARAM_QUALITY, g_server_config.compression_level);
+    BrotliEncoderSetParameter(state, BROTLI_PARAM_SIZE_HINT, in_len);
+
+    uint8_t *next_out = out;
+    size_t avail_out = out_cap;
+    bool okay = true;
+    for (int i = 0; i < count && okay; i++)
+    {
+        const uint8_t *next_in = in[i].iov_base;
+        size_t avail_in = in[i].iov_len;
+        BrotliEncoderOperation op = (i == count - 1) ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS;
+        do
+        {
+            okay = BrotliEncoderCompressStream(state, op, &avail_in, &next_in, &avail_out, &next_out, NULL);
+        } while (okay && avail_out && (avail_in || BrotliEncoderHasMoreOutput(state) ||
+            (op == BROTLI_OPERATION_FINISH && !BrotliEncoderIsFinished(state))));
+    }
+    okay = okay && BrotliEncoderIsFinished(state);
+    BrotliEncoderDestroyInstance(state);
+
+    return (okay) ? out_cap - avail_out : 0;
+}
+#endif
+
+// Compresses the buffers into the arena, returns 0 if it failed or the result isn't smaller
+size_t compression_compress(const char *encoding, Arena *arena, const struct iovec *in, int count,
+    size_t in_len, void **out)
+{
+    if (count == 0 || in_len == 0) { return 0; }
+
+    // Anything bigger than the input is useless anyway
+    size_t out_cap = in_len;
+    *out = arena_alloc(arena, out_cap);
+
+    size_t len = 0;
+#ifdef SSFHS_WITH_ZLIB
+    if (strcmp(encoding, "gzip") == 0) { len = compression_gzip(in, count, *out, out_cap); }
+#endif
+#ifdef SSFHS_WITH_BROTLI
+    if (strcmp(encoding, "br") == 0) { len = compression_brotli(in, count, in_len, *out, out_cap); }
+#endif
+    (void)encoding;
+    (void)in;
+
+    if (g_server_config.debug)
+    {
+        printf("[COMPRESS:Compress] %s: %zu -> %zu bytes\n", encoding, in_len, len);
+    }
+
+    return (len < in_len) ? len : 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//                                 Cache                                    //
+//////////////////////////////////////////////////////////////////////////////
+
+typedef struct CompressionCacheEntry {
+    struct CompressionCacheEntry *next;         // Bucket chain
+    struct CompressionCacheEntry *lru_prev;
+    struct CompressionCacheEntry *lru_next;
+    char *path;
+    const char *encoding;
+    struct timespec mtime;
+    off_t size;
+    void *data;
+    size_t len;                                 // 0 - the file doesn't compress
+} CompressionCacheEntry;
+
+static CompressionCacheEntry *cache[COMPRESSION_CACHE_BUCKETS];
+static CompressionCacheEntry *lru_head = NULL;  // Most recently used
+static CompressionCacheEntry *lru_tail = NULL;
+static CompressionCacheStats cache_stats;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned compression_cache_bucket(const char *path, const char *encoding)
+{
+    return (hash_string(path) ^ hash_string(encoding)) % COMPRESSION_CACHE_BUCKETS;
+}
+
+static size_t compression_cache_entry_size(const CompressionCacheEntry *entry)
+{
+    return sizeof(CompressionCacheEntry) + strlen(entry->path) + 1 + entry->len;
+}
+
+static void compression_cache_lru_unlink(CompressionCacheEntry *entry)
+{
+    if (entry->lru_prev) { entry->lru_prev->lru_next = entry->lru_next; }
+    else { lru_head = entry->lru_next; }
+    if (entry->lru_next) { entry->lru_next->lru_prev = entry->lru_prev; }
+    else { lru_tail = entry->lru_prev; }
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void compression_cache_lru_push(CompressionCacheEntry *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = lru_head;
+    if (lru_head) { lru_head->lru_prev = entry; }
+    lru_head = entry;
+    if (!lru_tail) { lru_tail = entry; }
+}
+
+// Unlinks the entry from everything and frees it (mutex has to be held)
+static void compression_cache_remove(CompressionCacheEntry *entry)
+{
+    CompressionCacheEntry **link = &cache[compression_cache_bucket(entry->path, entry->encoding)];
+    while (*link && *link != entry) { link = &(*link)->next; }
+    if (*link) { *link = entry->next; }
+    compression_cache_lru_unlink(entry);
+
+    cache_stats.size -= compression_cache_entry_size(entry);
+    cache_stats.entries--;
+    free(entry->path);
+    free(entry->data);
+    free(entry);
+}
+
+static CompressionCacheEntry *compression_cache_find(const char *path, const char *encoding)
+{
+    CompressionCacheEntry *entry = cache[compression_cache_bucket(path, encoding)];
+    while (entry && (entry->encoding != encoding || strcmp(entry->path, path) != 0))
+    {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+static bool compression_cache_is_current(const CompressionCacheEntry *entry, const struct stat *st)
+{
+    return entry->size == st->st_size &&
+        entry->mtime.tv_sec == st->st_mtim.tv_sec && entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// Copies the compressed file into the arena, returns false on a miss (an empty
+//  data means the file was tried already and doesn't get any smaller)
+bool compression_cache_get(Arena *arena, const char *path, const struct stat *st,
+    const char *encoding, struct iovec *data)
+{
+    if (g_server_config.compression_cache_size == 0) { return false; }
+
+    bool hit = false;
+    pthread_mutex_lock(&cache_mutex);
+    CompressionCacheEntry *entry = compression_cache_find(path, encoding);
+    if (entry && !compression_cache_is_current(entry, st))
+    {
+        compression_cache_remove(entry);
+        entry = NULL;
+    }
+    if (entry)
+    {
+        compression_cache_lru_unlink(entry);
+        compression_cache_lru_push(entry);
+        data->iov_len = entry->len;
+        data->iov_base = NULL;
+        if (entry->len)
+        {
+            data->iov_base = arena_alloc(arena, entry->len);
+            memcpy(data->iov_base, entry->data, entry->len);
+        }
+        cache_stats.hits++;
+        hit = true;
+    }
+    else
+    {
+        cache_stats.misses++;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+
+    if (g_server_config.debug)
+    {
+        printf("[COMPRESS:Cache] %s: %s (%s)\n", hit ? "hit" : "miss", path, encoding);
+    }
+
+    return hit;
+}
+
+// The encoding has to be one returned by compression_select_encoding()
+void compression_cache_put(const char *path, const struct stat *st, const char *encoding,
+    const void *data, size_t len)
+{
+    CompressionCacheEntry *fresh = calloc(1, sizeof(CompressionCacheEntry));
+    fresh->path = strdup(path);
+    fresh->encoding = encoding;
+    fresh->mtime = st->st_mtim;
+    fresh->size = st->st_size;
+    fresh->len = len;
+    fresh->data = malloc(len ? len : 1);
+    memcpy(fresh->data, data, len);
+
+    size_t fresh_size = compression_cache_entry_size(fresh);
+    if (fresh_size > g_server_config.compression_cache_size)
+    {
+        free(fresh->path);
+        free(fresh->data);
+        free(fresh);
+        return;
+    }
+
+    pthread_mutex_lock(&cache_mutex);
+
+    // Another thread might have been faster
+    CompressionCacheEntry *old = compression_cache_find(path, encoding);
+    if (old) { compression_cache_remove(old); }
+
+    // Make space, starting with the least recently used
+    while (lru_tail && cache_stats.size + fresh_size > g_server_config.compression_cache_size)
+    {
+        compression_cache_remove(lru_tail);
+        cache_stats.evictions++;
+    }
+
+    unsigned bucket = compression_cache_bucket(path, encoding);
+    fresh->next = cache[bucket];
+    cache[bucket] = fresh;
+    compression_cache_lru_push(fresh);
+    cache_stats.size += fresh_size;
+    cache_stats.entries++;
+
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+void compression_cache_free(void)
+{
+    pthread_mutex_lock(&cache_mutex);
+    while (lru_head) { compression_cache_remove(lru_head); }
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+void compression_cache_get_stats(CompressionCacheStats *stats)
+{
+    pthread_mutex_lock(&cache_mutex);
+    *stats = cache_stats;
+    pthread_mutex_unlock(&cache_mutex);
+}
@@ -8,19 +8,40 @@
  * 
  */
 #include <errno.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "ssfhs.h"
 
-static char* config_resolve_path_raw(char *path)
+static _Atomic(ServerConfig *) current = NULL;
+static _Atomic(ServerConfig *) *readers = NULL;    // The config every thread is using
+static int reader_count = 0;
+static _Thread_local ServerConfig *pinned = NULL;
+
+// Startup errors go to stderr, the ones of a reload to the log as well
+static void config_error(const char *format, ...)
+{
+    char buffer[LOG_BUFFER_SIZE];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+
+    if (atomic_load(&current)) { log_error(0, "%s", buffer); }
+    else { fputs(buffer, stderr); }
+}
+
+static char* config_resolve_path_raw(const ServerConfig *config, char *path)
 {
     // Get the directory of the config file
-    char *sep = strrchr(g_server_config.config_file, '/');
+    char *sep = strrchr(config->config_file, '/');
     if (!sep) { return NULL; }
-    int len = sep - g_server_config.config_file + 1;  // +1 for separator
+    int len = sep - config->config_file + 1;  // +1 for separator
     char *dir = malloc(len + 1);
-    memcpy(dir, g_server_config.config_file, len);
+    memcpy(dir, config->config_file, len);
     dir[len] = '\0';
 
     // Concatenate and resolve the path
@@ -33,35 +54,76 @@ static char* config_resolve_path_raw(char *path)
     return raw_path;
 }
 
-static char* config_resolve_path(char *path)
+static char* config_resolve_path(const ServerConfig *config, char *path)
 {
-    char *raw_path = config_resolve_path_raw(path);
+    char *raw_path = config_resolve_path_raw(config, path);
     char *real_path = realpath(raw_path, NULL);
 
     free(raw_path);
     return real_path;
 }
 
-void config_load(ServerConfig *config) 
+// "<requests a second>[:<burst>]", the burst defaults to the rate
+static int config_parse_rate_limit(const char *value, RateLimitRule *rule)
+{
+    char *end;
+    long rate = strtol(value, &end, 10);
+    long burst = rate;
+    if (end == value || rate < 0 || rate > INT32_MAX) { return 1; }
+    if (*end == ':')
+    {
+        const char *burst_str = end + 1;
+        burst = strtol(burst_str, &end, 10);
+        if (end == burst_str || burst < 1 || burst > INT32_MAX) { return 1; }
+    }
+    if (*end != '\0') { return 1; }
+
+    rule->rate = rate;
+    rule->burst = (burst) ? burst : 1;
+    return 0;
+}
+
+// Parses the config file into config, returns non-zero if it's invalid
+int config_load(ServerConfig *config) 
 {
     // Setup default configs
     config->dynamic_timeout = DEFAULT_DYNAMIC_TIMEOUT;
     config->request_timeout_ms = DEFAULT_REQUEST_TIMEOUT;
-
-    // Open the configuration file (at this point we know it exists)
-    const char *file_path = (config->config_file) ? config->config_file : "ssfhs.conf";
-    FILE *config_file = fopen(file_path, "r");
-    if (!config_file)
-    {
-        fprintf(stderr, "Could not open config file: %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
-    }
+    config->send_timeout_ms = DEFAULT_SEND_TIMEOUT;
+    config->drain_timeout_ms = DEFAULT_DRAIN_TIMEOUT;
+    config->max_connections = DEFAULT_MAX_CONNECTIONS;
+    config->max_header_size = DEFAULT_MAX_HEADER_SIZE;
+    config->max_header_count = DEFAULT_MAX_HEADER_COUNT;
+    config->max_url_length = DEFAULT_MAX_URL_LENGTH;
+    config->max_body_size = DEFAULT_MAX_BODY_SIZE;
+    config->worker_threads = DEFAULT_WORKER_THREADS;
+    config->dynamic_backend = DYNAMIC_BACKEND_FORK;
+    config->dynamic_workers = DEFAULT_DYNAMIC_WORKERS;
+    config->dynamic_worker_max_requests = DEFAULT_DYNAMIC_WORKER_MAX_REQUESTS;
+    config->dynamic_max_procs = DEFAULT_DYNAMIC_MAX_PROCS;
+    config->dynamic_queue_size = DEFAULT_DYNAMIC_QUEUE_SIZE;
+    config->dynamic_queue_timeout_ms = DEFAULT_DYNAMIC_QUEUE_TIMEOUT;
+    config->compression_level = DEFAULT_COMPRESSION_LEVEL;
+    config->compression_min_size = DEFAULT_COMPRESSION_MIN_SIZE;
+    config->compression_cache_size = DEFAULT_COMPRESSION_CACHE_SIZE;
+    config->directory_listing = true;
+    config->listing_page_size = DEFAULT_LISTING_PAGE_SIZE;
 
     // Initialize config with default values
     string_array_init(&config->protected_files);
     string_array_init(&config->dynamic_files);
+    string_array_init(&config->plugin_files);
+
+    // Open the configuration file (it existed at startup, but might be gone on a reload)
+    FILE *config_file = fopen(config->config_file, "r");
+    if (!config_file)
+    {
+        config_error("Could not open config file: %s\n", strerror(errno));
+        return 1;
+    }
 
     // Parse the lines
+    bool failed = false;
     int line_index = 0;
     for ( ;; )
     {
@@ -90,8 +152,9 @@ void config_load(ServerConfig *config)
         if (sep_ptr == NULL)
         {
             free(line);
-            fprintf(stderr, "Invalid config at line: %d\n", line_index);
-            exit(EXIT_FAILURE);
+            config_error("Invalid config at line: %d\n", line_index);
+            failed = true;
+            break;
         }
         int key_len = (sep_ptr - line);
         char *key = malloc(key_len + 1);
@@ -112,7 +175,7 @@ void config_load(ServerConfig *config)
         // Parse the key
         if (strcmp(key, "PROTECTED") == 0)
         {
-            char *full_path = config_resolve_path(value);
+            char *full_path = config_resolve_path(config, value);
             if (full_path)
             {
                 string_array_add(&config->protected_files, full_path);
@@ -124,13 +187,13 @@ void config_load(ServerConfig *config)
             }
             else
             {
-                fprintf(stderr, "Failed to resolve path: %s (ignored)\n", value);
+                config_error("Failed to resolve path: %s (ignored)\n", value);
             }
         }
 
         else if (strcmp(key, "DYNAMIC") == 0)
         {
-            char *full_path = config_resolve_path(value);
+            char *full_path = config_resolve_path(config, value);
             if (full_path)
             {
                 string_array_add(&config->dynamic_files, full_path);
@@ -142,13 +205,13 @@ void config_load(ServerConfig *config)
             }
             else
             {
-                fprintf(stderr, "Failed to resolve path: %s (ignored)\n", value);
+                config_error("Failed to resolve path: %s (ignored)\n", value);
             }
         }
 
         else if (strcmp(key, "400_PAGE") == 0)
         {
-            config->bad_request_page_file = config_resolve_path(value);
+            config->bad_request_page_file = config_resolve_path(config, value);
             if (config->debug)
             {
                 printf("[CONFIG] 400 Page path set to: %s\n", config->bad_request_page_file);
@@ -157,7 +220,7 @@ void config_load(ServerConfig *config)
 
         else if (strcmp(key, "403_PAGE") == 0)
         {
-            config->forbidden_page_file = config_resolve_path(value);
+            config->forbidden_page_file = config_resolve_path(config, value);
             if (config->debug)
             {
                 printf("[CONFIG] 403 Page path set to: %s\n", config->forbidden_page_file);
@@ -166,7 +229,7 @@ void config_load(ServerConfig *config)
 
         else if (strcmp(key, "404_PAGE") == 0)
         {
-            config->not_found_page_file = config_resolve_path(value);
+            config->not_found_page_file = config_resolve_path(config, value);
             if (config->debug)
             {
                 printf("[CONFIG] 404 Page path set to: %s\n", config->not_found_page_file);
@@ -175,16 +238,25 @@ void config_load(ServerConfig *config)
 
         else if (strcmp(key, "500_PAGE") == 0)
         {
-            config->server_error_page_file = config_resolve_path(value);
+            config->server_error_page_file = config_resolve_path(config, value);
             if (config->debug)
             {
                 printf("[CONFIG] 500 Page path set to: %s\n", config->server_error_page_file);
             }
         }
 
+        else if (strcmp(key, "503_PAGE") == 0)
+        {
+            config->service_unavailable_page_file = config_resolve_path(config, value);
+            if (config->debug)
+            {
+                printf("[CONFIG] 503 Page path set to: %s\n", config->service_unavailable_page_file);
+            }
+        }
+
         else if (strcmp(key, "INDEX_PAGE") == 0)
         {
-            config->index_page_file = config_resolve_path(value);
+            config->index_page_file = config_resolve_path(config, value);
             if (config->debug)
             {
                 printf("[CONFIG] Index Page path set to: %s\n", config->index_page_file);
@@ -196,23 +268,401 @@ void config_load(ServerConfig *config)
             int timeout = atoi(value);
             if (!timeout)
             {
-                fprintf(stderr, "Invalid request timeout: %s\n", value);
-                exit(EXIT_FAILURE);
+                config_error("Invalid request timeout: %s\n", value);
+                failed = true;
+                goto release;
             }
             config->request_timeout_ms = timeout;
         }
 
+        else if (strcmp(key, "SEND_TIMEOUT") == 0)
+        {
+            int timeout = parse_duration_ms(value, 1);
+            if (timeout <= 0)
+            {
+                config_error("Invalid send timeout: %s\n", value);
+                failed = true;
+                goto release;
+            }
+            config->send_timeout_ms = timeout;
+        }
+
+        else if (strcmp(key, "DRAIN_TIMEOUT") == 0)
+        {
+            int timeout = parse_duration_ms(value, 1);
+            if (timeout < 0)
+            {
+                config_error("Invalid drain timeout: %s\n", value);
+                failed = true;
+                goto release;
+            }
+            config->drain_timeout_ms = timeout;
+        }
+
+        else if (strcmp(key, "MAX_CONNECTIONS") == 0)
+        {
+            int count = atoi(value);
+            if (count <= 0)
+            {
+                config_error("Invalid connection limit: %s\n", value);
+                failed = true;
+                goto release;
+            }
+            config->max_connections = count;
+        }
+
+        else if (strcmp(key, "MAX_HEADER_SIZE") == 0)
+        {
+            long size = parse_size_bytes(value);
+            if (size <= 0)
+            {
+                config_error("Invalid header size limit: %s\n", value);
+                failed = true;
+                goto release;
+            }
+            config->max_header_size = size;
+        }
+
+        else if (strcmp(key, "MAX_HEADER_COUNT") == 0)
+        {
+            int count = atoi(value);
+            if (count <= 0)
+            {
+                config_error("Invalid header count limit: %s\n", value);
+                failed = true;
+                goto release;
+            }
+            config->max_header_count = count;
+        }
+
+        else if (strcmp(key, "MAX_URL_LENGTH") == 0)
+        {
+            long length = parse_size_bytes(value);
+            if (length <= 0 || length > INT32_MAX)
+            {
+                config_error("Invalid URL length limit: %s\n", value);
+                failed = true;
+                goto release;
+            }
+            config->max_url_length = length;
+        }
+
+        else if (strcmp(key, "MAX_BODY_SIZE") == 0)
+        {
+            long size = parse_size_bytes(value);
+            if (size < 0)
+            {
+                config_error("Invalid body size limit: %s\n", value);
+                failed = true;
+                goto release;
+            }
+            config->max_body_size = size;
+        }
+
+        else if (strcmp(key, "RATE_LIMIT_STATIC") == 0 || strcmp(key, "RATE_LIMIT_DYNAMIC") == 0)
+        {
+            RateLimitRule *rule = (strcmp(key, "RATE_LIMIT_STATIC") == 0) ?
+                &config->rate_limit_static : &config->rate_limit_dynamic;
+            if (config_parse_rate_limit(value, rule))
+            {
+                config_error("Invalid rate limit (expected <requests a second>[:<burst>]): %s\n", value);
+                failed = true;
+                goto release;
+            }
+        }
+
         else if (strcmp(key, "DYNAMIC_TIMEOUT") == 0)
         {
             int timeout = atoi(value);
             if (!timeout)
             {
-                fprintf(stderr, "Invalid dynamic timeout: %s\n", value);
-                exit(EXIT_FAILURE);
+                config_error("Invalid dynamic timeout: %s\n", value);
+                failed = true;
+                goto release;
             }
             config->dynamic_timeout = timeout;
         }
 
+        else if (strcmp(key, "WORKER_THREADS") == 0)
+        {
+            int threads = atoi(value);
+            if (threads <= 0)
+            {
+                config_error("Invalid worker thread count: %s\n", value);
+                failed = true;
+                goto release;
+            }
+            config->worker_threads = threads;
+        }
+
+        else if (strcmp(key, "DYNAMIC_CACHE") == 0)
+        {
+            // DYNAMIC_CACHE=<ttl>:<command>
+            char *cmd_sep = strchr(value, ':');
+            if (cmd_sep) { *cmd_sep = '\0'; }
+            int ttl = parse_duration_ms(value, 1000);
+            if (!cmd_sep || ttl < 0)
+            {
+                config_error("Invalid dynamic cache rule at line: %d\n", line_index);
+                failed = true;
+                goto release;
+            }
+
+            config->dynamic_cache_rules = realloc(config->dynamic_cache_rules,
+                (config->dynamic_cache_rule_count + 1) * sizeof(DynamicCacheRule));
+            DynamicCacheRule *rule = &config->dynamic_cache_rules[config->dynamic_cache_rule_count++];
+            rule->cmd = strtrim(cmd_sep + 1);
+            rule->ttl_ms = ttl;
+            if (config->debug)
+            {
+                printf("[CONFIG] Caching output of \"%s\" for %dms\n", rule->cmd, rule->ttl_ms);
+            }
+        }
+
+        else if (strcmp(key, "CACHE") == 0)
+        {
+            // CACHE=<pattern>:<Cache-Control value>
+            char *sep = strchr(value, ':');
+            if (!sep || sep == value || sep[1] == '\0')
+            {
+                config_error("Invalid cache rule (expected <pattern>:<directives>) at line: %d\n", 
+                    line_index);
+                failed = true;
+                goto release;
+            }
+            *sep = '\0';
+
+            config->cache_control_rules = realloc(config->cache_control_rules,
+                (config->cache_control_rule_count + 1) * sizeof(CacheControlRule));
+            CacheControlRule *rule = &config->cache_control_rules[config->cache_control_rule_count++];
+
+            // The URLs are matched without the leading slash
+            rule->pattern = strtrim(value + (value[0] == '/'));
+            char *directives = strtrim(sep + 1);
+            rule->header = malloc(strlen(directives) + 18);
+            sprintf(rule->header, "Cache-Control: %s\r\n", directives);
+
+            const char *max_age = strstr(directives, "max-age=");
+            rule->max_age = (max_age) ? atoi(max_age + 8) : -1;
+            free(directives);
+
+            if (config->debug)
+            {
+                printf("[CONFIG] Cache rule \"%s\" -> %s", rule->pattern, rule->header);
+            }
+        }
+
+        else if (strcmp(key, "DYNAMIC_BACKEND") == 0)
+        {
+            if (strcmp(value, "fork") == 0)
+            {
+                config->dynamic_backend = DYNAMIC_BACKEND_FORK;
+            }
+            else if (strcmp(value, "worker") == 0)
+            {
+                config->dynamic_backend = DYNAMIC_BACKEND_WORKER;
+            }
+            else
+            {
+                config_error("Invalid dynamic backend: %s\n", value);
+                failed = true;
+                goto release;
+            }
+        }
+
+        else if (strcmp(key, "DYNAMIC_WORKER") == 0)
+        {
+            config->dynamic_worker = config_resolve_path(config, value);
+            if (!config->dynamic_worker)
+            {
+                config_error("Failed to resolve dynamic worker path: %s\n", value);
+                failed = true;
+                goto release;
+            }
+        }
+
+        else if (strcmp(key, "DYNAMIC_WORKERS") == 0)
+        {
+            int count = atoi(value);
+            if (count <= 0)
+            {
+                config_error("Invalid dynamic worker count: %s\n", value);
+                failed = true;
+                goto release;
+            }
+            config->dynamic_workers = count;
+        }
+
+        else if (strcmp(key, "DYNAMIC_WORKER_MAX_REQUESTS") == 0)
+        {
+            int count = atoi(value);
+            if (count <= 0)
+            {
+                config_error("Invalid dynamic worker request limit: %s\n", value);
+                failed = true;
+                goto release;
+            }
+            config->dynamic_worker_max_requests = count;
+        }
+
+        else if (strcmp(key, "DYNAMIC_MAX_PROCS") == 0)
+        {
+            int count = atoi(value);
+            if (count <= 0)
+            {
+                config_error("Invalid dynamic process limit: %s\n", value);
+                failed = true;
+                goto release;
+            }
+            config->dynamic_max_procs = count;
+        }
+
+        else if (strcmp(key, "DYNAMIC_QUEUE_SIZE") == 0)
+        {
+            char *end;
+            long size = strtol(value, &end, 10);
+            if (end == value || *end != '\0' || size < 0)
+            {
+                config_error("Invalid dynamic queue size: %s\n", value);
+                failed = true;
+                goto release;
+            }
+            config->dynamic_queue_size = size;
+        }
+
+        else if (strcmp(key, "DYNAMIC_QUEUE_TIMEOUT") == 0)
+        {
+            int timeout = parse_duration_ms(value, 1);
+            if (timeout < 0)
+            {
+                config_error("Invalid dynamic queue timeout: %s\n", value);
+                failed = true;
+                goto release;
+            }
+            config->dynamic_queue_timeout_ms = timeout;
+        }
+
+        else if (strcmp(key, "STATUS_URL") == 0)
+        {
+            if (value[0] != '/')
+            {
+                config_error("STATUS_URL has to start with '/': %s\n", value);
+                failed = true;
+                goto release;
+            }
+            config->status_url = strdup(value);
+        }
+
+        else if (strcmp(key, "PLUGIN") == 0)
+        {
+            char *full_path = config_resolve_path(config, value);
+            if (!full_path)
+            {
+                config_error("Failed to resolve plugin path: %s\n", value);
+                failed = true;
+                goto release;
+            }
+            string_array_add(&config->plugin_files, full_path);
+            free(full_path);
+        }
+
+        else if (strcmp(key, "PLUGIN_URL") == 0)
+        {
+            // PLUGIN_URL=<url>:<handler>
+            char *sep = strrchr(value, ':');
+            if (!sep || value[0] != '/' || sep[1] == '\0')
+            {
+                config_error("Invalid plugin URL (expected <url>:<handler>): %s\n", value);
+                failed = true;
+                goto release;
+            }
+            *sep = '\0';
+
+            config->plugin_urls = realloc(config->plugin_urls, 
+                (config->plugin_url_count + 1) * sizeof(PluginUrlRule));
+            PluginUrlRule *rule = &config->plugin_urls[config->plugin_url_count++];
+            rule->url = strdup(value);
+            rule->handler = strdup(sep + 1);
+        }
+
+        else if (strcmp(key, "DYNAMIC_STREAMING") == 0)
+        {
+            if (!strcmp(value, "t"))
+            {
+                config->dynamic_streaming = true;
+            }
+        }
+
+        else if (strcmp(key, "DYNAMIC_HEAD") == 0)
+        {
+            if (!strcmp(value, "t"))
+            {
+                config->dynamic_head = true;
+            }
+        }
+
+        else if (strcmp(key, "DIRECTORY_LISTING") == 0)
+        {
+            config->directory_listing = !strcmp(value, "t");
+        }
+
+        else if (strcmp(key, "LISTING_PAGE_SIZE") == 0)
+        {
+            int page_size = atoi(value);
+            if (page_size <= 0)
+            {
+                config_error("Invalid listing page size: %s\n", value);
+                failed = true;
+                goto release;
+            }
+            config->listing_page_size = page_size;
+        }
+
+        else if (strcmp(key, "COMPRESSION") == 0)
+        {
+            if (!strcmp(value, "t"))
+            {
+                config->compression = true;
+            }
+        }
+
+        else if (strcmp(key, "COMPRESSION_LEVEL") == 0)
+        {
+            char *end;
+            long level = strtol(value, &end, 10);
+            if (end == value || *end != '\0' || level < 1 || level > 11)
+            {
+                config_error("Invalid compression level (1-11): %s\n", value);
+                failed = true;
+                goto release;
+            }
+            config->compression_level = level;
+        }
+
+        else if (strcmp(key, "COMPRESSION_MIN_SIZE") == 0)
+        {
+            long size = parse_size_bytes(value);
+            if (size < 0)
+            {
+                config_error("Invalid compression min size: %s\n", value);
+                failed = true;
+                goto release;
+            }
+            config->compression_min_size = size;
+        }
+
+        else if (strcmp(key, "COMPRESSION_CACHE_SIZE") == 0)
+        {
+            long size = parse_size_bytes(value);
+            if (size < 0)
+            {
+                config_error("Invalid compression cache size: %s\n", value);
+                failed = true;
+                goto release;
+            }
+            config->compression_cache_size = size;
+        }
+
         else if (strcmp(key, "IGNORE_DYNAMIC_ERRORS") == 0)
         {
             if (!strcmp(value, "t"))
@@ -227,15 +677,28 @@ void config_load(ServerConfig *config)
         }
 
         // Release the resources
+        release:
         free(key);
         free(value);
         free(line);
 
         if (unknown_token_error)
         {
-            fprintf(stderr, "Invalid config file TOKEN one line: %d\n", line_index);
-            exit(EXIT_FAILURE);
+            config_error("Invalid config file TOKEN one line: %d\n", line_index);
+            failed = true;
         }
+        if (failed) { break; }
+    }
+
+    if (!failed && config->dynamic_backend == DYNAMIC_BACKEND_WORKER && !config->dynamic_worker)
+    {
+        config_error("DYNAMIC_BACKEND=worker requires DYNAMIC_WORKER to be set\n");
+        failed = true;
+    }
+    if (failed)
+    {
+        fclose(config_file);
+        return 1;
     }
 
     // Print debug info
@@ -250,14 +713,42 @@ void config_load(ServerConfig *config)
         printf("    403 page: %s\n", config->forbidden_page_file);
         printf("    404 page: %s\n", config->not_found_page_file);
         printf("    500 page: %s\n", config->server_error_page_file);
+        printf("    503 page: %s\n", config->service_unavailable_page_file);
+        printf("    Status URL: %s\n", config->status_url);
         printf("    Protected files: %ld\n", config->protected_files.count);
         printf("    Dynamic files: %ld\n", config->dynamic_files.count);
+        printf("    Dynamic cache rules: %d\n", config->dynamic_cache_rule_count);
+        printf("    Cache-Control rules: %d\n", config->cache_control_rule_count);
+        printf("    Plugins: %ld (%d URLs)\n", config->plugin_files.count, config->plugin_url_count);
         printf("    Request timeout: %dms\n", config->request_timeout_ms);
+        printf("    Send timeout: %dms\n", config->send_timeout_ms);
+        printf("    Drain timeout: %dms\n", config->drain_timeout_ms);
+        printf("    Limits: %d connections, %zu header bytes, %d headers, %d URL bytes, %zu body bytes\n",
+            config->max_connections, config->max_header_size, config->max_header_count,
+            config->max_url_length, config->max_body_size);
+        printf("    Rate limits: %d/s (burst %d) static, %d/s (burst %d) dynamic\n",
+            config->rate_limit_static.rate, config->rate_limit_static.burst,
+            config->rate_limit_dynamic.rate, config->rate_limit_dynamic.burst);
         printf("    Dynamic timeout: %dms\n", config->dynamic_timeout);
+        printf("    Worker threads: %d\n", config->worker_threads);
         printf("    Ignore dynamic errors: %s\n", config->ignore_dynamic_errors ? "true" : "false");
+        printf("    Dynamic streaming: %s\n", config->dynamic_streaming ? "true" : "false");
+        printf("    Dynamic HEAD: %s\n", config->dynamic_head ? "true" : "false");
+        printf("    Dynamic backend: %s\n", 
+            config->dynamic_backend == DYNAMIC_BACKEND_WORKER ? "worker" : "fork");
+        printf("    Dynamic worker: %s (%d workers, %d jobs each)\n", config->dynamic_worker,
+            config->dynamic_workers, config->dynamic_worker_max_requests);
+        printf("    Dynamic executor: %d processes, %d queued for up to %dms\n",
+            config->dynamic_max_procs, config->dynamic_queue_size, config->dynamic_queue_timeout_ms);
+        printf("    Compression: %s (level %d, from %zu bytes, %zu bytes cached)\n",
+            config->compression ? "true" : "false", config->compression_level,
+            config->compression_min_size, config->compression_cache_size);
+        printf("    Directory listing: %s (%d entries per page)\n",
+            config->directory_listing ? "true" : "false", config->listing_page_size);
     }
 
     fclose(config_file);
+    return 0;
 }
 
 void config_free(ServerConfig *config)
@@ -266,6 +757,7 @@ void config_free(ServerConfig *config)
     if (config->root_dir) { free(config->root_dir); }
     if (config->log_file) { free(config->log_file); }
     if (config->config_file) { free(config->config_file); }
+    if (config->archive_file) { free(config->archive_file); }
 
     // Config file stuff
     if (config->index_page_file) { free(config->index_page_file); }
@@ -273,6 +765,158 @@ void config_free(ServerConfig *config)
     if (config->forbidden_page_file) { free(config->forbidden_page_file); }
     if (config->not_found_page_file) { free(config->not_found_page_file); }
     if (config->server_error_page_file) { free(config->server_error_page_file); }
+    if (config->service_unavailable_page_file) { free(config->service_unavailable_page_file); }
+    if (config->status_url) { free(config->status_url); }
+    if (config->dynamic_worker) { free(config->dynamic_worker); }
     string_array_free(&config->protected_files);
     string_array_free(&config->dynamic_files);
-}
\ No newline at end of file
+    for (int i = 0; i < config->dynamic_cache_rule_count; i++)
+    {
+        free(config->dynamic_cache_rules[i].cmd);
+    }
+    free(config->dynamic_cache_rules);
+    for (int i = 0; i < config->cache_control_rule_count; i++)
+    {
+        free(config->cache_control_rules[i].pattern);
+        free(config->cache_control_rules[i].header);
+    }
+    free(config->cache_control_rules);
+    string_array_free(&config->plugin_files);
+    for (int i = 0; i < config->plugin_url_count; i++)
+    {
+        free(config->plugin_urls[i].url);
+        free(config->plugin_urls[i].handler);
+    }
+    free(config->plugin_urls);
+}
+
+// Makes the loaded config the current one, there are reader_slots indexes for config_enter()
+void config_publish(ServerConfig *config, int reader_slots)
+{
+    reader_count = reader_slots;
+    readers = calloc(reader_count, sizeof(*readers));
+    atomic_store(&current, config);
+}
+
+// The config pinned by this thread, or the current one (g_server_config)
+ServerConfig *config_get(void)
+{
+    return (pinned) ? pinned : atomic_load(&current);
+}
+
+// Pins the current config until config_leave(), a reload doesn't free it in the meantime
+void config_enter(int reader)
+{
+    // Publish it first and check it's still current, otherwise the reload might not see us
+    ServerConfig *config;
+    do {
+        config = atomic_load(&current);
+        atomic_store(&readers[reader], config);
+    } while (config != atomic_load(&current));
+
+    pinned = config;
+}
+
+void config_leave(int reader)
+{
+    atomic_store(&readers[reader], NULL);
+    pinned = NULL;
+}
+
+static bool config_same_string(const char *a, const char *b)
+{
+    if (!a || !b) { return a == b; }
+    return strcmp(a, b) == 0;
+}
+
+static bool config_same_plugins(const ServerConfig *a, const ServerConfig *b)
+{
+    if (a->plugin_files.count != b->plugin_files.count || a->plugin_url_count != b->plugin_url_count)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < a->plugin_files.count; i++)
+    {
+        if (strcmp(a->plugin_files.items[i], b->plugin_files.items[i]) != 0) { return false; }
+    }
+    for (int i = 0; i < a->plugin_url_count; i++)
+    {
+        if (strcmp(a->plugin_urls[i].url, b->plugin_urls[i].url) != 0 ||
+            strcmp(a->plugin_urls[i].handler, b->plugin_urls[i].handler) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The threads, dynamic workers and plugins are set up once, so their settings stay as they were
+static void config_keep_startup_settings(ServerConfig *fresh, ServerConfig *old)
+{
+    if (fresh->worker_threads != old->worker_threads ||
+        fresh->dynamic_backend != old->dynamic_backend ||
+        fresh->dynamic_workers != old->dynamic_workers ||
+        !config_same_string(fresh->dynamic_worker, old->dynamic_worker) ||
+        !config_same_plugins(fresh, old))
+    {
+        log_error(0, "WORKER_THREADS, DYNAMIC_BACKEND, DYNAMIC_WORKER(S) and PLUGIN(_URL) "
+            "only change on restart, keeping the old ones\n");
+    }
+
+    fresh->worker_threads = old->worker_threads;
+    fresh->dynamic_backend = old->dynamic_backend;
+    fresh->dynamic_workers = old->dynamic_workers;
+    free(fresh->dynamic_worker);
+    fresh->dynamic_worker = (old->dynamic_worker) ? strdup(old->dynamic_worker) : NULL;
+
+    // The plugin routes point into the URL rules, so these are handed over instead of copied
+    StringArray plugin_files = fresh->plugin_files;
+    PluginUrlRule *plugin_urls = fresh->plugin_urls;
+    int plugin_url_count = fresh->plugin_url_count;
+    fresh->plugin_files = old->plugin_files;
+    fresh->plugin_urls = old->plugin_urls;
+    fresh->plugin_url_count = old->plugin_url_count;
+    old->plugin_files = plugin_files;
+    old->plugin_urls = plugin_urls;
+    old->plugin_url_count = plugin_url_count;
+}
+
+// Parses the config file again and swaps it in, the old one is kept if the new one is invalid
+int config_reload(void)
+{
+    uint64_t start = now_us();
+    ServerConfig *old = atomic_load(&current);
+
+    // The CLI settings don't change
+    ServerConfig *fresh = calloc(1, sizeof(ServerConfig));
+    fresh->port = old->port;
+    fresh->debug = old->debug;
+    fresh->snapshot = old->snapshot;
+    fresh->root_dir = strdup(old->root_dir);
+    fresh->log_file = strdup(old->log_file);
+    fresh->config_file = strdup(old->config_file);
+    fresh->archive_file = (old->archive_file) ? strdup(old->archive_file) : NULL;
+
+    if (config_load(fresh))
+    {
+        config_free(fresh);
+        free(fresh);
+        return 1;
+    }
+    config_keep_startup_settings(fresh, old);
+    uint64_t parsed = now_us();
+    atomic_store(&current, fresh);
+
+    // Wait for the requests that are still using the old one
+    struct timespec pause = { .tv_sec = 0, .tv_nsec = 1000000 };
+    for (int i = 0; i < reader_count; i++)
+    {
+        while (atomic_load(&readers[i]) == old) { nanosleep(&pause, NULL); }
+    }
+    config_free(old);
+    free(old);
+
+    log_message(0, "Reloaded %s: parsed in %.1fms, %.1fms until the old config was released\n",
+        fresh->config_file, (float)(parsed - start) / 1000.0, (float)(now_us() - parsed) / 1000.0);
+    return 0;
+}
@@ -7,103 +7,150 @@
  * @copyright Copyright (c) 2025
  * 
  */
+#define _GNU_SOURCE  // pipe2()
 #include <errno.h>
+#include <ctype.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <poll.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <time.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
 #include "ssfhs.h"
 
 extern char **environ;
-static const char *opening_tag = "<" DYNAMIC_TAG ">";
-static const char *closing_tag = "</" DYNAMIC_TAG ">";
 
-static int dynamic_extract_commands(const CharVector *vec, StringArray *dyncmds)
+// Snapshot of the server environment, shared by all the dynamic commands
+static char **base_environ = NULL;
+static int base_environ_count = 0;
+
+void dynamic_environment_init(void)
 {
-    const char *ptr = vec->items;
+    while (environ[base_environ_count] != NULL) { base_environ_count++; }
 
-    while (ptr < vec->items + vec->count)
+    base_environ = malloc((base_environ_count + 1) * sizeof(char*));
+    for (int i = 0; i < base_environ_count; i++)
     {
-        // Find the opening tag
-        char *opening = strstr(ptr, opening_tag);
-        if (!opening) { break; }
-        ptr = opening + strlen(opening_tag);
-
-        // Find the closing tag
-        char *closing = strstr(ptr, closing_tag);
-        if (!closing) { return 1; }
-        ptr = closing + strlen(closing_tag);
-
-        // Extract the command
-        size_t index = opening - vec->items + strlen(opening_tag);
-        size_t len = closing - opening - strlen(opening_tag);
-        char *cmd = char_vector_get_alloc(vec, index, len);
-        string_array_add(dyncmds, cmd);
-        free(cmd);
+        base_environ[i] = strdup(environ[i]);
     }
+    base_environ[base_environ_count] = NULL;
+}
 
-    if (g_server_config.debug)
+void dynamic_environment_free(void)
+{
+    for (int i = 0; i < base_environ_count; i++)
     {
-        for (size_t i = 0; i < dyncmds->count; i++)
-        {
-            printf("[DYNAMIC:Extract:%ld] %s\n", i, dyncmds->items[i]);
-        }
+        free(base_environ[i]);
     }
+    free(base_environ);
+    base_environ = NULL;
+    base_environ_count = 0;
+}
 
-    return 0;
+static char* dynamic_format_variable(Arena *arena, const char *name, const char *value, size_t value_len)
+{
+    size_t name_len = strlen(name);
+    char *var = arena_alloc(arena, name_len + value_len + 2);
+    memcpy(var, name, name_len);
+    var[name_len] = '=';
+    memcpy(var + name_len + 1, value, value_len);
+    var[name_len + value_len + 1] = '\0';
+    return var;
 }
 
-static char** dynamic_generate_environment(int request_id, const char *request_str)
+// "Content-Type: x" becomes "HTTP_CONTENT_TYPE=x"
+static char* dynamic_format_header(Arena *arena, const char *key, const char *value)
 {
-    char env_buf[512];
-    char **env = NULL;
+    size_t key_len = strlen(key);
+    size_t value_len = strlen(value);
+    char *var = arena_alloc(arena, 5 + key_len + value_len + 2);
 
-    // Compute the size of the parent environment
-    size_t penv_count = 0;
-    while (environ[penv_count] != NULL)
+    memcpy(var, "HTTP_", 5);
+    for (size_t i = 0; i < key_len; i++)
     {
-        penv_count++;
+        unsigned char c = key[i];
+        var[5 + i] = isalnum(c) ? toupper(c) : '_';
     }
+    var[5 + key_len] = '=';
+    memcpy(var + 5 + key_len + 1, value, value_len + 1);
+    return var;
+}
+
+// Per request variables (the request is NULL for the error pages)
+static char** dynamic_request_variables(int request_id, Arena *arena, const HTTPRequest *request, int *count)
+{
+    int header_count = (request) ? request->header_keys.count : 0;
+    char **vars = arena_alloc(arena, (8 + header_count) * sizeof(char*));
+    char buffer[32];
+    int n = 0;
 
-    // Allocate memory for the child environment
-    // +1 for the NULL terminator, +2 for ID and REQUEST_STR
-    env = malloc((penv_count + 3) * sizeof(char *));
-    if (!env) { return NULL; }
+    snprintf(buffer, sizeof(buffer), "%d", request_id);
+    vars[n++] = dynamic_format_variable(arena, "REQUEST_ID", buffer, strlen(buffer));
 
-    // Copy the parent environment
-    for (size_t i = 0; i < penv_count; i++)
+    if (!request)
     {
-        env[i] = strdup(environ[i]);
+        vars[n++] = dynamic_format_variable(arena, "REQUEST_STR", "", 0);
+        *count = n;
+        return vars;
     }
 
-    // Add REQUEST_STR
-    const char *req_var_name = "REQUEST_STR";
-    char *req_str_buf = malloc(strlen(req_var_name) + strlen(request_str) + 2);
-    if (!req_str_buf) { return NULL; }
-    sprintf(req_str_buf, "%s=%s", req_var_name, request_str);
-    env[penv_count] = req_str_buf;
+    vars[n++] = dynamic_format_variable(arena, "REQUEST_STR", request->raw, strlen(request->raw));
+    vars[n++] = dynamic_format_variable(arena, "REQUEST_METHOD", request->method, strlen(request->method));
+    vars[n++] = dynamic_format_variable(arena, "REQUEST_URI", request->url, strlen(request->url));
+    vars[n++] = dynamic_format_variable(arena, "QUERY_STRING", request->query, strlen(request->query));
+    vars[n++] = dynamic_format_variable(arena, "REQUEST_BODY", request->data, request->data_len);
+    if (request->remote_addr)
+    {
+        vars[n++] = dynamic_format_variable(arena, "REMOTE_ADDR", 
+            request->remote_addr, strlen(request->remote_addr));
+    }
 
-    // Add REQUEST_ID
-    snprintf(env_buf, sizeof(env_buf) - 1, "REQUEST_ID=%d", request_id);
-    env[penv_count + 1] = strdup(env_buf);
+    for (int i = 0; i < header_count; i++)
+    {
+        // HTTP_PROXY would send the commands' HTTP requests through the client's proxy (httpoxy)
+        if (strcasecmp(request->header_keys.items[i], "Proxy") == 0) { continue; }
+        vars[n++] = dynamic_format_header(arena, 
+            request->header_keys.items[i], request->header_values.items[i]);
+    }
 
-    // Add NULL terminator
-    env[penv_count + 2] = NULL;
+    *count = n;
+    return vars;
+}
 
+// The base environment followed by the request variables, only the array is allocated
+static char** dynamic_generate_environment(Arena *arena, char **vars, int var_count)
+{
+    char **env = arena_alloc(arena, (base_environ_count + var_count + 1) * sizeof(char*));
+    memcpy(env, base_environ, base_environ_count * sizeof(char*));
+    memcpy(env + base_environ_count, vars, var_count * sizeof(char*));
+    env[base_environ_count + var_count] = NULL;
     return env;
 }
 
+static void dynamic_close_fd(int *fd)
+{
+    if (*fd >= 0)
+    {
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+// The pipes are CLOEXEC so the commands of other requests don't keep them open
 static int dynamic_open_pipes(DynamicSubprocesses *dsp)
 {
     for (int i = 0; i < dsp->count; i++)
     {
         DynamicSubprocess *p = &dsp->processes[i];
-        int res1 = pipe(p->pipe_err_fd);
-        int res2 = pipe(p->pipe_out_fd);
+        int res1 = pipe2(p->pipe_err_fd, O_CLOEXEC);
+        int res2 = pipe2(p->pipe_out_fd, O_CLOEXEC);
         if (res1 == -1 || res2 == -1) 
         {
             log_error(dsp->request_id, "Failed to open pipe for dynamic command: %s\n", 
@@ -131,25 +178,22 @@ static int dynamic_create_forks(DynamicSubprocesses *dsp, char **child_environ)
         {
             log_error(dsp->request_id, "Failed to fork for dynamic command: %s\n", 
                 strerror(errno));
-            close(p->pipe_out_fd[0]);
-            close(p->pipe_out_fd[1]);
-            close(p->pipe_err_fd[0]);
-            close(p->pipe_err_fd[1]);
+            dynamic_close_fd(&p->pipe_out_fd[0]);
+            dynamic_close_fd(&p->pipe_out_fd[1]);
+            dynamic_close_fd(&p->pipe_err_fd[0]);
+            dynamic_close_fd(&p->pipe_err_fd[1]);
+            p->exited = true;
             p->status = -1;
             continue;
         }
 
-        char_vector_init(&p->out_vec, 2048);
-        char_vector_init(&p->err_vec, 2048);
-
         if (!p->pid) 
         {
-            close(p->pipe_out_fd[0]); // close read end
-            close(p->pipe_err_fd[0]); // close reaprocesses[i].d end
             dup2(p->pipe_out_fd[1], STDOUT_FILENO);  // redirect stdout
             dup2(p->pipe_err_fd[1], STDERR_FILENO);  // redirect stderr
-            close(p->pipe_out_fd[1]);
-            close(p->pipe_err_fd[1]);
+
+            // The server ignores SIGPIPE, the commands shouldn't
+            signal(SIGPIPE, SIG_DFL);
 
             // Change to server root dir
             chdir(g_server_config.root_dir);
@@ -157,6 +201,18 @@ static int dynamic_create_forks(DynamicSubprocesses *dsp, char **child_environ)
             _exit(127); // only reached if exec fails
         }
 
+        // Only the child writes into the pipes
+        dynamic_close_fd(&p->pipe_out_fd[1]);
+        dynamic_close_fd(&p->pipe_err_fd[1]);
+
+        // Get notified through a descriptor when the process exits
+        p->pidfd = syscall(SYS_pidfd_open, p->pid, 0);
+        if (p->pidfd < 0 && g_server_config.debug)
+        {
+            printf("[Dynamic:Execute:%d] pidfd_open failed, falling back to polling: %s\n",
+                index, strerror(errno));
+        }
+
         if (g_server_config.debug)
         {
             printf("[Dynamic:Execute:%d] Created fork, PID: %d\n", index, p->pid);
@@ -166,46 +222,113 @@ static int dynamic_create_forks(DynamicSubprocesses *dsp, char **child_environ)
     return 0;
 }
 
+// Reads whatever is in the pipe, closes it on EOF
+static void dynamic_drain_pipe(int *fd, CharVector *vec)
+{
+    for ( ;; )
+    {
+        char_vector_reserve(vec, 4096);
+        ssize_t n = read(*fd, &vec->items[vec->count], vec->max_size - vec->count - 1);
+        if (n > 0)
+        {
+            char_vector_commit(vec, n);
+            continue;
+        }
+        if (n == 0) { dynamic_close_fd(fd); }
+        break;
+    }
+}
+
+// Notices the exit without reaping, the pid must not be reused while the deadline might still kill it
+static void dynamic_check_exited(DynamicSubprocess *p)
+{
+    siginfo_t info;
+    info.si_pid = 0;
+    if (waitid(P_PID, p->pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == p->pid)
+    {
+        p->exited = true;
+        p->status = (info.si_code == CLD_EXITED) ? info.si_status : -1;
+        dynamic_close_fd(&p->pidfd);
+    }
+}
+
+// Called from the timer thread, the processes that exited already are zombies until the cleanup
+static void dynamic_deadline_passed(void *ctx)
+{
+    DynamicSubprocesses *dsp = ctx;
+    atomic_store(&dsp->timed_out, true);
+    for (int i = 0; i < dsp->count; i++)
+    {
+        if (dsp->processes[i].pid > 0) { kill(dsp->processes[i].pid, SIGKILL); }
+    }
+}
+
+// Waits for the output and the exits in a single poll(), the deadline kills what's still running
 static int dynamic_poll_pipes(DynamicSubprocesses *dsp)
 {
-    char buf[1024];
-    ssize_t n;
+    // Up to 3 descriptors per process: stdout, stderr and the pidfd
+    struct pollfd pfds[3 * dsp->count];
+    timer_arm(&dsp->deadline, g_server_config.dynamic_timeout, dynamic_deadline_passed, dsp);
 
-    uint64_t start_ms = now_ms();
-    int completed_processes = 0;
-    while ((int)(now_ms() - start_ms) < g_server_config.dynamic_timeout)
+    for ( ;; )
     {
+        // Collect the descriptors of the running processes
+        int nfds = 0, running = 0;
+        bool need_polling = false;
         for (int i = 0; i < dsp->count; i++)
         {
             DynamicSubprocess *p = &dsp->processes[i];
+            if (p->exited) { continue; }
+            running++;
 
-            // Read the out pipe
-            while ((n = read(p->pipe_out_fd[0], buf, 1024)) > 0)
+            int fds[3] = { p->pipe_out_fd[0], p->pipe_err_fd[0], p->pidfd };
+            for (int j = 0; j < 3; j++)
             {
-                char_vector_push_arr(&p->out_vec, buf, n);
+                if (fds[j] < 0) { continue; }
+                pfds[nfds].fd = fds[j];
+                pfds[nfds].events = POLLIN;
+                pfds[nfds].revents = 0;
+                nfds++;
             }
+            need_polling |= (p->pidfd < 0);
+        }
+        if (running == 0) { break; }
 
-            // Read the error pipe
-            while ((n = read(p->pipe_err_fd[0], buf, 1024)) > 0)
-            {
-                char_vector_push_arr(&p->out_vec, buf, n);
-            }
+        int timeout = (need_polling) ? SUBPROCESS_POLL_GRANULARITY_MS : -1;
+        if (poll(pfds, nfds, timeout) < 0 && errno != EINTR)
+        {
+            log_error(dsp->request_id, "Something went wrong while polling subprocesses: %s\n",
+                strerror(errno));
+            return 1;
+        }
 
-            int status = 0;
-            int res = waitpid(p->pid, &status, WNOHANG);
-            if (res > 0)
+        // Read the output first so nothing is lost when the process exits
+        for (int i = 0; i < dsp->count; i++)
+        {
+            DynamicSubprocess *p = &dsp->processes[i];
+            if (p->exited) { continue; }
+            if (p->pipe_out_fd[0] >= 0) { dynamic_drain_pipe(&p->pipe_out_fd[0], &p->out_vec); }
+            if (p->pipe_err_fd[0] >= 0) { dynamic_drain_pipe(&p->pipe_err_fd[0], &p->err_vec); }
+            dynamic_check_exited(p);
+
+            // Let the streaming know (with whatever was written right before the exit)
+            if (p->exited && dsp->progress && !(p->status < 0 && atomic_load(&dsp->timed_out)))
             {
-                completed_processes ++;
+                if (p->pipe_out_fd[0] >= 0) { dynamic_drain_pipe(&p->pipe_out_fd[0], &p->out_vec); }
+                dsp->progress->done(dsp->progress->ctx, dsp->progress->base + i,
+                    p->out_vec.items, p->out_vec.count, p->status);
             }
         }
+    }
 
-        // Sleep for a bit before polling again
-        usleep(SUBPROCESS_POLL_GRANULARITY_MS * 1000);
+    timer_cancel(&dsp->deadline);
 
-        if (completed_processes == dsp->count)
-        {
-            break;
-        }
+    // Anything written right before the exit
+    for (int i = 0; i < dsp->count; i++)
+    {
+        DynamicSubprocess *p = &dsp->processes[i];
+        if (p->pipe_out_fd[0] >= 0) { dynamic_drain_pipe(&p->pipe_out_fd[0], &p->out_vec); }
+        if (p->pipe_err_fd[0] >= 0) { dynamic_drain_pipe(&p->pipe_err_fd[0], &p->err_vec); }
     }
 
     return 0;
@@ -219,19 +342,17 @@ static int dynamic_check_exit_codes(DynamicSubprocesses *dsp)
     {
         DynamicSubprocess *p = &dsp->processes[i];
 
-        // Check if the process finished execution
-        int status = 0;
-        pid_t result = waitpid(p->pid, &status, WNOHANG);
-        if (result == 0)
+        // Killed by the deadline
+        if (p->pid > 0 && p->status < 0 && atomic_load(&dsp->timed_out))
         {
             log_error(dsp->request_id, "Dynamic command %d (pid: %d) did not finish in time and was killed.\n",
                 i, p->pid);
-            kill(p->pid, SIGKILL);
             error = true;
             continue;
         }
 
         // Check the exit code
+        int status = p->status;
         if (status != 0)
         {
             if (g_server_config.ignore_dynamic_errors)
@@ -264,137 +385,418 @@ static int dynamic_check_exit_codes(DynamicSubprocesses *dsp)
     return error;
 }
 
-static int dynamic_copy_outputs(DynamicSubprocesses *dsp, char **outputs)
+// The output buffers are handed over to the arena (no copies)
+static int dynamic_copy_outputs(DynamicSubprocesses *dsp, Arena *arena, struct iovec *outputs, int *statuses)
 {
     for (int i = 0; i < dsp->count; i++)
     {
-        outputs[i] = strdup(dsp->processes[i].out_vec.items);
+        CharVector *out = &dsp->processes[i].out_vec;
+        statuses[i] = dsp->processes[i].status;
+        if (arena_adopt(arena, out->items)) { return 1; }
+        outputs[i].iov_base = out->items;
+        outputs[i].iov_len = out->count;
+        out->items = NULL;
     }
     return 0;
 }
 
 static void dynamic_cleanup_processes(DynamicSubprocesses *dsp)
 {
+    // The pids are only given back once nothing is going to kill them anymore
+    timer_cancel(&dsp->deadline);
     for (int i = 0; i < dsp->count; i++)
     {
         DynamicSubprocess *p = &dsp->processes[i];
+
+        // Don't leave zombies behind (or running processes if we bailed out early)
+        if (p->pid > 0)
+        {
+            if (!p->exited) { kill(p->pid, SIGKILL); }
+            waitpid(p->pid, NULL, 0);
+        }
+
         char_vector_free(&p->out_vec);
         char_vector_free(&p->err_vec);
-        close(p->pipe_out_fd[0]);
-        close(p->pipe_out_fd[1]);
-        close(p->pipe_err_fd[0]);
-        close(p->pipe_err_fd[1]);
+        dynamic_close_fd(&p->pipe_out_fd[0]);
+        dynamic_close_fd(&p->pipe_out_fd[1]);
+        dynamic_close_fd(&p->pipe_err_fd[0]);
+        dynamic_close_fd(&p->pipe_err_fd[1]);
+        dynamic_close_fd(&p->pidfd);
     }
-    free(dsp->processes);
 }
 
-static int dynamic_execute_commands(int request_id, const StringArray *cmds, char **outputs, const char *request_str)
+static int dynamic_run_batch(int request_id, Arena *arena, const char **cmds, int count, 
+    struct iovec *outputs, int *statuses, char **vars, int var_count, const DynamicProgress *progress)
 {
-    DynamicSubprocesses dsp;
+    // The workers get only the request variables, the rest they inherited on startup
+    if (g_server_config.dynamic_backend == DYNAMIC_BACKEND_WORKER)
+    {
+        return dynamic_workers_execute(request_id, arena, cmds, count, outputs, statuses, 
+            vars, var_count, progress);
+    }
+
+    DynamicSubprocesses dsp = { 0 };
 
-    size_t process_alloc_size = cmds->count * sizeof(DynamicSubprocess);
-    dsp.processes = malloc(process_alloc_size);
-    dsp.count = cmds->count;
+    size_t process_alloc_size = count * sizeof(DynamicSubprocess);
+    dsp.processes = arena_alloc(arena, process_alloc_size);
+    dsp.count = count;
     dsp.request_id = request_id;
-    memset(dsp.processes, 0, cmds->count * sizeof(DynamicSubprocess));
-    for (size_t i = 0; i < cmds->count; i++)
+    dsp.progress = progress;
+    memset(dsp.processes, 0, process_alloc_size);
+    for (int i = 0; i < count; i++)
     {
-        dsp.processes[i].cmd = cmds->items[i];
+        DynamicSubprocess *p = &dsp.processes[i];
+        p->cmd = cmds[i];
+        p->pid = -1;
+        p->pidfd = -1;
+        p->pipe_out_fd[0] = p->pipe_out_fd[1] = -1;
+        p->pipe_err_fd[0] = p->pipe_err_fd[1] = -1;
+        char_vector_init(&p->out_vec, 2048);
+        char_vector_init(&p->err_vec, 256);
     }
 
-    char **child_environ = dynamic_generate_environment(request_id, request_str);
+    char **child_environ = dynamic_generate_environment(arena, vars, var_count);
     
     bool error =
         dynamic_open_pipes(&dsp) ||
         dynamic_create_forks(&dsp, child_environ) ||
         dynamic_poll_pipes(&dsp) ||
         dynamic_check_exit_codes(&dsp) ||
-        dynamic_copy_outputs(&dsp, outputs);
+        dynamic_copy_outputs(&dsp, arena, outputs, statuses);
 
     dynamic_cleanup_processes(&dsp);
     return error;
 }
 
-static int dynamic_extract_replace(const CharVector *in_vec, CharVector *out_vec, char **outputs)
+// Runs the commands in batches of the slots granted by the executor
+static int dynamic_execute_commands(int request_id, Arena *arena, const char **cmds, int count, 
+    struct iovec *outputs, int *statuses, char **vars, int var_count, const DynamicProgress *progress)
 {
-    const char *ptr = in_vec->items;
+    int slots;
+    int result = dynamic_executor_acquire(request_id, count, &slots);
+    if (result) { return result; }
+    if (progress) { progress->started(progress->ctx); }
 
-    int index = 0;
-    while (ptr < in_vec->items + in_vec->count)
+    for (int start = 0; start < count && !result; start += slots)
     {
-        const char *tptr = ptr;
-
-        // Find the opening tag
-        char *opening = strstr(tptr, opening_tag);
-        if (!opening) { break; }
-        tptr = opening + strlen(opening_tag);
+        int batch = (count - start < slots) ? count - start : slots;
+        DynamicProgress batch_progress;
+        if (progress)
+        {
+            batch_progress = *progress;
+            batch_progress.base = start;
+        }
+        result = dynamic_run_batch(request_id, arena, &cmds[start], batch, 
+            &outputs[start], &statuses[start], vars, var_count, (progress) ? &batch_progress : NULL);
+    }
 
-        // Find the closing tag
-        char *closing = strstr(tptr, closing_tag);
-        if (!closing) { return 1; }
-        tptr = closing + strlen(closing_tag);
+    dynamic_executor_release(slots);
+    return result;
+}
 
-        // Copy the text up to the opening tag and the output
-        char_vector_push_arr(out_vec, ptr, opening - ptr);
-        char_vector_push_arr(out_vec, outputs[index], strlen(outputs[index]));
+// Looks the variable up in the request variables and then in the server environment
+static const char* dynamic_lookup_variable(const char *name, char **vars, int var_count)
+{
+    size_t name_len = strlen(name);
+    for (int i = 0; i < var_count; i++)
+    {
+        if (strncmp(vars[i], name, name_len) == 0 && vars[i][name_len] == '=')
+        {
+            return vars[i] + name_len + 1;
+        }
+    }
+    for (int i = 0; i < base_environ_count; i++)
+    {
+        if (strncmp(base_environ[i], name, name_len) == 0 && base_environ[i][name_len] == '=')
+        {
+            return base_environ[i] + name_len + 1;
+        }
+    }
+    return "";
+}
 
-        // Move the pointer and increment index
-        ptr = tptr;
-        index ++;
+static void dynamic_html_escape(Arena *arena, const char *value, struct iovec *output)
+{
+    // Worst case every character becomes "&quot;"
+    size_t len = strlen(value);
+    char *out = arena_alloc(arena, len * 6 + 1);
+    char *ptr = out;
+    for (size_t i = 0; i < len; i++)
+    {
+        const char *entity = NULL;
+        switch (value[i])
+        {
+            case '&':  entity = "&amp;";  break;
+            case '<':  entity = "&lt;";   break;
+            case '>':  entity = "&gt;";   break;
+            case '"':  entity = "&quot;"; break;
+            case '\'': entity = "&#39;";  break;
+            default:   *ptr++ = value[i]; continue;
+        }
+        size_t entity_len = strlen(entity);
+        memcpy(ptr, entity, entity_len);
+        ptr += entity_len;
     }
+    *ptr = '\0';
 
-    // Copy the remaining text
-    char_vector_push_arr(out_vec, ptr, strlen(ptr));
+    output->iov_base = out;
+    output->iov_len = ptr - out;
+}
 
-    if (g_server_config.debug)
+// Evaluates the built in directives inside the server (no processes are created)
+static int dynamic_evaluate_directive(int request_id, Arena *arena, const TemplateSegment *seg,
+    const HTTPRequest *request, char **vars, int var_count, struct iovec *output)
+{
+    output->iov_base = NULL;
+    output->iov_len = 0;
+
+    if (seg->type == SEGMENT_INCLUDE)
+    {
+        // Included files are confined to the root dir (the protected ones are fine)
+        char url[PATH_MAX];
+        snprintf(url, sizeof(url), "%s%s", (seg->text[0] == '/') ? "" : "/", seg->text);
+        const char *path = resource_resolve_url_path(arena, url);
+        DynamicTemplate *file = (path) ? template_acquire_raw(path) : NULL;
+        if (!file)
+        {
+            log_error(request_id, "Could not include file: %s\n", seg->text);
+            return 1;
+        }
+        arena_defer(arena, template_release, file);
+        output->iov_base = file->text;
+        output->iov_len = file->text_len;
+    }
+    else if (seg->type == SEGMENT_VAR)
+    {
+        const char *value = dynamic_lookup_variable(seg->text, vars, var_count);
+        if (seg->escape)
+        {
+            dynamic_html_escape(arena, value, output);
+        }
+        else
+        {
+            output->iov_base = (void*)value;
+            output->iov_len = strlen(value);
+        }
+    }
+    else if (seg->type == SEGMENT_PLUGIN)
     {
-        printf("[DYNAMIC:Replace] Replaced %d dynamic tags.\n", index);
+        // The output is handed over to the arena like the outputs of the commands
+        CharVector out;
+        char_vector_init(&out, 1024);
+        if (plugin_run(request_id, seg->handler, request, &out, NULL))
+        {
+            char_vector_free(&out);
+            return 1;
+        }
+        arena_adopt(arena, out.items);
+        output->iov_base = out.items;
+        output->iov_len = out.count;
+    }
+    else if (seg->type == SEGMENT_DATE)
+    {
+        time_t now = time(NULL);
+        struct tm local;
+        localtime_r(&now, &local);
+        char *buffer = arena_alloc(arena, 256);
+        output->iov_base = buffer;
+        output->iov_len = strftime(buffer, 256, seg->text, &local);
     }
 
     return 0;
 }
 
+// State of a page that is sent while its commands are still running
+typedef struct {
+    HTTPResponse *response;
+    Arena *arena;
+    const DynamicTemplate *tmpl;
+    const char *content_type;
+    struct iovec *parts;        // By segment index
+    bool *ready;
+    const int *run_segment;     // Executed command -> segment index
+    int next_segment;           // First segment that wasn't sent yet
+    bool failed;
+} DynamicStream;
+
+// Sends everything up to the first command that didn't finish yet
+static void dynamic_stream_flush(DynamicStream *stream)
+{
+    struct iovec iov[SEND_IOV_BATCH - 2];
+    int count = 0;
+
+    while (!stream->failed && stream->next_segment < stream->tmpl->segment_count)
+    {
+        if (!stream->ready[stream->next_segment]) { break; }
+        iov[count++] = stream->parts[stream->next_segment++];
+
+        if (count == SEND_IOV_BATCH - 2)
+        {
+            stream->failed = http_response_stream_write(stream->response, iov, count);
+            count = 0;
+        }
+    }
+
+    if (count && !stream->failed)
+    {
+        stream->failed = http_response_stream_write(stream->response, iov, count);
+    }
+}
+
+// The executor admitted the request, send the head and everything up to the first command
+static void dynamic_stream_started(void *ctx)
+{
+    DynamicStream *stream = ctx;
+    stream->failed = http_response_stream_start(stream->response, stream->content_type);
+    dynamic_stream_flush(stream);
+}
 
-// Replaces the buffers (deallocates old ones and allocates new ones)
-int dynamic_process(int request_id, void **buff, size_t *buffsz, const char *request_str)
+static void dynamic_stream_done(void *ctx, int index, const void *data, size_t len, int status)
 {
-    // Copy the buffer into a vector
-    CharVector vec;
-    char_vector_init(&vec, *buffsz + 1);
-    char_vector_push_arr(&vec, *buff, *buffsz);
+    DynamicStream *stream = ctx;
+    int seg = stream->run_segment[index];
+    if (status != 0 && !g_server_config.ignore_dynamic_errors)
+    {
+        stream->failed = true;
+        return;
+    }
 
-    // Extract the commands
-    StringArray dyncmds;
-    string_array_init(&dyncmds);
-    dynamic_extract_commands(&vec, &dyncmds);
+    stream->parts[seg].iov_base = (void*)data;
+    stream->parts[seg].iov_len = len;
+    stream->ready[seg] = true;
+    dynamic_stream_flush(stream);
+
+    // Keep a copy if it has to wait for the commands before it
+    if (!stream->failed && seg >= stream->next_segment)
+    {
+        void *copy = arena_alloc(stream->arena, len);
+        memcpy(copy, data, len);
+        stream->parts[seg].iov_base = copy;
+    }
+}
+
+// Appends the template to the response as parts, the literals are not copied
+//  (the template is released when the arena resets)
+int dynamic_process(int request_id, Arena *arena, HTTPResponse *response, const char *path, 
+    const HTTPRequest *request)
+{
+    DynamicTemplate *tmpl = template_acquire(path);
+    if (!tmpl) { return 1; }
+    if (arena_defer(arena, template_release, tmpl))
+    {
+        template_release(tmpl);
+        return 1;
+    }
+
+    if (g_server_config.debug)
+    {
+        for (int i = 0; i < tmpl->segment_count; i++)
+        {
+            if (tmpl->segments[i].type == SEGMENT_COMMAND)
+            {
+                printf("[DYNAMIC:Extract:%d] %s\n", i, tmpl->segments[i].text);
+            }
+        }
+    }
+
+    int var_count;
+    char **vars = dynamic_request_variables(request_id, arena, request, &var_count);
+
+    // Fill in the literals, the directives and the cached outputs, the rest has to be executed
+    struct iovec *parts = arena_alloc(arena, tmpl->segment_count * sizeof(struct iovec));
+    bool *ready = arena_alloc(arena, tmpl->segment_count * sizeof(bool));
+    const char **run_cmds = arena_alloc(arena, tmpl->command_count * sizeof(char*));
+    int *run_segment = arena_alloc(arena, tmpl->command_count * sizeof(int));
+    int run_count = 0;
+    for (int i = 0; i < tmpl->segment_count; i++)
+    {
+        const TemplateSegment *seg = &tmpl->segments[i];
+        ready[i] = true;
+
+        if (seg->type == SEGMENT_LITERAL)
+        {
+            parts[i].iov_base = (void*)seg->text;
+            parts[i].iov_len = seg->len;
+        }
+        else if (seg->type != SEGMENT_COMMAND)
+        {
+            if (dynamic_evaluate_directive(request_id, arena, seg, request, vars, var_count, &parts[i]) &&
+                !g_server_config.ignore_dynamic_errors)
+            {
+                return 1;
+            }
+        }
+        else if (!seg->cache_ms || !dynamic_cache_get(arena, seg->text, &parts[i]))
+        {
+            run_cmds[run_count] = seg->text;
+            run_segment[run_count] = i;
+            run_count++;
+            ready[i] = false;
+        }
+    }
+
+    // Stream the page if there's something to wait for
+    DynamicStream stream;
+    DynamicProgress progress;
+    bool streaming = g_server_config.dynamic_streaming && response->write && request && run_count;
+    if (streaming)
+    {
+        memset(&stream, 0, sizeof(stream));
+        stream.response = response;
+        stream.arena = arena;
+        stream.tmpl = tmpl;
+        stream.content_type = resource_get_content_type(path);
+        stream.parts = parts;
+        stream.ready = ready;
+        stream.run_segment = run_segment;
+
+        progress.started = dynamic_stream_started;
+        progress.done = dynamic_stream_done;
+        progress.ctx = &stream;
+        progress.base = 0;
+    }
 
     // Execute the commands
-    bool exit_error = false;
-    char **outputs = malloc(dyncmds.count * sizeof(char*));
-    memset(outputs, 0, dyncmds.count * sizeof(char*));
-    if (dynamic_execute_commands(request_id, &dyncmds, outputs, request_str))
+    struct iovec *run_outputs = arena_alloc(arena, run_count * sizeof(struct iovec));
+    int *run_statuses = arena_alloc(arena, run_count * sizeof(int));
+    if (run_count)
     {
-        exit_error = true;
-        goto exit;
+        int result = dynamic_execute_commands(request_id, arena, run_cmds, run_count, 
+            run_outputs, run_statuses, vars, var_count, (streaming) ? &progress : NULL);
+        if (result) { return (response->streaming) ? 1 : result; }
     }
 
-    // Replace the tags with command outputs
-    CharVector replvec;
-    char_vector_init(&replvec, *buffsz + 1);
-    dynamic_extract_replace(&vec, &replvec, outputs);
+    // Place the outputs and cache the successful ones
+    for (int i = 0; i < run_count; i++)
+    {
+        const TemplateSegment *seg = &tmpl->segments[run_segment[i]];
+        parts[run_segment[i]] = run_outputs[i];
+        ready[run_segment[i]] = true;
+        if (seg->cache_ms && run_statuses[i] == 0)
+        {
+            dynamic_cache_put(run_cmds[i], seg->cache_ms, 
+                run_outputs[i].iov_base, run_outputs[i].iov_len);
+        }
+    }
+
+    // Send the rest, the body is terminated only if nothing went wrong
+    if (streaming)
+    {
+        dynamic_stream_flush(&stream);
+        if (!stream.failed) { stream.failed = http_response_stream_end(response); }
+        return stream.failed;
+    }
 
-    // Replace the buffer and cleanup
-    free(*buff);
-    *buff = replvec.items;
-    *buffsz = replvec.count;
+    // Splice the literals and the outputs
+    for (int i = 0; i < tmpl->segment_count; i++)
+    {
+        http_response_add_part(response, arena, parts[i].iov_base, parts[i].iov_len);
+    }
 
-    exit:
-    for (size_t i = 0; i < dyncmds.count; i++)
+    if (g_server_config.debug)
     {
-        free(outputs[i]);
+        printf("[DYNAMIC:Replace] Replaced %d dynamic tags.\n", tmpl->command_count);
     }
-    free(outputs);
-    string_array_free(&dyncmds);
-    char_vector_free(&vec);
-    return exit_error;
+
+    return 0;
 }
@@ -0,0 +1,104 @@
+/**
+ * @file dyncache.c
+ * @author epsiii
+ * @brief Shared cache for the outputs of the dynamic commands
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "ssfhs.h"
+
+typedef struct DynamicCacheEntry {
+    struct DynamicCacheEntry *next;
+    char *cmd;
+    char *output;
+    size_t len;
+    uint64_t expires_ms;
+} DynamicCacheEntry;
+
+static DynamicCacheEntry *cache[DYNAMIC_CACHE_BUCKETS];
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void dynamic_cache_free_entry(DynamicCacheEntry *entry)
+{
+    free(entry->cmd);
+    free(entry->output);
+    free(entry);
+}
+
+// Copies the cached output into the arena, returns false on a miss
+bool dynamic_cache_get(Arena *arena, const char *cmd, struct iovec *output)
+{
+    unsigned bucket = hash_string(cmd) % DYNAMIC_CACHE_BUCKETS;
+    uint64_t now = now_ms();
+    bool hit = false;
+
+    pthread_mutex_lock(&cache_mutex);
+    DynamicCacheEntry **link = &cache[bucket];
+    while (*link)
+    {
+        DynamicCacheEntry *entry = *link;
+        if (strcmp(entry->cmd, cmd) != 0)
+        {
+            link = &entry->next;
+            continue;
+        }
+
+        // Drop the expired entry
+        if (entry->expires_ms <= now)
+        {
+            *link = entry->next;
+            dynamic_cache_free_entry(entry);
+            break;
+        }
+
+        output->iov_base = arena_alloc(arena, entry->len);
+        output->iov_len = entry->len;
+        memcpy(output->iov_base, entry->output, entry->len);
+        hit = true;
+        break;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+
+    if (g_server_config.debug)
+    {
+        printf("[DYNAMIC:Cache] %s: %s\n", hit ? "hit" : "miss", cmd);
+    }
+
+    return hit;
+}
+
+void dynamic_cache_put(const char *cmd, int ttl_ms, const void *data, size_t len)
+{
+    DynamicCacheEntry *fresh = malloc(sizeof(DynamicCacheEntry));
+    fresh->cmd = strdup(cmd);
+    fresh->output = malloc(len ? len : 1);
+    memcpy(fresh->output, data, len);
+    fresh->len = len;
+    fresh->expires_ms = now_ms() + ttl_ms;
+
+    unsigned bucket = hash_string(cmd) % DYNAMIC_CACHE_BUCKETS;
+
+    // Replace the old entry if there is one
+    pthread_mutex_lock(&cache_mutex);
+    DynamicCacheEntry **link = &cache[bucket];
+    while (*link)
+    {
+        DynamicCacheEntry *entry = *link;
+        if (strcmp(entry->cmd, cmd) == 0)
+        {
+            *link = entry->next;
+            dynamic_cache_free_entry(entry);
+            break;
+        }
+        link = &entry->next;
+    }
+    fresh->next = cache[bucket];
+    cache[bucket] = fresh;
+    pthread_mutex_unlock(&cache_mutex);
+}
@@ -0,0 +1,175 @@
+/**
+ * @file dynexec.c
+ * @author epsiii
+ * @brief Server wide limit on the concurrently running dynamic commands
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * Every request asks for as many slots as it has commands (capped at
+ * DYNAMIC_MAX_PROCS) and runs its commands in batches of the granted size.
+ * When there are no free slots the request waits in a FIFO queue of at most
+ * DYNAMIC_QUEUE_SIZE requests for up to DYNAMIC_QUEUE_TIMEOUT. If the queue
+ * is full or the wait times out the request is rejected (503) right away
+ * instead of piling up more processes.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "ssfhs.h"
+
+typedef struct ExecutorWaiter {
+    struct ExecutorWaiter *next;
+    int wanted;
+    bool granted;
+    pthread_cond_t cond;
+} ExecutorWaiter;
+
+static pthread_mutex_t executor_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ExecutorWaiter *queue_head = NULL;
+static ExecutorWaiter *queue_tail = NULL;
+static DynamicExecutorStats executor_stats;
+
+// Hands the free slots to the waiters in the order they came (mutex has to be held)
+static void dynamic_executor_grant_waiters(void)
+{
+    while (queue_head &&
+        executor_stats.running + queue_head->wanted <= g_server_config.dynamic_max_procs)
+    {
+        ExecutorWaiter *waiter = queue_head;
+        queue_head = waiter->next;
+        if (!queue_head) { queue_tail = NULL; }
+
+        executor_stats.running += waiter->wanted;
+        executor_stats.queued--;
+        waiter->granted = true;
+        pthread_cond_signal(&waiter->cond);
+    }
+}
+
+static void dynamic_executor_unlink(ExecutorWaiter *waiter)
+{
+    ExecutorWaiter *prev = NULL;
+    for (ExecutorWaiter *it = queue_head; it; prev = it, it = it->next)
+    {
+        if (it != waiter) { continue; }
+
+        if (prev) { prev->next = it->next; }
+        else { queue_head = it->next; }
+        if (queue_tail == it) { queue_tail = prev; }
+        executor_stats.queued--;
+        return;
+    }
+}
+
+// Returns 0 with the number of granted slots, RESOURCE_BUSY if the request was rejected
+int dynamic_executor_acquire(int request_id, int count, int *granted)
+{
+    int wanted = (count < g_server_config.dynamic_max_procs) ? count : g_server_config.dynamic_max_procs;
+
+    pthread_mutex_lock(&executor_mutex);
+
+    // Fast path, nobody is waiting and there's enough space
+    if (!queue_head && executor_stats.running + wanted <= g_server_config.dynamic_max_procs)
+    {
+        executor_stats.running += wanted;
+        executor_stats.admitted++;
+        pthread_mutex_unlock(&executor_mutex);
+        *granted = wanted;
+        return 0;
+    }
+
+    // Fail fast if the queue is full
+    if (executor_stats.queued >= g_server_config.dynamic_queue_size)
+    {
+        executor_stats.rejected_full++;
+        pthread_mutex_unlock(&executor_mutex);
+        log_error(request_id, "Dynamic executor queue is full, rejecting the request\n");
+        return RESOURCE_BUSY;
+    }
+
+    // Get in the line
+    ExecutorWaiter waiter = { .next = NULL, .wanted = wanted, .granted = false };
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&waiter.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (queue_tail) { queue_tail->next = &waiter; }
+    else { queue_head = &waiter; }
+    queue_tail = &waiter;
+    executor_stats.queued++;
+    executor_stats.queued_total++;
+    if (executor_stats.queued > executor_stats.peak_queued)
+    {
+        executor_stats.peak_queued = executor_stats.queued;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += g_server_config.dynamic_queue_timeout_ms / 1000;
+    deadline.tv_nsec += (long)(g_server_config.dynamic_queue_timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    uint64_t wait_start = now_us();
+    while (!waiter.granted)
+    {
+        if (pthread_cond_timedwait(&waiter.cond, &executor_mutex, &deadline) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+
+    int result = 0;
+    uint64_t waited = now_us() - wait_start;
+    if (waiter.granted)
+    {
+        executor_stats.admitted++;
+        executor_stats.wait_total_us += waited;
+        if (waited > executor_stats.wait_max_us) { executor_stats.wait_max_us = waited; }
+        *granted = wanted;
+    }
+    else
+    {
+        // Leave the line, the ones behind us might fit now
+        dynamic_executor_unlink(&waiter);
+        dynamic_executor_grant_waiters();
+        executor_stats.rejected_timeout++;
+        result = RESOURCE_BUSY;
+    }
+    pthread_mutex_unlock(&executor_mutex);
+    pthread_cond_destroy(&waiter.cond);
+
+    if (result)
+    {
+        log_error(request_id, "Waited %.1fms for the dynamic executor, rejecting the request\n",
+            (float)waited / 1000.0);
+    }
+    else if (g_server_config.debug)
+    {
+        printf("[DYNEXEC:Acquire] Got %d slots after %.1fms\n", wanted, (float)waited / 1000.0);
+    }
+
+    return result;
+}
+
+void dynamic_executor_release(int count)
+{
+    pthread_mutex_lock(&executor_mutex);
+    executor_stats.running -= count;
+    dynamic_executor_grant_waiters();
+    pthread_mutex_unlock(&executor_mutex);
+}
+
+void dynamic_executor_get_stats(DynamicExecutorStats *stats)
+{
+    pthread_mutex_lock(&executor_mutex);
+    *stats = executor_stats;
+    pthread_mutex_unlock(&executor_mutex);
+}
@@ -0,0 +1,470 @@
+/**
+ * @file dynworker.c
+ * @author epsiii
+ * @brief Pool of persistent processes executing the dynamic commands
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * Protocol (over a UNIX socket connected to the worker's stdin and stdout),
+ *  every frame is "<KEYWORD> <number>\n" optionally followed by <number> bytes
+ *  of payload and a "\n":
+ *
+ *  Server -> worker:  CMD <len>  the command to execute
+ *                     ENV <len>  a KEY=VALUE request variable (repeated)
+ *                     RUN 0      execute the command
+ *  Worker -> server:  OUT <len>  output of the command (may repeat)
+ *                     ERR <len>  error output, gets logged (may repeat)
+ *                     EXIT <code>  done, no payload
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "ssfhs.h"
+
+typedef struct {
+    pid_t pid;
+    int fd;
+    int handled;
+    bool busy;
+} DynamicWorker;
+
+typedef struct {
+    DynamicWorker *worker;
+    CharVector in;
+    CharVector out;             // The job, sent as the worker reads it
+    size_t out_sent;
+    int cmd_index;
+    bool active;
+    bool broken;
+} DynamicWorkerSlot;
+
+static DynamicWorker *workers = NULL;
+static int worker_count = 0;
+static pthread_mutex_t workers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workers_free = PTHREAD_COND_INITIALIZER;
+
+static int dynamic_worker_spawn(DynamicWorker *w)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv))
+    {
+        log_error(0, "Failed to create dynamic worker socket: %s\n", strerror(errno));
+        return 1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        log_error(0, "Failed to fork dynamic worker: %s\n", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        return 1;
+    }
+
+    if (!pid)
+    {
+        // The duplicates don't have the CLOEXEC flag
+        dup2(sv[1], STDIN_FILENO);
+        dup2(sv[1], STDOUT_FILENO);
+        signal(SIGPIPE, SIG_DFL);
+        chdir(g_server_config.root_dir);
+        execl(g_server_config.dynamic_worker, g_server_config.dynamic_worker, (char*)NULL);
+        _exit(127);
+    }
+
+    // Only the server's end, the worker reads its stdin blocking
+    close(sv[1]);
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    w->pid = pid;
+    w->fd = sv[0];
+    w->handled = 0;
+
+    if (g_server_config.debug)
+    {
+        printf("[DynamicWorker:Spawn] Started worker, PID: %d\n", pid);
+    }
+
+    return 0;
+}
+
+static void dynamic_worker_kill(DynamicWorker *w)
+{
+    if (w->fd >= 0) { close(w->fd); }
+    if (w->pid > 0)
+    {
+        kill(w->pid, SIGKILL);
+        waitpid(w->pid, NULL, 0);
+    }
+    w->fd = -1;
+    w->pid = -1;
+}
+
+void dynamic_workers_start(void)
+{
+    worker_count = g_server_config.dynamic_workers;
+    workers = calloc(worker_count, sizeof(DynamicWorker));
+
+    for (int i = 0; i < worker_count; i++)
+    {
+        if (dynamic_worker_spawn(&workers[i]))
+        {
+            fprintf(stderr, "Failed to start dynamic worker: %s\n", g_server_config.dynamic_worker);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    log_message(0, "Started %d dynamic workers (%s)\n", worker_count, g_server_config.dynamic_worker);
+}
+
+void dynamic_workers_stop(void)
+{
+    for (int i = 0; i < worker_count; i++)
+    {
+        dynamic_worker_kill(&workers[i]);
+    }
+    free(workers);
+    workers = NULL;
+    worker_count = 0;
+}
+
+// Waits for at least one free worker and takes up to max of them, returns the count
+static int dynamic_workers_acquire(DynamicWorker **out, int max, uint64_t deadline_ms)
+{
+    int count = 0;
+
+    pthread_mutex_lock(&workers_mutex);
+    for ( ;; )
+    {
+        for (int i = 0; i < worker_count && count < max; i++)
+        {
+            if (!workers[i].busy)
+            {
+                workers[i].busy = true;
+                out[count++] = &workers[i];
+            }
+        }
+        if (count > 0) { break; }
+
+        // Wait for someone to release a worker
+        uint64_t now = now_ms();
+        if (now >= deadline_ms) { break; }
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        uint64_t wait_ms = deadline_ms - now;
+        ts.tv_sec += wait_ms / 1000;
+        ts.tv_nsec += (wait_ms % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) { ts.tv_sec++; ts.tv_nsec -= 1000000000; }
+        pthread_cond_timedwait(&workers_free, &workers_mutex, &ts);
+    }
+    pthread_mutex_unlock(&workers_mutex);
+
+    return count;
+}
+
+// Broken and worn out workers are replaced before they are handed out again
+static void dynamic_workers_release(DynamicWorker *w, bool broken)
+{
+    if (broken || w->handled >= g_server_config.dynamic_worker_max_requests)
+    {
+        if (g_server_config.debug)
+        {
+            printf("[DynamicWorker:Recycle] Replacing worker PID: %d (%d jobs%s)\n",
+                w->pid, w->handled, broken ? ", broken" : "");
+        }
+        dynamic_worker_kill(w);
+        dynamic_worker_spawn(w);
+    }
+
+    pthread_mutex_lock(&workers_mutex);
+    w->busy = (w->fd < 0);  // Keep it out of the pool if it couldn't be respawned
+    pthread_cond_signal(&workers_free);
+    pthread_mutex_unlock(&workers_mutex);
+}
+
+static void dynamic_worker_push_frame(CharVector *vec, const char *keyword, const char *payload, size_t len)
+{
+    char header[64];
+    snprintf(header, sizeof(header), "%s %zu\n", keyword, len);
+    char_vector_push_arr(vec, header, strlen(header));
+    if (payload)
+    {
+        char_vector_push_arr(vec, payload, len);
+        char_vector_push(vec, '\n');
+    }
+}
+
+static void dynamic_worker_build_job(CharVector *job, const char *cmd, char **vars, int var_count)
+{
+    char_vector_clear(job);
+    dynamic_worker_push_frame(job, "CMD", cmd, strlen(cmd));
+    for (int i = 0; i < var_count; i++)
+    {
+        dynamic_worker_push_frame(job, "ENV", vars[i], strlen(vars[i]));
+    }
+    dynamic_worker_push_frame(job, "RUN", NULL, 0);
+}
+
+// Sends what the worker takes of the job without blocking, returns non-zero if it went away
+static int dynamic_worker_flush(DynamicWorkerSlot *slot)
+{
+    while (slot->out_sent < slot->out.count)
+    {
+        ssize_t res = send(slot->worker->fd, slot->out.items + slot->out_sent, 
+            slot->out.count - slot->out_sent, MSG_NOSIGNAL);
+        if (res < 0)
+        {
+            if (errno == EINTR) { continue; }
+            return (errno != EAGAIN && errno != EWOULDBLOCK);
+        }
+        slot->out_sent += res;
+    }
+    return 0;
+}
+
+// Reads the next frame from the buffer
+//  Returns 1 if a frame was read, 0 if more data is needed, -1 on a protocol error
+static int dynamic_worker_next_frame(const CharVector *in, size_t *pos, char *keyword,
+    size_t keyword_size, long *number, const char **payload)
+{
+    const char *start = in->items + *pos;
+    const char *lf = memchr(start, '\n', in->count - *pos);
+    if (!lf) { return 0; }
+
+    // Parse "<KEYWORD> <number>"
+    const char *sep = memchr(start, ' ', lf - start);
+    if (!sep || (size_t)(sep - start) >= keyword_size) { return -1; }
+    memcpy(keyword, start, sep - start);
+    keyword[sep - start] = '\0';
+    char *num_end;
+    *number = strtol(sep + 1, &num_end, 10);
+    if (num_end != lf) { return -1; }
+
+    // EXIT doesn't have a payload
+    size_t header_len = lf - start + 1;
+    if (strcmp(keyword, "EXIT") == 0)
+    {
+        *payload = NULL;
+        *pos += header_len;
+        return 1;
+    }
+
+    // The payload is followed by a newline
+    if (*number < 0) { return -1; }
+    if (in->count - *pos < header_len + (size_t)*number + 1) { return 0; }
+    *payload = lf + 1;
+    *pos += header_len + (size_t)*number + 1;
+    return 1;
+}
+
+// Returns 1 once the whole response is there (output and status filled), 0 if more
+//  data is needed, -1 on a protocol error
+static int dynamic_worker_parse(int request_id, int index, const CharVector *in, Arena *arena,
+    struct iovec *output, int *status)
+{
+    char keyword[16];
+    long number;
+    const char *payload;
+
+    // First pass, check that the response is complete and compute the output size
+    size_t pos = 0, out_len = 0;
+    int res;
+    while ((res = dynamic_worker_next_frame(in, &pos, keyword, sizeof(keyword), &number, &payload)) > 0)
+    {
+        if (strcmp(keyword, "OUT") == 0) { out_len += number; }
+        else if (strcmp(keyword, "EXIT") == 0) { break; }
+        else if (strcmp(keyword, "ERR") != 0) { return -1; }
+    }
+    if (res <= 0) { return res; }
+    *status = number;
+
+    // Second pass, gather the output and log the errors
+    char *out = arena_alloc(arena, out_len + 1);
+    output->iov_base = out;
+    output->iov_len = out_len;
+    pos = 0;
+    while (dynamic_worker_next_frame(in, &pos, keyword, sizeof(keyword), &number, &payload) > 0)
+    {
+        if (strcmp(keyword, "OUT") == 0)
+        {
+            memcpy(out, payload, number);
+            out += number;
+        }
+        else if (strcmp(keyword, "ERR") == 0)
+        {
+            log_error(request_id, "[DynamicWorker:Execute:%d] stderr: %.*s\n", index, (int)number, payload);
+        }
+        else { break; }
+    }
+    *out = '\0';
+
+    return 1;
+}
+
+static int dynamic_worker_dispatch(DynamicWorkerSlot *slot, int cmd_index, const char **cmds,
+    char **vars, int var_count)
+{
+    slot->cmd_index = cmd_index;
+    slot->active = true;
+    char_vector_clear(&slot->in);
+    dynamic_worker_build_job(&slot->out, cmds[cmd_index], vars, var_count);
+    slot->out_sent = 0;
+    slot->worker->handled++;
+
+    // Whatever doesn't fit into the socket is sent from the poll loop, within the deadline
+    if (dynamic_worker_flush(slot))
+    {
+        slot->broken = true;
+        slot->active = false;
+        return 1;
+    }
+    return 0;
+}
+
+// Same contract as the fork backend, the commands are spread over the free workers
+int dynamic_workers_execute(int request_id, Arena *arena, const char **cmds, int count,
+    struct iovec *outputs, int *statuses, char **vars, int var_count, const DynamicProgress *progress)
+{
+    uint64_t deadline = now_ms() + g_server_config.dynamic_timeout;
+    bool error = false;
+
+    DynamicWorker **held = arena_alloc(arena, count * sizeof(DynamicWorker*));
+    int held_count = dynamic_workers_acquire(held, count, deadline);
+    if (held_count == 0)
+    {
+        log_error(request_id, "No dynamic worker became available in time\n");
+        return 1;
+    }
+
+    // Start the first batch of commands
+    DynamicWorkerSlot *slots = arena_alloc(arena, held_count * sizeof(DynamicWorkerSlot));
+    struct pollfd *pfds = arena_alloc(arena, held_count * sizeof(struct pollfd));
+    int next_cmd = 0, done = 0;
+    for (int i = 0; i < held_count; i++)
+    {
+        DynamicWorkerSlot *slot = &slots[i];
+        memset(slot, 0, sizeof(*slot));
+        slot->worker = held[i];
+        char_vector_init(&slot->in, 1024);
+        char_vector_init(&slot->out, 1024);
+        if (dynamic_worker_dispatch(slot, next_cmd, cmds, vars, var_count))
+        {
+            statuses[next_cmd] = -1;
+            outputs[next_cmd].iov_base = NULL;
+            outputs[next_cmd].iov_len = 0;
+            error = true;
+            done++;
+        }
+        next_cmd++;
+    }
+
+    while (done < count && !error)
+    {
+        // Wait for any of the workers to respond
+        int nfds = 0;
+        for (int i = 0; i < held_count; i++)
+        {
+            pfds[i].fd = slots[i].active ? slots[i].worker->fd : -1;
+            pfds[i].events = POLLIN | ((slots[i].out_sent < slots[i].out.count) ? POLLOUT : 0);
+            pfds[i].revents = 0;
+            nfds += slots[i].active;
+        }
+        if (nfds == 0) { break; }
+
+        int64_t left = (int64_t)deadline - (int64_t)now_ms();
+        int res = (left > 0) ? poll(pfds, held_count, left) : 0;
+        if (res < 0 && errno == EINTR) { continue; }
+        if (res <= 0)
+        {
+            log_error(request_id, "Dynamic workers did not finish in time, the busy ones are replaced\n");
+            error = true;
+            break;
+        }
+
+        for (int i = 0; i < held_count; i++)
+        {
+            DynamicWorkerSlot *slot = &slots[i];
+            if (!slot->active || !pfds[i].revents) { continue; }
+
+            // The rest of the job (a large REQUEST_BODY doesn't fit into the socket at once)
+            if ((pfds[i].revents & POLLOUT) && dynamic_worker_flush(slot))
+            {
+                log_error(request_id, "Could not send the job to dynamic worker (pid: %d): %s\n",
+                    slot->worker->pid, strerror(errno));
+                slot->broken = true;
+                error = true;
+                break;
+            }
+            if (!(pfds[i].revents & ~POLLOUT)) { continue; }
+
+            // Read what's available
+            char_vector_reserve(&slot->in, 4096);
+            ssize_t n = read(slot->worker->fd, &slot->in.items[slot->in.count],
+                slot->in.max_size - slot->in.count - 1);
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) { continue; }
+            if (n <= 0)
+            {
+                log_error(request_id, "Dynamic worker (pid: %d) closed the connection\n", slot->worker->pid);
+                slot->broken = true;
+                error = true;
+                break;
+            }
+            char_vector_commit(&slot->in, n);
+
+            // Check whether the response is complete
+            int ci = slot->cmd_index;
+            int parsed = dynamic_worker_parse(request_id, ci, &slot->in, arena, &outputs[ci], &statuses[ci]);
+            if (parsed < 0)
+            {
+                log_error(request_id, "Dynamic worker (pid: %d) sent a malformed response\n", slot->worker->pid);
+                slot->broken = true;
+                error = true;
+                break;
+            }
+            if (parsed == 0) { continue; }
+
+            slot->active = false;
+            done++;
+            if (statuses[ci] != 0)
+            {
+                log_error(request_id, "Dynamic command %d failed with exit code: %d%s\n",
+                    ci, statuses[ci], g_server_config.ignore_dynamic_errors ? " (ignored)" : "");
+                if (!g_server_config.ignore_dynamic_errors) { error = true; }
+            }
+
+            if (g_server_config.debug)
+            {
+                printf("[DynamicWorker:Execute:%d] Got output: %s\n", ci, (char*)outputs[ci].iov_base);
+            }
+            if (progress)
+            {
+                progress->done(progress->ctx, progress->base + ci, 
+                    outputs[ci].iov_base, outputs[ci].iov_len, statuses[ci]);
+            }
+
+            // Hand out the next command
+            if (next_cmd < count &&
+                dynamic_worker_dispatch(slot, next_cmd++, cmds, vars, var_count))
+            {
+                error = true;
+            }
+        }
+    }
+
+    // The workers that are still busy are in an unknown state
+    for (int i = 0; i < held_count; i++)
+    {
+        dynamic_workers_release(slots[i].worker, slots[i].broken || slots[i].active);
+        char_vector_free(&slots[i].in);
+        char_vector_free(&slots[i].out);
+    }
+
+    return error;
+}
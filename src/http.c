@@ -7,8 +7,13 @@
  * @copyright Copyright (c) 2025
  * 
  */
+#define _GNU_SOURCE  // strptime(), timegm()
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <time.h>
 #include "ssfhs.h"
@@ -58,14 +63,8 @@ bool http_got_whole_request(const CharVector *vec)
         char *len_end = strchr(cl_ptr, '\r');
         if (!len_start || !len_end) { return false; }
 
-        char *len_str_raw = char_vector_get_alloc(vec, 
-            len_start - vec->items + 1, len_end - len_start - 1);
-        char *len_str = strtrim(len_str_raw);
-
-        int len = atoi(len_str);
-
-        free(len_str);
-        free(len_str_raw);
+        // atoi() skips the leading whitespace and stops at the CR
+        int len = atoi(len_start + 1);
 
         if (!len)
         { 
@@ -84,6 +83,101 @@ bool http_got_whole_request(const CharVector *vec)
     }
 }
 
+// Checks what was received so far against the limits from the config, returns 0 or the status
+//  of the limit it's over (413, 414 or 431), so a huge request is refused before it's all read
+int http_check_limits(const CharVector *vec)
+{
+    const char *start = vec->items;
+    const char *end = vec->items + vec->count;
+
+    // The URL is between the first two spaces of the request line (which might not be complete yet)
+    const char *url = memchr(start, ' ', vec->count);
+    if (url)
+    {
+        url++;
+        const char *url_end = url;
+        while (url_end < end && *url_end != ' ' && *url_end != '\r' && *url_end != '\n') { url_end++; }
+        if (url_end - url > g_server_config.max_url_length) { return 414; }
+    }
+
+    // The header lines up to the empty one
+    const char *ptr = start;
+    const char *header_end = NULL;
+    int lines = 0;
+    long long content_length = 0;
+    while (ptr < end)
+    {
+        const char *lf = memchr(ptr, '\n', end - ptr);
+        if (!lf) { break; }
+        if (lf == ptr || (lf - ptr == 1 && *ptr == '\r'))
+        {
+            header_end = lf + 1;
+            break;
+        }
+        if (strncasecmp(ptr, "Content-Length:", 15) == 0) { content_length = atoll(ptr + 15); }
+        lines++;
+        ptr = lf + 1;
+    }
+
+    size_t header_size = ((header_end) ? header_end : end) - start;
+    if (header_size > g_server_config.max_header_size) { return 431; }
+    if (lines - 1 > g_server_config.max_header_count) { return 431; }
+
+    // The body is refused before it's received
+    if (header_end && content_length > 0 && (size_t)content_length > g_server_config.max_body_size)
+    {
+        return 413;
+    }
+
+    return 0;
+}
+
+static HTTPMethod http_method_from_string(const char *method)
+{
+    // Methods from RFC 9110 and 5789 that nothing here handles
+    const char *unsupported[] = { "PUT", "DELETE", "CONNECT", "TRACE", "PATCH" };
+
+    if (strcmp(method, "GET") == 0) { return HTTP_METHOD_GET; }
+    if (strcmp(method, "HEAD") == 0) { return HTTP_METHOD_HEAD; }
+    if (strcmp(method, "POST") == 0) { return HTTP_METHOD_POST; }
+    if (strcmp(method, "OPTIONS") == 0) { return HTTP_METHOD_OPTIONS; }
+    for (size_t i = 0; i < sizeof(unsupported) / sizeof(*unsupported); i++)
+    {
+        if (strcmp(method, unsupported[i]) == 0) { return HTTP_METHOD_UNSUPPORTED; }
+    }
+    return HTTP_METHOD_UNKNOWN;
+}
+
+static int http_hex_value(char c)
+{
+    if (c >= '0' && c <= '9') { return c - '0'; }
+    if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
+    if (c >= 'A' && c <= 'F') { return c - 'A' + 10; }
+    return -1;
+}
+
+// Decodes the %XX escapes in place, fails on broken escapes and on NUL
+static int http_url_decode(char *url)
+{
+    char *out = url;
+    for (char *in = url; *in; in++)
+    {
+        if (*in != '%')
+        {
+            *out++ = *in;
+            continue;
+        }
+
+        int high = http_hex_value(in[1]);
+        int low = (high < 0) ? -1 : http_hex_value(in[2]);
+        if (low < 0 || (high | low) == 0) { return 1; }
+        *out++ = (char)(high << 4 | low);
+        in += 2;
+    }
+    *out = '\0';
+    return 0;
+}
+
 static int http_request_parse_1st_line(const CharVector *vec, HTTPRequest *request, char **ptr)
 {
     *ptr = vec->items;
@@ -93,9 +187,9 @@ static int http_request_parse_1st_line(const CharVector *vec, HTTPRequest *reque
     if (!method_end) { return 1; }
     size_t method_len = method_end - *ptr;
 
-    if (request->method) { free(request->method); }
-    request->method = char_vector_get_alloc(vec, *ptr - vec->items, method_len);
+    request->method = arena_strndup(request->arena, *ptr, method_len);
     if (!request->method) { return 1; }
+    request->method_type = http_method_from_string(request->method);
 
     *ptr += method_len + 1;
     if (g_server_config.debug) 
@@ -108,13 +202,24 @@ static int http_request_parse_1st_line(const CharVector *vec, HTTPRequest *reque
     if (!url_end) { return 1; }
     size_t url_len = url_end - *ptr;
 
-    if (request->url) { free(request->url); }
-    request->url = char_vector_get_alloc(vec, *ptr - vec->items, url_len);
+    request->url = arena_strndup(request->arena, *ptr, url_len);
     if (!request->url) { return 1; }
 
-    // If there's a query string, place a null terminator there
+    // If there's a query string, place a null terminator there and keep the rest
     char *query_start = strchr(request->url, '?');
-    if (query_start) { *query_start = '\0'; }
+    if (query_start) 
+    { 
+        *query_start = '\0'; 
+        request->query = query_start + 1;
+    }
+    else
+    {
+        request->query = request->url + url_len;
+    }
+
+    // "GET  HTTP/1.1" or just a query, there's no path to resolve
+    if (request->url[0] == '\0') { return 1; }
+    if (http_url_decode(request->url)) { return 1; }
 
     *ptr += url_len + 1;
     if (g_server_config.debug) 
@@ -132,7 +237,7 @@ static int http_request_parse_1st_line(const CharVector *vec, HTTPRequest *reque
 }
 
 // 0 - Read a header, 1 - Done parsing, -1 - Error
-static int http_request_parse_header(const CharVector *vec, HTTPRequest *request, char **ptr)
+static int http_request_parse_header(HTTPRequest *request, char **ptr)
 {
     // Exit on CRLF
     char *line_end = strchr(*ptr, '\n');
@@ -143,40 +248,37 @@ static int http_request_parse_header(const CharVector *vec, HTTPRequest *request
     char *sep = strchr(*ptr, ':');
     if (!sep) { return -1; }
 
-    // Split the line into the key and value
-    char *raw_key = char_vector_get_alloc(vec, *ptr - vec->items, sep - *ptr);
-    char *raw_value = char_vector_get_alloc(vec, sep - vec->items + 1, line_end - sep);
-
-    // Trim the strings
-    char *key = strtrim(raw_key);
-    char *value = strtrim(raw_value);
+    // Split the line into the key and value and trim them
+    const char *key = *ptr;
+    size_t key_len = sep - *ptr;
+    const char *value = sep + 1;
+    size_t value_len = line_end - sep - 1;
+    strtrim_span(&key, &key_len);
+    strtrim_span(&value, &value_len);
 
     // Store the key and value
-    string_array_add(&request->header_keys, key);
-    string_array_add(&request->header_values, value);
+    string_array_add_len(&request->header_keys, key, key_len);
+    string_array_add_len(&request->header_values, value, value_len);
 
     // Print debug info
     if (g_server_config.debug)
     {
-        printf("[HTTP:ParseHeader] Got header >%s< --- >%s<\n", key, value);
+        printf("[HTTP:ParseHeader] Got header >%s< --- >%s<\n", 
+            request->header_keys.items[request->header_keys.count - 1],
+            request->header_values.items[request->header_values.count - 1]);
     }
 
-    // Free the resources
-    free(key);
-    free(value);
-    free(raw_key);
-    free(raw_value);
-
     // Move to the next line
     *ptr = line_end + 1;
     return 0;
 }
 
-void http_request_init(HTTPRequest *request)
+void http_request_init(HTTPRequest *request, Arena *arena)
 {
     memset(request, 0, sizeof(HTTPRequest));
-    string_array_init(&request->header_keys);
-    string_array_init(&request->header_values);
+    request->arena = arena;
+    string_array_init_arena(&request->header_keys, arena);
+    string_array_init_arena(&request->header_values, arena);
 }
 
 int http_request_parse(const CharVector *vec, HTTPRequest *request)
@@ -192,10 +294,16 @@ int http_request_parse(const CharVector *vec, HTTPRequest *request)
     // Parse the headers
     int res;
     do {
-        res = http_request_parse_header(vec, request, &ptr);
+        res = http_request_parse_header(request, &ptr);
     } while (res == 0);
     if (res < 0) { return 1; }
 
+    // The body follows the empty line (it points into the receive buffer)
+    ptr = strchr(ptr, '\n') + 1;
+    request->raw = vec->items;
+    request->data = ptr;
+    request->data_len = vec->count - (ptr - vec->items);
+
     request->okay = true;
     return 0;
 }
@@ -204,22 +312,91 @@ int http_request_parse(const CharVector *vec, HTTPRequest *request)
 //                        Response Generation                               //
 //////////////////////////////////////////////////////////////////////////////
 
-static int http_response_generate_internal(int request_id, CharVector *vec, 
-    const char *status, const char *path, const char *request_str)
+void http_response_init(HTTPResponse *response, CharVector *head, CharVector *body)
 {
-    char buffer[128];
+    memset(response, 0, sizeof(HTTPResponse));
+    response->head = head;
+    response->body = body;
+    response->file_fd = -1;
+}
 
-    // Get the resource
-    void *res_buff;
-    size_t res_size;
-    char *res_type;
-    if (path != NULL)
+// Drops everything generated so far (used when switching to an error page)
+static void http_response_clear(HTTPResponse *response)
+{
+    char_vector_clear(response->head);
+    char_vector_clear(response->body);
+    response->part_count = 0;
+    response->part_len = 0;
+    response->header_count = 0;
+    response->file_fd = -1;
+    response->file_len = 0;
+}
+
+// The data is not copied, it has to stay valid until the arena is reset
+void http_response_add_part(HTTPResponse *response, Arena *arena, const void *data, size_t len)
+{
+    if (len == 0) { return; }
+
+    if (response->part_count == response->part_capacity)
     {
-        int result = resource_get(request_id, &res_buff, &res_size, path, request_str);
-        res_type = resource_get_content_type(path);
-        if (result) { return 1; }
+        int capacity = response->part_capacity ? response->part_capacity * 2 : 16;
+        struct iovec *parts = arena_alloc(arena, capacity * sizeof(struct iovec));
+        if (response->part_count)
+        {
+            memcpy(parts, response->parts, response->part_count * sizeof(struct iovec));
+        }
+        response->parts = parts;
+        response->part_capacity = capacity;
+    }
+
+    response->parts[response->part_count].iov_base = (void*)data;
+    response->parts[response->part_count].iov_len = len;
+    response->part_count++;
+    response->part_len += len;
+}
+
+// Headers sent on top of the default ones
+void http_response_add_header(HTTPResponse *response, Arena *arena, const char *name, const char *value)
+{
+    size_t name_len = strlen(name);
+    size_t value_len = strlen(value);
+    char *line = arena_alloc(arena, name_len + value_len + 5);
+    memcpy(line, name, name_len);
+    memcpy(line + name_len, ": ", 2);
+    memcpy(line + name_len + 2, value, value_len);
+    memcpy(line + name_len + 2 + value_len, "\r\n", 3);
+    http_response_add_header_line(response, arena, line);
+}
+
+// Same as above with a complete "Name: value\r\n" line, the line isn't copied
+void http_response_add_header_line(HTTPResponse *response, Arena *arena, const char *line)
+{
+    if (response->header_count == response->header_capacity)
+    {
+        int capacity = response->header_capacity ? response->header_capacity * 2 : 8;
+        char **headers = arena_alloc(arena, capacity * sizeof(char*));
+        if (response->header_count)
+        {
+            memcpy(headers, response->headers, response->header_count * sizeof(char*));
+        }
+        response->headers = headers;
+        response->header_capacity = capacity;
     }
 
+    response->headers[response->header_count++] = (char*)line;
+}
+
+size_t http_response_body_len(const HTTPResponse *response)
+{
+    return response->body->count + response->part_len + response->file_len;
+}
+
+// Writes the status line and the headers, the body headers only if there's a content type
+static void http_response_generate_head(HTTPResponse *response, const char *status, const char *content_type)
+{
+    char buffer[128];
+    CharVector *vec = response->head;
+
     // Generate the 1st line
     const char *resp_1st_line = "HTTP/1.1 ";
     char_vector_push_arr(vec, resp_1st_line, strlen(resp_1st_line));
@@ -237,128 +414,831 @@ static int http_response_generate_internal(int request_id, CharVector *vec,
     strftime(buffer, sizeof(buffer) - 1, "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", gmt);
     char_vector_push_arr(vec, buffer, strlen(buffer));
 
-    if (path != NULL)
+    if (content_type != NULL)
     {
-        // Generate content length header
-        snprintf(buffer, sizeof(buffer) - 1, "Content-Length: %ld\r\n", res_size);
-        char_vector_push_arr(vec, buffer, strlen(buffer));
+        // Generate content length header (the length of a streamed body isn't known yet)
+        if (response->streaming)
+        {
+            snprintf(buffer, sizeof(buffer) - 1, "Transfer-Encoding: chunked\r\n");
+            char_vector_push_arr(vec, buffer, strlen(buffer));
+        }
+        else if (!response->unknown_length)
+        {
+            snprintf(buffer, sizeof(buffer) - 1, "Content-Length: %zu\r\n", http_response_body_len(response));
+            char_vector_push_arr(vec, buffer, strlen(buffer));
+        }
 
         // Generate content type header
-        snprintf(buffer, sizeof(buffer) - 1, "Content-Type: %s\r\n", res_type);
+        snprintf(buffer, sizeof(buffer) - 1, "Content-Type: %s\r\n", content_type);
         char_vector_push_arr(vec, buffer, strlen(buffer));
     }
 
-    // Add the content type and connection headers
+    // Add the extra headers
+    for (int i = 0; i < response->header_count; i++)
+    {
+        char_vector_push_arr(vec, response->headers[i], strlen(response->headers[i]));
+    }
+
+    // Add the connection header
     const char *resp_headers = 
         "Connection: Close\r\n\r\n";
     char_vector_push_arr(vec, resp_headers, strlen(resp_headers));
+}
+
+// Sends the head right away, the body has to follow with http_response_stream_write()
+int http_response_stream_start(HTTPResponse *response, const char *content_type)
+{
+    if (!response->write) { return 1; }
+
+    response->streaming = true;
+    http_response_generate_head(response, "200 OK", content_type);
+
+    struct iovec iov = { response->head->items, response->head->count };
+    int result = response->write(response->write_ctx, &iov, 1);
+    char_vector_clear(response->head);
+    return result;
+}
+
+// Sends the buffers as a single chunk
+int http_response_stream_write(HTTPResponse *response, const struct iovec *iov, int count)
+{
+    struct iovec chunk[SEND_IOV_BATCH];
+    char size_line[24];
+    if (count > SEND_IOV_BATCH - 2) { return 1; }
+
+    size_t len = 0;
+    for (int i = 0; i < count; i++) { len += iov[i].iov_len; }
+    if (len == 0) { return 0; }  // An empty chunk would end the body
+
+    chunk[0].iov_base = size_line;
+    chunk[0].iov_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", len);
+    memcpy(&chunk[1], iov, count * sizeof(struct iovec));
+    chunk[count + 1].iov_base = "\r\n";
+    chunk[count + 1].iov_len = 2;
+
+    return response->write(response->write_ctx, chunk, count + 2);
+}
+
+int http_response_stream_end(HTTPResponse *response)
+{
+    struct iovec iov = { "0\r\n\r\n", 5 };
+    return response->write(response->write_ctx, &iov, 1);
+}
+
+// Replaces the body with its compressed version, static files are cached (st is set for them)
+static bool http_response_compress(Arena *arena, HTTPResponse *response, const char *encoding,
+    const char *path, const struct stat *st)
+{
+    size_t len = http_response_body_len(response);
+    if (len < g_server_config.compression_min_size) { return false; }
+
+    // The body buffer goes first, then the parts
+    int count = 0;
+    struct iovec *in = arena_alloc(arena, (response->part_count + 1) * sizeof(struct iovec));
+    if (response->body->count)
+    {
+        in[count].iov_base = response->body->items;
+        in[count].iov_len = response->body->count;
+        count++;
+    }
+    if (response->part_count)
+    {
+        memcpy(&in[count], response->parts, response->part_count * sizeof(struct iovec));
+        count += response->part_count;
+    }
+
+    void *out;
+    size_t out_len = compression_compress(encoding, arena, in, count, len, &out);
+    if (st) { compression_cache_put(path, st, encoding, out, out_len); }
+    if (!out_len) { return false; }
+
+    char_vector_clear(response->body);
+    response->part_count = 0;
+    response->part_len = 0;
+    http_response_add_part(response, arena, out, out_len);
+    return true;
+}
 
+// Writes an IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT")
+static void http_format_date(char *buffer, size_t size, time_t time)
+{
+    struct tm gmt;
+    gmtime_r(&time, &gmt);
+    strftime(buffer, size, "%a, %d %b %Y %H:%M:%S GMT", &gmt);
+}
+
+// Cache-Control (and Expires with max-age) of the first rule matching the URL
+static void http_response_add_cache_headers(Arena *arena, HTTPResponse *response, const char *url)
+{
+    const char *path = (url[0] == '/') ? url + 1 : url;
+    for (int i = 0; i < g_server_config.cache_control_rule_count; i++)
+    {
+        const CacheControlRule *rule = &g_server_config.cache_control_rules[i];
+        if (!glob_match(rule->pattern, path)) { continue; }
+
+        http_response_add_header_line(response, arena, rule->header);
+        if (rule->max_age >= 0)
+        {
+            char expires[64];
+            http_format_date(expires, sizeof(expires), time(NULL) + rule->max_age);
+            http_response_add_header(response, arena, "Expires", expires);
+        }
+        return;
+    }
+}
+
+// Whether the entity tag is in an If-None-Match list (weak comparison, W/ is ignored)
+static bool http_etag_matches(const char *list, const char *etag)
+{
+    size_t etag_len = strlen(etag);
+    const char *ptr = list;
+    while (*ptr)
+    {
+        ptr += strspn(ptr, " \t,");
+        if (*ptr == '*') { return true; }
+        if (strncmp(ptr, "W/", 2) == 0) { ptr += 2; }
+
+        size_t len = strcspn(ptr, ",");
+        const char *tag = ptr;
+        strtrim_span(&tag, &len);
+        if (len == etag_len && strncmp(tag, etag, etag_len) == 0) { return true; }
+        ptr += strcspn(ptr, ",");
+    }
+    return false;
+}
+
+// If-None-Match wins over If-Modified-Since when both are present
+static bool http_request_is_not_modified(const HTTPRequest *request, const char *etag, time_t mtime)
+{
+    const char *if_none_match = http_request_get_header(request, "If-None-Match");
+    if (if_none_match) { return http_etag_matches(if_none_match, etag); }
+
+    const char *if_modified_since = http_request_get_header(request, "If-Modified-Since");
+    if (!if_modified_since) { return false; }
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(if_modified_since, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end != '\0') { return false; }
+    return mtime <= timegm(&tm);
+}
+
+static bool http_parse_offset(const char **ptr, uint64_t *value)
+{
+    if (!isdigit((unsigned char)**ptr)) { return false; }
+
+    char *end;
+    errno = 0;
+    *value = strtoull(*ptr, &end, 10);
+    *ptr = end;
+    return errno == 0;
+}
+
+// Parses a single "bytes=" range into [start, end], 0 - okay, 1 - the header should be
+//  ignored (malformed or multiple ranges), -1 - the range is outside of the file
+static int http_parse_range(const char *range, uint64_t size, uint64_t *start, uint64_t *end)
+{
+    if (strncasecmp(range, "bytes=", 6) != 0 || strchr(range, ',')) { return 1; }
+    const char *ptr = range + 6;
+
+    // The last n bytes
+    if (*ptr == '-')
+    {
+        ptr++;
+        uint64_t suffix;
+        if (!http_parse_offset(&ptr, &suffix) || *ptr != '\0') { return 1; }
+        if (suffix == 0 || size == 0) { return -1; }
+        *start = (suffix < size) ? size - suffix : 0;
+        *end = size - 1;
+        return 0;
+    }
+
+    // From the start to the end (or to the end of the file)
+    if (!http_parse_offset(&ptr, start) || *ptr++ != '-') { return 1; }
+    *end = UINT64_MAX;
+    if (*ptr != '\0' && (!http_parse_offset(&ptr, end) || *ptr != '\0')) { return 1; }
+    if (*end < *start) { return 1; }
+    if (*start >= size) { return -1; }
+    if (*end >= size) { *end = size - 1; }
+    return 0;
+}
+
+// Sends a window of the file if the range is valid, returns 0 if the whole file should be sent
+static int http_response_generate_range(int request_id, Arena *arena, HTTPResponse *response,
+    const char *range, const ResourceFile *file, const char *content_type, const char *encoding)
+{
+    const struct stat *st = &file->st;
+    char buffer[96];
+    uint64_t start, end;
+    int parsed = http_parse_range(range, st->st_size, &start, &end);
+    if (parsed > 0) { return 0; }
+    if (parsed < 0)
+    {
+        snprintf(buffer, sizeof(buffer), "bytes */%lu", (unsigned long)st->st_size);
+        http_response_add_header(response, arena, "Content-Range", buffer);
+        http_response_generate_head(response, "416 Range Not Satisfiable", NULL);
+        return RESOURCE_BAD_RANGE;
+    }
+
+    if (resource_get_window(request_id, arena, response, file, start, end - start + 1)) { return 1; }
+
+    snprintf(buffer, sizeof(buffer), "bytes %lu-%lu/%lu",
+        (unsigned long)start, (unsigned long)end, (unsigned long)st->st_size);
+    http_response_add_header(response, arena, "Content-Range", buffer);
+    if (encoding) { http_response_add_header(response, arena, "Content-Encoding", encoding); }
+    http_response_generate_head(response, "206 Partial Content", content_type);
+    return RESOURCE_PARTIAL;
+}
+
+// The snapshot entry (--snapshot) replaces the lookups of the path
+static int http_response_generate_internal(int request_id, Arena *arena, HTTPResponse *response, 
+    const char *status, const char *path, const HTTPRequest *request, const SnapshotEntry *entry)
+{
+    // Get the resource
+    const char *res_type = NULL;
+    if (request) { http_response_add_cache_headers(arena, response, request->url); }
     if (path != NULL)
     {
-        // Add the message at the end
-        char_vector_push_arr(vec, res_buff, res_size);
-        free(res_type);
-        free(res_buff);
+        res_type = (entry) ? entry->content_type : resource_get_content_type(path);
+        bool is_static = (entry) ? !entry->is_dynamic : !resource_is_dynamic(path);
+        const char *accept_encoding = (request) ? http_request_get_header(request, "Accept-Encoding") : NULL;
+        ResourceFile file = { .path = path, .fd = -1 };
+        if (entry) { file = entry->file; }
+        bool has_stat = request && is_static && (entry || stat(path, &file.st) == 0);
+        struct stat st = file.st;
+
+        // HEAD of a dynamic page only runs the commands if it's configured to
+        if (response->head_only && !is_static && !g_server_config.dynamic_head)
+        {
+            response->unknown_length = true;
+            http_response_generate_head(response, status, res_type);
+            return 0;
+        }
+
+        // Static files can be sent precompressed, the type still comes from the original name
+        ResourceFile body = file;
+        const char *encoding = NULL;
+        bool vary = false;
+        if (has_stat && entry)
+        {
+            body = *snapshot_select_encoding(entry, accept_encoding, &encoding, &vary);
+        }
+        else if (has_stat)
+        {
+            body.path = resource_select_encoding(arena, path, accept_encoding, &encoding, &vary);
+
+            // The precompressed copy has its own size
+            if (body.path != path && stat(body.path, &body.st) != 0) { return 1; }
+        }
+
+        // Otherwise they can be compressed here, static files only once
+        bool compressible = request && !encoding && compression_is_compressible(res_type);
+        const char *compression = (compressible) ? compression_select_encoding(accept_encoding) : NULL;
+        if (has_stat && (size_t)st.st_size < g_server_config.compression_min_size)
+        {
+            compressible = false;
+            compression = NULL;
+        }
+        // Ranges are of the identity (or the precompressed) file, there's no compressed copy to cut,
+        //  HEAD describes the identity file as well so it doesn't have to compress anything
+        const char *range = (has_stat) ? http_request_get_header(request, "Range") : NULL;
+        if (range || response->head_only) { compression = NULL; }
+
+        bool cacheable = compression && has_stat;
+        bool cached = false;
+        if (compressible) { vary = true; }
+        if (vary) { http_response_add_header(response, arena, "Vary", "Accept-Encoding"); }
+
+        // The ETag has to name the encoding that's actually sent, the compression might not pay
+        //  off (then the identity body goes out), so that one is added once it's known
+        bool etag_known = !compression;
+
+        // Validators of the static files, a revalidation that matches doesn't touch the file
+        if (has_stat)
+        {
+            char last_modified[64];
+            const char *etag = resource_get_etag(arena, &st, (encoding) ? encoding : compression);
+            http_format_date(last_modified, sizeof(last_modified), st.st_mtime);
+            if (etag_known) { http_response_add_header(response, arena, "ETag", etag); }
+            http_response_add_header(response, arena, "Last-Modified", last_modified);
+
+            // The client might hold either ETag, the identity one goes out whenever the compression
+            //  doesn't pay off, and the 304 repeats the one that matched
+            const char *matched = NULL;
+            if (http_request_is_not_modified(request, etag, st.st_mtime)) { matched = etag; }
+            else if (!etag_known)
+            {
+                const char *identity_etag = resource_get_etag(arena, &st, NULL);
+                if (http_request_is_not_modified(request, identity_etag, st.st_mtime)) { matched = identity_etag; }
+            }
+            if (matched)
+            {
+                if (!etag_known) { http_response_add_header(response, arena, "ETag", matched); }
+                http_response_generate_head(response, "304 Not Modified", NULL);
+                return RESOURCE_NOT_MODIFIED;
+            }
+
+            // If-Range makes the range conditional, the whole file is sent if it changed
+            http_response_add_header(response, arena, "Accept-Ranges", "bytes");
+            const char *if_range = http_request_get_header(request, "If-Range");
+            if (range && (!if_range || strcmp(if_range, etag) == 0 || strcmp(if_range, last_modified) == 0))
+            {
+                int result = http_response_generate_range(request_id, arena, response, range,
+                    &body, res_type, encoding);
+                if (result) { return result; }
+            }
+        }
+
+        if (cacheable)
+        {
+            struct iovec data;
+            if (compression_cache_get(arena, path, &st, compression, &data))
+            {
+                // An empty entry means the file doesn't get any smaller
+                if (data.iov_len) { http_response_add_part(response, arena, data.iov_base, data.iov_len); }
+                else { compression = NULL; }
+                cached = (compression != NULL);
+            }
+        }
+
+        if (response->head_only && has_stat)
+        {
+            // Only the length is needed, the file isn't touched
+            response->file_len = body.st.st_size;
+        }
+        else if (has_stat && body.fd >= 0 && !compression)
+        {
+            // The snapshot keeps it open, so it goes straight from the page cache
+            if (resource_get_window(request_id, arena, response, &body, 0, body.st.st_size)) { return 1; }
+        }
+        else if (!cached)
+        {
+            // The mapped content of an archive only has to be compressed
+            int result = 0;
+            if (has_stat && body.data)
+            {
+                http_response_add_part(response, arena, body.data, body.st.st_size);
+            }
+            else
+            {
+                result = resource_get(request_id, arena, response, body.path, request);
+            }
+            if (result || response->streaming) { return result; }
+            if (compression && !http_response_compress(arena, response, compression, path,
+                (cacheable) ? &st : NULL))
+            {
+                compression = NULL;
+            }
+        }
+
+        if (compression) { encoding = compression; }
+        if (encoding) { http_response_add_header(response, arena, "Content-Encoding", encoding); }
+        if (has_stat && !etag_known)
+        {
+            http_response_add_header(response, arena, "ETag", resource_get_etag(arena, &st, encoding));
+        }
     }
 
+    http_response_generate_head(response, status, res_type);
     return 0;
 }
 
-static void http_response_generate_bad_request(int request_id, CharVector *vec)
+static void http_response_generate_bad_request(int request_id, Arena *arena, HTTPResponse *response)
 {
-    http_response_generate_internal(request_id, vec,
+    http_response_clear(response);
+    http_response_generate_internal(request_id, arena, response,
         "400 Bad Request",
         g_server_config.bad_request_page_file,
-        ""
+        NULL, NULL
     );
 }
 
-static void http_response_generate_not_found(int request_id, CharVector *vec)
+static void http_response_generate_not_found(int request_id, Arena *arena, HTTPResponse *response)
 {
-    http_response_generate_internal(request_id, vec,
+    http_response_clear(response);
+    http_response_generate_internal(request_id, arena, response,
         "404 Not Found",
         g_server_config.not_found_page_file,
-        ""
+        NULL, NULL
     );
 }
 
-static void http_response_generate_forbidden(int request_id, CharVector *vec)
+static void http_response_generate_forbidden(int request_id, Arena *arena, HTTPResponse *response)
 {
-    http_response_generate_internal(request_id, vec,
+    http_response_clear(response);
+    http_response_generate_internal(request_id, arena, response,
         "403 Forbidden",
         g_server_config.forbidden_page_file,
-        ""
+        NULL, NULL
     );
 }
 
-static void http_response_generate_server_error(int request_id, CharVector *vec)
+static void http_response_generate_server_error(int request_id, Arena *arena, HTTPResponse *response)
 {
-    http_response_generate_internal(request_id, vec,
+    http_response_clear(response);
+    http_response_generate_internal(request_id, arena, response,
         "500 Internal Server Error",
         g_server_config.server_error_page_file,
-        ""
+        NULL, NULL
     );
 }
 
-int http_response_generate(int request_id, CharVector *response, HTTPRequest *request, const char *request_str)
+// The request was over one of the limits, its head isn't parsed
+static void http_response_generate_over_limit(HTTPResponse *response, int status)
+{
+    const char *status_line = "431 Request Header Fields Too Large";
+    if (status == 413) { status_line = "413 Content Too Large"; }
+    else if (status == 414) { status_line = "414 URI Too Long"; }
+    http_response_generate_head(response, status_line, NULL);
+}
+
+// Returns true if the client is out of requests of the class, the response is 429 then
+static bool http_response_rate_limited(HTTPResponse *response, HTTPRequest *request, int class)
+{
+    if (!request->remote_sockaddr) { return false; }
+    int retry_after = ratelimit_take(request->remote_sockaddr, class);
+    if (!retry_after) { return false; }
+
+    char value[16];
+    snprintf(value, sizeof(value), "%d", retry_after);
+    http_response_clear(response);
+    http_response_add_header(response, request->arena, "Retry-After", value);
+    http_response_generate_head(response, "429 Too Many Requests", NULL);
+    return true;
+}
+
+// The static resources only take the methods without a body
+static void http_response_generate_method_not_allowed(Arena *arena, HTTPResponse *response)
 {
+    http_response_clear(response);
+    http_response_add_header(response, arena, "Allow", "GET, HEAD, OPTIONS");
+    http_response_generate_head(response, "405 Method Not Allowed", NULL);
+}
+
+static int http_response_generate_plugin(int request_id, HTTPResponse *response, 
+    HTTPRequest *request, SsfhsHandler handler)
+{
+    const char *content_type = NULL;
+    if (plugin_run(request_id, handler, request, response->body, &content_type)) { return 1; }
+    if (!content_type) { content_type = resource_get_content_type(request->url); }
+    http_response_add_cache_headers(request->arena, response, request->url);
+
+    http_response_generate_head(response, "200 OK", content_type);
+    return 0;
+}
+
+// Returns 0 with the path (and the snapshot entry) of the directory's index page, or the status
+//  of the generated response
+static int http_response_generate_directory(int request_id, HTTPResponse *response,
+    HTTPRequest *request, const char **path, const SnapshotEntry **entry)
+{
+    // The relative links only work with the trailing slash
+    size_t url_len = strlen(request->url);
+    if (url_len == 0 || request->url[url_len - 1] != '/')
+    {
+        // The URL was decoded already, a "%3F" or a space can't go back into the header as is
+        size_t location_len = 3 * url_len + strlen(request->query) + 3;
+        char *location = arena_alloc(request->arena, location_len);
+        size_t len = url_encode(location, request->url, "/");
+        snprintf(location + len, location_len - len, "/%s%s",
+            (request->query[0]) ? "?" : "", request->query);
+
+        http_response_add_header(response, request->arena, "Location", location);
+        http_response_generate_head(response, "301 Moved Permanently", NULL);
+        return 301;
+    }
+
+    if (*entry && (*entry)->index)
+    {
+        *entry = (*entry)->index;
+        *path = (*entry)->file.path;
+        return 0;
+    }
+    const char *index = (*entry) ? NULL : resource_find_directory_index(request->arena, *path);
+    if (index && !resource_is_protected(index))
+    {
+        *path = index;
+        return 0;
+    }
+
+    if (!g_server_config.directory_listing)
+    {
+        http_response_generate_forbidden(request_id, request->arena, response);
+        return 403;
+    }
+    if (request->method_type == HTTP_METHOD_POST)
+    {
+        http_response_generate_method_not_allowed(request->arena, response);
+        return 405;
+    }
+
+    // ?page=N, anything else is the first page
+    int page = 1;
+    const char *page_param = strstr(request->query, "page=");
+    if (page_param && (page_param == request->query || page_param[-1] == '&'))
+    {
+        page = atoi(page_param + 5);
+    }
+
+    if (listing_generate(request_id, *path, request->url, page, response->body))
+    {
+        http_response_generate_server_error(request_id, request->arena, response);
+        return 500;
+    }
+
+    http_response_add_cache_headers(request->arena, response, request->url);
+    http_response_generate_head(response, "200 OK", "text/html");
+    return 200;
+}
+
+static void http_response_generate_service_unavailable(int request_id, Arena *arena, HTTPResponse *response)
+{
+    char retry_after[16];
+    snprintf(retry_after, sizeof(retry_after), "%d", DYNAMIC_RETRY_AFTER);
+
+    http_response_clear(response);
+    http_response_add_header(response, arena, "Retry-After", retry_after);
+    http_response_generate_internal(request_id, arena, response,
+        "503 Service Unavailable",
+        g_server_config.service_unavailable_page_file,
+        NULL, NULL
+    );
+}
+
+// Plain text "name value" lines with the internal counters
+static void http_response_generate_status(HTTPResponse *response)
+{
+    char buffer[1024];
+    DynamicExecutorStats exec;
+    ArenaStats arena;
+    CompressionCacheStats comp;
+    SocketStats conn;
+    RateLimitStats rate;
+    TimerStats timers;
+    dynamic_executor_get_stats(&exec);
+    arena_get_stats(&arena);
+    compression_cache_get_stats(&comp);
+    socket_get_stats(&conn);
+    ratelimit_get_stats(&rate);
+    timer_get_stats(&timers);
+
+    // Average over the requests that waited and got in
+    uint64_t waited = exec.queued_total - exec.queued - exec.rejected_timeout;
+    double wait_avg_ms = (waited) ? (double)exec.wait_total_us / 1000.0 / waited : 0.0;
+
+    int len = snprintf(buffer, sizeof(buffer),
+        "connections_open %d\n"
+        "connections_queued %d\n"
+        "connections_max %d\n"
+        "connections_rejected %" PRIu64 "\n"
+        "rate_limit_clients %d\n"
+        "rate_limited_static %" PRIu64 "\n"
+        "rate_limited_dynamic %" PRIu64 "\n"
+        "timers_armed %d\n"
+        "timers_fired %" PRIu64 "\n"
+        "dynamic_running %d\n"
+        "dynamic_max_procs %d\n"
+        "dynamic_queued %d\n"
+        "dynamic_queued_peak %d\n"
+        "dynamic_queue_size %d\n"
+        "dynamic_admitted %" PRIu64 "\n"
+        "dynamic_rejected_full %" PRIu64 "\n"
+        "dynamic_rejected_timeout %" PRIu64 "\n"
+        "dynamic_wait_avg_ms %.1f\n"
+        "dynamic_wait_max_ms %.1f\n"
+        "arena_high_water_bytes %zu\n"
+        "arena_resets %" PRIu64 "\n"
+        "arena_chunk_allocs %" PRIu64 "\n"
+        "arena_large_allocs %" PRIu64 "\n"
+        "compression_cache_hits %" PRIu64 "\n"
+        "compression_cache_misses %" PRIu64 "\n"
+        "compression_cache_evictions %" PRIu64 "\n"
+        "compression_cache_entries %d\n"
+        "compression_cache_bytes %zu\n",
+        conn.open, conn.queued, g_server_config.max_connections, conn.rejected,
+        rate.clients, rate.limited_static, rate.limited_dynamic,
+        timers.armed, timers.fired,
+        exec.running, g_server_config.dynamic_max_procs,
+        exec.queued, exec.peak_queued, g_server_config.dynamic_queue_size,
+        exec.admitted, exec.rejected_full, exec.rejected_timeout,
+        wait_avg_ms, (double)exec.wait_max_us / 1000.0,
+        arena.high_water, arena.resets, arena.chunk_allocs, arena.large_allocs,
+        comp.hits, comp.misses, comp.evictions, comp.entries, comp.size);
+
+    char_vector_push_arr(response->body, buffer, len);
+    http_response_generate_head(response, "200 OK", "text/plain");
+}
+
+int http_response_generate(int request_id, HTTPResponse *response, HTTPRequest *request)
+{
+    if (request->limit_status)
+    {
+        http_response_generate_over_limit(response, request->limit_status);
+        return request->limit_status;
+    }
+
     // If the request wasn't parsed correctly, return 400 Bad Request
     if (!request->okay)
     {
-        http_response_generate_bad_request(request_id, response);
+        http_response_generate_bad_request(request_id, request->arena, response);
         return 400;
     }
 
-    // Resolve "/" to "/index.html", and other paths to their URIs
-    char *resolved_path;
-    if (strcmp(request->url, "/") == 0)
+    // Methods are sorted out before anything is looked up
+    switch (request->method_type)
+    {
+    case HTTP_METHOD_UNKNOWN:
+        http_response_generate_head(response, "501 Not Implemented", NULL);
+        return 501;
+    case HTTP_METHOD_UNSUPPORTED:
+        http_response_add_header(response, request->arena, "Allow", ALLOWED_METHODS);
+        http_response_generate_head(response, "405 Method Not Allowed", NULL);
+        return 405;
+    case HTTP_METHOD_OPTIONS:
+        http_response_add_header(response, request->arena, "Allow", ALLOWED_METHODS);
+        http_response_generate_head(response, "204 No Content", NULL);
+        return 204;
+    case HTTP_METHOD_HEAD:
+        // Nothing is sent after the head, so there's nothing to stream either
+        response->head_only = true;
+        response->write = NULL;
+        break;
+    default:
+        break;
+    }
+
+    // The internal counters
+    if (g_server_config.status_url && strcmp(request->url, g_server_config.status_url) == 0)
+    {
+        if (request->method_type == HTTP_METHOD_POST)
+        {
+            http_response_generate_method_not_allowed(request->arena, response);
+            return 405;
+        }
+        http_response_generate_status(response);
+        return 200;
+    }
+
+    // The URLs served by the plugins don't have to exist
+    SsfhsHandler handler = plugin_find_url(request->url);
+    if (handler)
+    {
+        if (http_response_rate_limited(response, request, RATE_LIMIT_DYNAMIC)) { return 429; }
+        if (http_response_generate_plugin(request_id, response, request, handler))
+        {
+            http_response_generate_server_error(request_id, request->arena, response);
+            return 500;
+        }
+        return 200;
+    }
+
+    // Resolve "/" to "/index.html", and other paths to their URIs (the snapshot knows them all)
+    const char *resolved_path;
+    const SnapshotEntry *entry = NULL;
+    if (request->snapshot)
+    {
+        entry = snapshot_lookup(request->snapshot, request->url);
+        resolved_path = (entry) ? entry->file.path : NULL;
+    }
+    else if (strcmp(request->url, "/") == 0 && g_server_config.index_page_file)
     {
-        resolved_path = strdup(g_server_config.index_page_file);
+        resolved_path = g_server_config.index_page_file;
     }
     else
     {
-        resolved_path = resource_resolve_url_path(request->url);
+        resolved_path = resource_resolve_url_path(request->arena, request->url);
+    }
+
+    // Charged before any file, listing or command work, so the missing, protected and directory
+    //  paths (listings and redirects) can't be probed for free, they count as static
+    bool is_directory = resolved_path && 
+        ((entry) ? entry->is_directory : resource_is_directory(resolved_path));
+    bool is_dynamic = resolved_path && !is_directory &&
+        ((entry) ? entry->is_dynamic : resource_is_dynamic(resolved_path));
+    if (http_response_rate_limited(response, request, (is_dynamic) ? RATE_LIMIT_DYNAMIC : RATE_LIMIT_STATIC))
+    {
+        return 429;
     }
 
     // Return not found if resource isn't available
-    if (!resolved_path || !resource_is_accessible(resolved_path))
+    if (!resolved_path || (!entry && !resource_is_accessible(resolved_path)))
     {
-        if (resolved_path) { free(resolved_path); }
-        http_response_generate_not_found(request_id, response);
+        http_response_generate_not_found(request_id, request->arena, response);
         return 404;
     }
 
     // Return forbidden if resource is protected
-    if (resource_is_protected(resolved_path))
+    if ((entry) ? entry->is_protected : resource_is_protected(resolved_path))
     {
-        free(resolved_path);
-        http_response_generate_forbidden(request_id, response);
+        http_response_generate_forbidden(request_id, request->arena, response);
         return 403;
     }
 
+    // A directory is served by its index page or by a generated listing
+    if (is_directory)
+    {
+        int result = http_response_generate_directory(request_id, response, request, 
+            &resolved_path, &entry);
+        if (result) { return result; }
+
+        // A dynamic index page takes a dynamic token as well
+        is_dynamic = (entry) ? entry->is_dynamic : resource_is_dynamic(resolved_path);
+        if (is_dynamic && http_response_rate_limited(response, request, RATE_LIMIT_DYNAMIC)) { return 429; }
+    }
+
+    // Only the dynamic files can take a body
+    if (request->method_type == HTTP_METHOD_POST && !is_dynamic)
+    {
+        http_response_generate_method_not_allowed(request->arena, response);
+        return 405;
+    }
+
     // Return the normal response if there was no problem
     if (g_server_config.debug)
     {
         printf("[HTTP:GenerateResponse] Returning resource: %s\n", resolved_path);
     }
 
-    // Try to return the resource, if that fails return 500, if that fails return empty 500 code
-    if (http_response_generate_internal(request_id, response, "200 OK", resolved_path, request_str))
+    // Try to return the resource, if that fails return 500 (or 503 if we're overloaded)
+    int result = http_response_generate_internal(request_id, request->arena, response, "200 OK", 
+        resolved_path, request, entry);
+
+    // A streamed response is out already, an error can only cut it short
+    if (response->streaming)
+    {
+        return (result) ? 500 : 200;
+    }
+    if (result == RESOURCE_NOT_MODIFIED)
+    {
+        return 304;
+    }
+    if (result == RESOURCE_PARTIAL)
+    {
+        return 206;
+    }
+    if (result == RESOURCE_BAD_RANGE)
+    {
+        return 416;
+    }
+    if (result == RESOURCE_BUSY)
+    {
+        http_response_generate_service_unavailable(request_id, request->arena, response);
+        return 503;
+    }
+    if (result)
     {
-        http_response_generate_server_error(request_id, response);
+        http_response_generate_server_error(request_id, request->arena, response);
         return 500;
     }
 
     // Normal exit
-    free(resolved_path);
     return 200;
 }
 
+// Case insensitive, returns NULL if the request doesn't have the header
+const char *http_request_get_header(const HTTPRequest *request, const char *name)
+{
+    for (size_t i = 0; i < request->header_keys.count; i++)
+    {
+        if (strcasecmp(request->header_keys.items[i], name) == 0)
+        {
+            return request->header_values.items[i];
+        }
+    }
+    return NULL;
+}
+
+// Quality of a token in an Accept-* list ("gzip;q=0.5, br"), 0 if it's not acceptable
+double http_accept_quality(const char *accept, const char *token)
+{
+    double wildcard = 0.0;
+    size_t token_len = strlen(token);
+    const char *ptr = accept;
+    while (*ptr)
+    {
+        // Split the list on commas, and the element on the parameters
+        size_t elem_len = strcspn(ptr, ",");
+        const char *name = ptr;
+        size_t name_len = strcspn(ptr, ",;");
+        if (name_len > elem_len) { name_len = elem_len; }
+        strtrim_span(&name, &name_len);
+
+        double quality = 1.0;
+        const char *q = strstr(ptr, "q=");
+        if (q && q < ptr + elem_len) { quality = strtod(q + 2, NULL); }
+
+        if (name_len == token_len && strncasecmp(name, token, token_len) == 0) { return quality; }
+        if (name_len == 1 && *name == '*') { wildcard = quality; }
+
+        ptr += elem_len;
+        if (*ptr == ',') { ptr++; }
+    }
+    return wildcard;
+}
+
+// The strings live in the request arena, only the arrays are reset here
 void http_request_free(HTTPRequest *request)
 {
-    if (request->method) free(request->method);
-    if (request->url) free(request->url);
-    if (request->data) free(request->data);
     string_array_free(&request->header_keys);
     string_array_free(&request->header_values);
 }
\ No newline at end of file
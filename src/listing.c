@@ -0,0 +1,340 @@
+/**
+ * @file listing.c
+ * @author epsiii
+ * @brief Generated listings of the directories without an index page
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * A directory is read and sorted once, the entries are kept in a cache until
+ * the directory's mtime changes (a file was added, removed or renamed). The
+ * pages are rendered from the cached entries, LISTING_PAGE_SIZE at a time,
+ * so walking a huge directory doesn't read and sort it again on every hit.
+ */
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "ssfhs.h"
+
+typedef struct {
+    const char *name;           // Points into the names block of the listing
+    bool is_dir;
+    off_t size;
+    time_t mtime;
+} ListingEntry;
+
+typedef struct Listing {
+    struct Listing *next;
+    char *path;
+    struct timespec mtime;
+    ListingEntry *entries;
+    int count;
+    char *names;
+    uint64_t last_used;
+} Listing;
+
+static Listing *cache[LISTING_CACHE_BUCKETS];
+static int cache_count = 0;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void listing_free(Listing *listing)
+{
+    free(listing->path);
+    free(listing->entries);
+    free(listing->names);
+    free(listing);
+}
+
+// Directories first, then by name
+static int listing_compare(const void *a, const void *b)
+{
+    const ListingEntry *x = a;
+    const ListingEntry *y = b;
+    if (x->is_dir != y->is_dir) { return (x->is_dir) ? -1 : 1; }
+    return strcmp(x->name, y->name);
+}
+
+// Reads and sorts the directory, the protected files are left out
+static Listing *listing_read(int request_id, const char *path, const struct stat *dir_st)
+{
+    DIR *dir = opendir(path);
+    if (!dir)
+    {
+        log_error(request_id, "Could not open directory %s\n", path);
+        return NULL;
+    }
+
+    CharVector names;
+    char_vector_init(&names, MIN_BUFFER_SIZE);
+    size_t *offsets = NULL;
+    ListingEntry *entries = NULL;
+    int count = 0;
+    int capacity = 0;
+
+    char full_path[PATH_MAX];
+    struct dirent *ent;
+    while ((ent = readdir(dir)))
+    {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) { continue; }
+
+        int len = snprintf(full_path, sizeof(full_path), "%s/%s", path, ent->d_name);
+        struct stat st;
+        if (len < 0 || len >= (int)sizeof(full_path) || stat(full_path, &st) != 0) { continue; }
+        if (resource_is_protected(full_path)) { continue; }
+
+        if (count == capacity)
+        {
+            capacity = (capacity) ? capacity * 2 : 64;
+            entries = realloc(entries, capacity * sizeof(ListingEntry));
+            offsets = realloc(offsets, capacity * sizeof(size_t));
+        }
+        entries[count].is_dir = S_ISDIR(st.st_mode);
+        entries[count].size = st.st_size;
+        entries[count].mtime = st.st_mtime;
+        offsets[count] = names.count;
+        char_vector_push_arr(&names, ent->d_name, strlen(ent->d_name) + 1);
+        count++;
+    }
+    closedir(dir);
+
+    // The names block doesn't move anymore
+    for (int i = 0; i < count; i++) { entries[i].name = names.items + offsets[i]; }
+    free(offsets);
+    qsort(entries, count, sizeof(ListingEntry), listing_compare);
+
+    Listing *listing = calloc(1, sizeof(Listing));
+    listing->path = strdup(path);
+    listing->mtime = dir_st->st_mtim;
+    listing->entries = entries;
+    listing->count = count;
+    listing->names = names.items;
+
+    if (g_server_config.debug)
+    {
+        printf("[LISTING:Read] Read %d entries of %s\n", count, path);
+    }
+
+    return listing;
+}
+
+// Returns the cached listing if it's still current (mutex has to be held)
+static Listing *listing_cache_find(const char *path, const struct stat *dir_st, unsigned bucket)
+{
+    Listing **link = &cache[bucket];
+    while (*link)
+    {
+        Listing *listing = *link;
+        if (strcmp(listing->path, path) != 0)
+        {
+            link = &listing->next;
+            continue;
+        }
+
+        if (listing->mtime.tv_sec == dir_st->st_mtim.tv_sec &&
+            listing->mtime.tv_nsec == dir_st->st_mtim.tv_nsec)
+        {
+            return listing;
+        }
+
+        // The directory changed
+        *link = listing->next;
+        listing_free(listing);
+        cache_count--;
+        return NULL;
+    }
+    return NULL;
+}
+
+// Makes space for one more listing by dropping the least recently used one (mutex has to be held)
+static void listing_cache_evict(void)
+{
+    Listing **oldest = NULL;
+    for (int i = 0; i < LISTING_CACHE_BUCKETS; i++)
+    {
+        for (Listing **link = &cache[i]; *link; link = &(*link)->next)
+        {
+            if (!oldest || (*link)->last_used < (*oldest)->last_used) { oldest = link; }
+        }
+    }
+    if (!oldest) { return; }
+
+    Listing *listing = *oldest;
+    *oldest = listing->next;
+    listing_free(listing);
+    cache_count--;
+}
+
+static void listing_push_str(CharVector *out, const char *str)
+{
+    char_vector_push_arr(out, str, strlen(str));
+}
+
+static void listing_push_escaped(CharVector *out, const char *str)
+{
+    for ( ; *str; str++)
+    {
+        switch (*str)
+        {
+            case '&':  listing_push_str(out, "&amp;");  break;
+            case '<':  listing_push_str(out, "&lt;");   break;
+            case '>':  listing_push_str(out, "&gt;");   break;
+            case '"':  listing_push_str(out, "&quot;"); break;
+            case '\'': listing_push_str(out, "&#39;");  break;
+            default:   char_vector_push(out, *str);     break;
+        }
+    }
+}
+
+static void listing_push_url_encoded(CharVector *out, const char *str)
+{
+    char buffer[3 * NAME_MAX + 1];
+    char_vector_push_arr(out, buffer, url_encode(buffer, str, NULL));
+}
+
+// Renders one page of the listing (mutex has to be held)
+static void listing_render(const Listing *listing, const char *url, int page, CharVector *out)
+{
+    char buffer[256];
+    int page_size = g_server_config.listing_page_size;
+    int pages = (listing->count + page_size - 1) / page_size;
+    if (pages == 0) { pages = 1; }
+    if (page > pages) { page = pages; }
+
+    listing_push_str(out,
+        "<!DOCTYPE html>\n"
+        "<html lang=\"en\">\n"
+        "<head>\n"
+        "    <meta charset=\"UTF-8\">\n"
+        "    <title>Index of ");
+    listing_push_escaped(out, url);
+    listing_push_str(out,
+        "</title>\n"
+        "</head>\n"
+        "<body>\n"
+        "    <h1>Index of ");
+    listing_push_escaped(out, url);
+    listing_push_str(out,
+        "</h1>\n"
+        "    <table>\n"
+        "        <tr><th>Name</th><th>Size</th><th>Modified</th></tr>\n");
+    if (strcmp(url, "/") != 0)
+    {
+        listing_push_str(out, "        <tr><td><a href=\"../\">../</a></td><td>-</td><td>-</td></tr>\n");
+    }
+
+    int start = (page - 1) * page_size;
+    int end = (start + page_size < listing->count) ? start + page_size : listing->count;
+    for (int i = start; i < end; i++)
+    {
+        const ListingEntry *entry = &listing->entries[i];
+        const char *slash = (entry->is_dir) ? "/" : "";
+
+        listing_push_str(out, "        <tr><td><a href=\"");
+        listing_push_url_encoded(out, entry->name);
+        listing_push_str(out, slash);
+        listing_push_str(out, "\">");
+        listing_push_escaped(out, entry->name);
+        listing_push_str(out, slash);
+
+        struct tm tm;
+        char modified[32];
+        localtime_r(&entry->mtime, &tm);
+        strftime(modified, sizeof(modified), "%Y-%m-%d %H:%M", &tm);
+        if (entry->is_dir) { snprintf(buffer, sizeof(buffer), "</a></td><td>-</td><td>%s</td></tr>\n", modified); }
+        else
+        {
+            snprintf(buffer, sizeof(buffer), "</a></td><td>%lu</td><td>%s</td></tr>\n",
+                (unsigned long)entry->size, modified);
+        }
+        listing_push_str(out, buffer);
+    }
+    listing_push_str(out, "    </table>\n");
+
+    if (pages > 1)
+    {
+        listing_push_str(out, "    <p>");
+        if (page > 1)
+        {
+            snprintf(buffer, sizeof(buffer), "<a href=\"?page=%d\">Previous</a> ", page - 1);
+            listing_push_str(out, buffer);
+        }
+        snprintf(buffer, sizeof(buffer), "Page %d of %d", page, pages);
+        listing_push_str(out, buffer);
+        if (page < pages)
+        {
+            snprintf(buffer, sizeof(buffer), " <a href=\"?page=%d\">Next</a>", page + 1);
+            listing_push_str(out, buffer);
+        }
+        listing_push_str(out, "</p>\n");
+    }
+
+    listing_push_str(out,
+        "</body>\n"
+        "</html>\n");
+}
+
+// Appends a page of the directory's listing to out, the page numbers start at 1
+int listing_generate(int request_id, const char *path, const char *url, int page, CharVector *out)
+{
+    struct stat dir_st;
+    if (stat(path, &dir_st) != 0 || !S_ISDIR(dir_st.st_mode)) { return 1; }
+    if (page < 1) { page = 1; }
+
+    unsigned bucket = hash_string(path) % LISTING_CACHE_BUCKETS;
+    pthread_mutex_lock(&cache_mutex);
+    Listing *listing = listing_cache_find(path, &dir_st, bucket);
+    if (!listing)
+    {
+        // The directory is read without holding the lock
+        pthread_mutex_unlock(&cache_mutex);
+        Listing *fresh = listing_read(request_id, path, &dir_st);
+        if (!fresh) { return 1; }
+        pthread_mutex_lock(&cache_mutex);
+
+        // Another thread might have been faster
+        listing = listing_cache_find(path, &dir_st, bucket);
+        if (listing)
+        {
+            listing_free(fresh);
+        }
+        else
+        {
+            if (cache_count >= LISTING_CACHE_SIZE) { listing_cache_evict(); }
+            fresh->next = cache[bucket];
+            cache[bucket] = fresh;
+            cache_count++;
+            listing = fresh;
+        }
+    }
+    else if (g_server_config.debug)
+    {
+        printf("[LISTING:Cache] hit: %s\n", path);
+    }
+
+    listing->last_used = now_ms();
+    listing_render(listing, url, page, out);
+    pthread_mutex_unlock(&cache_mutex);
+
+    return 0;
+}
+
+void listing_cache_free(void)
+{
+    pthread_mutex_lock(&cache_mutex);
+    for (int i = 0; i < LISTING_CACHE_BUCKETS; i++)
+    {
+        while (cache[i])
+        {
+            Listing *listing = cache[i];
+            cache[i] = listing->next;
+            listing_free(listing);
+        }
+    }
+    cache_count = 0;
+    pthread_mutex_unlock(&cache_mutex);
+}
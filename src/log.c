@@ -60,7 +60,7 @@ void log_error(int conn_id, const char *format, ...)
     va_end(args);
 
     fputs(log_buffer, stderr);
-    if (g_server_config.log_file)
+    if (log_file)
     {
         fputs(log_buffer, log_file);
     }
@@ -77,7 +77,7 @@ void log_message(int conn_id, const char *format, ...)
     va_end(args);
 
     fputs(log_buffer, stdout);
-    if (g_server_config.log_file)
+    if (log_file)
     {
         fputs(log_buffer, log_file);
     }
@@ -1,39 +1,329 @@
+#define _GNU_SOURCE  // pipe2()
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/wait.h>
 #include "ssfhs.h"
 
-ServerConfig g_server_config;
+extern char **environ;
+
 static int listen_fd;
+static char **server_argv;
+static char server_exe[PATH_MAX];
+static sem_t control_sem;
+static volatile sig_atomic_t reload_requested = 0;
+static volatile sig_atomic_t upgrade_requested = 0;
+static volatile sig_atomic_t shutdown_requested = 0;
+
+// Only wakes up the control thread, nothing else is safe in a signal handler
+static void control_signal(int signal)
+{
+    if (signal == SIGHUP) { reload_requested = 1; }
+    else if (signal == SIGUSR2) { upgrade_requested = 1; }
+    else
+    {
+        // The second SIGINT/SIGTERM doesn't wait for the drain
+        if (shutdown_requested) { _exit(EXIT_FAILURE); }
+        shutdown_requested = 1;
+    }
+    sem_post(&control_sem);
+}
+
+static void reload(void)
+{
+    log_message(0, "Reloading the config...\n");
+    if (config_reload())
+    {
+        log_error(0, "Could not reload the config, keeping the old one\n");
+    }
+    else
+    {
+        // The listings were filtered with the old PROTECTED entries, the templates
+        //  were compiled with the old DYNAMIC_CACHE rules
+        listing_cache_free();
+        template_cache_flush();
+    }
+
+    // After the config, so the new index follows the new PROTECTED/DYNAMIC files
+    if (!g_server_config.snapshot) { return; }
+    log_message(0, "Reloading the snapshot of the root directory...\n");
+    if (snapshot_reload())
+    {
+        log_error(0, "Could not rebuild the snapshot, keeping the old one\n");
+    }
+}
+
+// The environment of the new binary, with the listening socket and the pipe it reports on
+static char **upgrade_environment(char *listen_var, char *ready_var)
+{
+    int count = 0;
+    while (environ[count]) { count++; }
+
+    char **env = calloc(count + 3, sizeof(char*));
+    memcpy(env, environ, count * sizeof(char*));
+    env[count] = listen_var;
+    env[count + 1] = ready_var;
+    return env;
+}
+
+// Starts the binary again on the same listening socket, returns once it's serving (non-zero if it failed)
+static int upgrade(void)
+{
+    int ready[2];
+    if (pipe2(ready, O_CLOEXEC))
+    {
+        log_error(0, "Could not create the upgrade pipe: %s\n", strerror(errno));
+        return 1;
+    }
+
+    // Everything is prepared before the fork, the child only calls async-signal-safe functions
+    uint64_t start = now_us();
+    char listen_var[64];
+    char ready_var[64];
+    snprintf(listen_var, sizeof(listen_var), "%s=%d", LISTEN_FD_ENV, listen_fd);
+    snprintf(ready_var, sizeof(ready_var), "%s=%d", READY_FD_ENV, ready[1]);
+    char **env = upgrade_environment(listen_var, ready_var);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        fcntl(listen_fd, F_SETFD, 0);
+        fcntl(ready[1], F_SETFD, 0);
+        execve(server_exe, server_argv, env);
+        _exit(127);
+    }
+    free(env);
+    close(ready[1]);
 
-void clean_exit(int signal)
+    if (pid < 0)
+    {
+        close(ready[0]);
+        log_error(0, "Could not start the new binary: %s\n", strerror(errno));
+        return 1;
+    }
+
+    // A byte means it's serving, EOF that it exited before that
+    struct pollfd pfd = { .fd = ready[0], .events = POLLIN };
+    char byte;
+    int res;
+    do { res = poll(&pfd, 1, UPGRADE_READY_TIMEOUT); } while (res < 0 && errno == EINTR);
+    bool ready_ok = res == 1 && read(ready[0], &byte, 1) == 1;
+    close(ready[0]);
+
+    if (!ready_ok)
+    {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        log_error(0, "The new binary (%s) didn't start, still serving\n", server_exe);
+        return 1;
+    }
+
+    log_message(0, "Handed the listening socket over to process %d after %.1fms\n",
+        (int)pid, (float)(now_us() - start) / 1000.0);
+    return 0;
+}
+
+// Tells the process that started this one in an upgrade that it can stop accepting
+static void upgrade_report_ready(void)
 {
-    (void)signal;
+    const char *value = getenv(READY_FD_ENV);
+    if (!value) { return; }
+    unsetenv(READY_FD_ENV);
 
-    log_message(0, "Shutting down server...\n");
+    int fd = atoi(value);
+    char byte = 1;
+    if (write(fd, &byte, 1) != 1)
+    {
+        log_error(0, "Could not report to the previous process: %s\n", strerror(errno));
+    }
+    close(fd);
+}
 
+static void* control_thread(void *arg)
+{
+    (void)arg;
+    for ( ;; )
+    {
+        if (sem_wait(&control_sem)) { continue; }
+
+        if (shutdown_requested)
+        {
+            log_message(0, "Shutting down server...\n");
+            break;
+        }
+
+        if (upgrade_requested)
+        {
+            upgrade_requested = 0;
+            log_message(0, "Upgrading to %s...\n", server_exe);
+            if (upgrade() == 0) { break; }
+        }
+
+        if (reload_requested)
+        {
+            reload_requested = 0;
+            reload();
+        }
+    }
+
+    // The requests that were already accepted are finished by the main thread
+    socket_stop_accepting();
+    return NULL;
+}
+
+static void control_start(void)
+{
+    pthread_t tid;
+    sem_init(&control_sem, 0, 0);
+    if (pthread_create(&tid, NULL, control_thread, NULL))
+    {
+        fprintf(stderr, "Failed to create the control thread\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(tid);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = control_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGHUP, &action, NULL);
+    sigaction(SIGUSR2, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    // A client that went away (or a connection shut down by its deadline) is an error from send()
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &action, NULL);
+}
+
+// Waits for the accepted connections, the rest is only freed if they all finished in time
+static void clean_exit(void)
+{
     close(listen_fd);
+    int left = socket_drain(g_server_config.drain_timeout_ms);
+    if (left)
+    {
+        log_error(0, "%d connections still open after %dms, exiting anyway\n",
+            left, g_server_config.drain_timeout_ms);
+    }
+
+    ArenaStats stats;
+    arena_get_stats(&stats);
+    log_message(0, "Arena stats: high-water %zu bytes, %" PRIu64 " resets, %" PRIu64 " extra chunks, %" PRIu64 " heap fallbacks\n",
+        stats.high_water, stats.resets, stats.chunk_allocs, stats.large_allocs);
+
+    DynamicExecutorStats exec;
+    dynamic_executor_get_stats(&exec);
+    log_message(0, "Dynamic executor stats: %" PRIu64 " admitted, %" PRIu64 " rejected (queue full), %" PRIu64 " rejected (timeout), "
+        "peak queue %d, max wait %.1fms\n",
+        exec.admitted, exec.rejected_full, exec.rejected_timeout, exec.peak_queued,
+        (float)exec.wait_max_us / 1000.0);
+
+    CompressionCacheStats comp;
+    compression_cache_get_stats(&comp);
+    log_message(0, "Compression cache stats: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " evictions, %d entries (%zu bytes)\n",
+        comp.hits, comp.misses, comp.evictions, comp.entries, comp.size);
+
+    SocketStats conn;
+    socket_get_stats(&conn);
+    log_message(0, "Connection stats: %" PRIu64 " refused over capacity\n", conn.rejected);
+
+    if (g_server_config.dynamic_backend == DYNAMIC_BACKEND_WORKER)
+    {
+        dynamic_workers_stop();
+    }
+    // The workers still running keep using all the rest (exit() flushes the log)
+    if (left) { exit(EXIT_SUCCESS); }
+
+    dynamic_environment_free();
+    plugin_unload_all();
+    compression_cache_free();
+    listing_cache_free();
+    ratelimit_free();
+    snapshot_free();
     log_close_file();
-    config_free(&g_server_config);
+    ServerConfig *config = &g_server_config;
+    config_free(config);
+    free(config);
     exit(EXIT_SUCCESS);
 }
 
-int main(int argc, char **argv) 
+// Finds argv[0] the way the shell did (in PATH unless it has a slash) and stores its absolute
+//  path, returns non-zero if it can't be found
+static int resolve_server_exe(const char *arg0)
+{
+    if (strchr(arg0, '/')) { return realpath(arg0, server_exe) == NULL; }
+
+    const char *path = getenv("PATH");
+    if (!path) { return 1; }
+
+    char candidate[PATH_MAX];
+    while (*path)
+    {
+        size_t len = strcspn(path, ":");
+        // An empty entry is the current directory
+        int n = (len) ? snprintf(candidate, sizeof(candidate), "%.*s/%s", (int)len, path, arg0)
+            : snprintf(candidate, sizeof(candidate), "./%s", arg0);
+        if (n > 0 && (size_t)n < sizeof(candidate) && access(candidate, X_OK) == 0 &&
+            realpath(candidate, server_exe))
+        {
+            return 0;
+        }
+        path += len;
+        if (*path == ':') { path++; }
+    }
+    return 1;
+}
+
+int main(int argc, char **argv)
 {
-    signal(SIGINT, clean_exit);
-    signal(SIGTERM, clean_exit);
+    // An upgrade runs the same command line again from the path of the binary, so a new one
+    //  installed over it is started. /proc/self/exe would run the old inode again
+    server_argv = argv;
+    bool exe_resolved = !resolve_server_exe(argv[0]);
+    if (!exe_resolved) { snprintf(server_exe, sizeof(server_exe), "/proc/self/exe"); }
 
-    cli_args_parse(&g_server_config, argc, (const char **)argv);
-    config_load(&g_server_config);
+    // One config slot for every worker thread and one for the accepting thread
+    ServerConfig *config = calloc(1, sizeof(ServerConfig));
+    cli_args_parse(config, argc, (const char **)argv);
+    if (config_load(config)) { exit(EXIT_FAILURE); }
+    config_publish(config, config->worker_threads + 1);
     log_open_file();
+    if (!exe_resolved)
+    {
+        log_error(0, "Could not find the path of %s, an upgrade will restart the running binary\n", argv[0]);
+    }
 
-    listen_fd = socket_open(g_server_config.port);
-    log_message(0, "Server listening on port [%d]\n", g_server_config.port);
+    // Taken over from the previous process during an upgrade
+    listen_fd = socket_inherit();
+    if (listen_fd < 0) { listen_fd = socket_open(g_server_config.port); }
 
-    for ( ;; )
+    dynamic_environment_init();
+    ratelimit_init();
+    plugin_load_all();
+    if (g_server_config.dynamic_backend == DYNAMIC_BACKEND_WORKER)
     {
-        socket_accept_connection(listen_fd);
+        dynamic_workers_start();
     }
+    if (g_server_config.snapshot)
+    {
+        snapshot_init();
+    }
+    socket_start_workers();
+    control_start();
+    log_message(0, "Server listening on port [%d]\n", g_server_config.port);
+    upgrade_report_ready();
 
-    clean_exit(0);
-}
\ No newline at end of file
+    while (socket_accept_connection(listen_fd) >= 0) { }
+
+    clean_exit();
+}
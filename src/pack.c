@@ -0,0 +1,103 @@
+/**
+ * @file pack.c
+ * @author epsiii
+ * @brief ssfhs-pack, packs a root directory into a site archive (ssfhs --archive)
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * The archive holds the sorted index of the root with the content types
+ * and the metadata the ETags are made of, followed by the contents of the
+ * static files (aligned, so they can be mapped and sent as they are). The
+ * protected files only get an entry, and the dynamic files stay where they
+ * are because they are executed from the root directory.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "ssfhs.h"
+
+static void print_help_and_exit(const char *prog_name, int status)
+{
+    printf("Usage: %s [options] -o [ARCHIVE]\n", prog_name);
+    printf("Options:\n");
+    printf("  -h, --help                    Show this help message and exit.\n");
+    printf("  -d, --root-dir [DIR]          Root directory to pack (default: .).\n");
+    printf("  -c, --config-file [FILE]      Server config file (default: ./ssfhs.conf).\n");
+    printf("  -o, --output [FILE]           Archive to write.\n");
+    printf("  -z, --compress                Add the Brotli/gzip copies of the compressible files.\n");
+    printf("  -v, --debug                   Enable debug logs.\n");
+
+    exit(status);
+}
+
+int main(int argc, char **argv)
+{
+    ServerConfig *config = calloc(1, sizeof(ServerConfig));
+    config->root_dir = ".";
+    config->config_file = "./ssfhs.conf";
+    const char *output = NULL;
+    bool compress = false;
+
+    for (int arg_index = 1; arg_index < argc; arg_index++)
+    {
+        const char *arg = argv[arg_index];
+        bool has_value = arg_index + 1 < argc;
+
+        if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0)
+        {
+            print_help_and_exit(argv[0], EXIT_SUCCESS);
+        }
+        else if ((strcmp(arg, "--root-dir") == 0 || strcmp(arg, "-d") == 0) && has_value)
+        {
+            config->root_dir = argv[++arg_index];
+        }
+        else if ((strcmp(arg, "--config-file") == 0 || strcmp(arg, "-c") == 0) && has_value)
+        {
+            config->config_file = argv[++arg_index];
+        }
+        else if ((strcmp(arg, "--output") == 0 || strcmp(arg, "-o") == 0) && has_value)
+        {
+            output = argv[++arg_index];
+        }
+        else if (strcmp(arg, "--compress") == 0 || strcmp(arg, "-z") == 0)
+        {
+            compress = true;
+        }
+        else if (strcmp(arg, "--debug") == 0 || strcmp(arg, "-v") == 0)
+        {
+            config->debug = true;
+        }
+        else
+        {
+            fprintf(stderr, "Unknown argument: %s\n", arg);
+            print_help_and_exit(argv[0], EXIT_FAILURE);
+        }
+    }
+    if (!output)
+    {
+        print_help_and_exit(argv[0], EXIT_FAILURE);
+    }
+
+    // The same paths the server resolves, the strings are owned by config_free()
+    config->root_dir = realpath(config->root_dir, NULL);
+    if (!config->root_dir || access(config->config_file, F_OK) != 0)
+    {
+        fprintf(stderr, "Could not open the root directory or the config file: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    config->config_file = strdup(config->config_file);
+    if (config_load(config)) { return EXIT_FAILURE; }
+    config_publish(config, 1);
+
+    // The copies are made once, so they can as well be the smallest ones
+    config->compression = compress;
+    config->compression_level = 11;
+
+    int result = snapshot_write_archive(output, compress);
+    config_free(config);
+    free(config);
+    return (result) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
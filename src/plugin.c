@@ -0,0 +1,186 @@
+/**
+ * @file plugin.c
+ * @author epsiii
+ * @brief Handlers loaded from shared objects (see ssfhs_plugin.h)
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include "ssfhs.h"
+
+typedef struct {
+    void *handle;
+    const char *path;
+    const SsfhsHandlerEntry *handlers;
+    void (*fini)(void);
+} LoadedPlugin;
+
+typedef struct {
+    const char *url;
+    SsfhsHandler handler;
+} PluginRoute;
+
+static LoadedPlugin *plugins = NULL;
+static int plugin_count = 0;
+static PluginRoute *routes = NULL;
+static int route_count = 0;
+
+// dlsym() for functions, ISO C has no cast between object and function pointers
+static void plugin_function(void *handle, const char *name, void *function)
+{
+    void *symbol = dlsym(handle, name);
+    memcpy(function, &symbol, sizeof(symbol));
+}
+
+static void plugin_load(const char *path)
+{
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle)
+    {
+        fprintf(stderr, "Could not load plugin: %s\n", dlerror());
+        exit(EXIT_FAILURE);
+    }
+
+    // Refuse the plugins built against a different interface
+    const int *version = dlsym(handle, "ssfhs_plugin_api_version");
+    if (!version || *version != SSFHS_PLUGIN_API_VERSION)
+    {
+        fprintf(stderr, "Plugin %s was built for API version %d, expected %d\n",
+            path, version ? *version : -1, SSFHS_PLUGIN_API_VERSION);
+        exit(EXIT_FAILURE);
+    }
+
+    const SsfhsHandlerEntry *handlers = dlsym(handle, "ssfhs_plugin_handlers");
+    if (!handlers)
+    {
+        fprintf(stderr, "Plugin %s doesn't export ssfhs_plugin_handlers\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    int (*init)(void);
+    plugin_function(handle, "ssfhs_plugin_init", &init);
+    if (init && init())
+    {
+        fprintf(stderr, "Plugin %s failed to initialize\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    LoadedPlugin *plugin = &plugins[plugin_count++];
+    plugin->handle = handle;
+    plugin->path = path;
+    plugin->handlers = handlers;
+    plugin_function(handle, "ssfhs_plugin_fini", &plugin->fini);
+
+    if (g_server_config.debug)
+    {
+        printf("[PLUGIN:Load] Loaded %s\n", path);
+    }
+}
+
+// Loads the plugins and resolves the URL handlers, a failure stops the server
+void plugin_load_all(void)
+{
+    plugins = calloc(g_server_config.plugin_files.count + 1, sizeof(LoadedPlugin));
+    for (size_t i = 0; i < g_server_config.plugin_files.count; i++)
+    {
+        plugin_load(g_server_config.plugin_files.items[i]);
+    }
+
+    routes = calloc(g_server_config.plugin_url_count + 1, sizeof(PluginRoute));
+    for (int i = 0; i < g_server_config.plugin_url_count; i++)
+    {
+        const PluginUrlRule *rule = &g_server_config.plugin_urls[i];
+        SsfhsHandler handler = plugin_find_handler(rule->handler);
+        if (!handler)
+        {
+            fprintf(stderr, "No plugin exports a handler named: %s\n", rule->handler);
+            exit(EXIT_FAILURE);
+        }
+        routes[route_count].url = rule->url;
+        routes[route_count].handler = handler;
+        route_count++;
+    }
+}
+
+void plugin_unload_all(void)
+{
+    for (int i = 0; i < plugin_count; i++)
+    {
+        if (plugins[i].fini) { plugins[i].fini(); }
+        dlclose(plugins[i].handle);
+    }
+    free(plugins);
+    free(routes);
+    plugins = NULL;
+    routes = NULL;
+    plugin_count = route_count = 0;
+}
+
+SsfhsHandler plugin_find_handler(const char *name)
+{
+    for (int i = 0; i < plugin_count; i++)
+    {
+        for (const SsfhsHandlerEntry *entry = plugins[i].handlers; entry->name; entry++)
+        {
+            if (strcmp(entry->name, name) == 0) { return entry->handler; }
+        }
+    }
+    return NULL;
+}
+
+SsfhsHandler plugin_find_url(const char *url)
+{
+    for (int i = 0; i < route_count; i++)
+    {
+        if (strcmp(routes[i].url, url) == 0) { return routes[i].handler; }
+    }
+    return NULL;
+}
+
+static int plugin_write(SsfhsWriter *writer, const void *data, size_t len)
+{
+    char_vector_push_arr(writer->internal, data, len);
+    return 0;
+}
+
+// Calls the handler, the output is appended to out (the request is NULL for the error pages)
+int plugin_run(int request_id, SsfhsHandler handler, const HTTPRequest *request,
+    CharVector *out, const char **content_type)
+{
+    SsfhsRequest view;
+    memset(&view, 0, sizeof(view));
+    view.request_id = request_id;
+    view.method = view.url = view.query = view.remote_addr = "";
+    if (request)
+    {
+        view.method = request->method;
+        view.url = request->url;
+        view.query = request->query;
+        view.remote_addr = (request->remote_addr) ? request->remote_addr : "";
+        view.header_keys = (const char *const *)request->header_keys.items;
+        view.header_values = (const char *const *)request->header_values.items;
+        view.header_count = request->header_keys.count;
+        view.body = request->data;
+        view.body_len = request->data_len;
+    }
+
+    SsfhsWriter writer;
+    writer.write = plugin_write;
+    writer.content_type = NULL;
+    writer.internal = out;
+
+    int result = handler(&view, &writer);
+    if (result)
+    {
+        log_error(request_id, "Plugin handler failed with: %d\n", result);
+        return 1;
+    }
+
+    if (content_type) { *content_type = writer.content_type; }
+    return 0;
+}
@@ -0,0 +1,270 @@
+/**
+ * @file ratelimit.c
+ * @author epsiii
+ * @brief Per client token buckets for the static and the dynamic requests
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * A client is an IPv4 address or an IPv6 /64 (one host usually gets a whole
+ * /64, so single addresses would be free to rotate). The clients are spread
+ * over RATE_LIMIT_SHARDS hash tables with a lock each, so the workers only
+ * contend when they serve clients of the same shard. A client whose buckets
+ * would be full again is the same as a new one, so those are dropped when
+ * their shard is swept, at most every RATE_LIMIT_SWEEP_INTERVAL.
+ */
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "ssfhs.h"
+
+typedef struct RateLimitClient {
+    struct RateLimitClient *next;           // Bucket chain
+    struct RateLimitClient *lru_prev;
+    struct RateLimitClient *lru_next;
+    unsigned bucket;
+    uint64_t key;
+    int family;
+    double tokens[RATE_LIMIT_CLASSES];
+    uint64_t refilled_us;
+} RateLimitClient;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    RateLimitClient *buckets[RATE_LIMIT_SHARD_BUCKETS];
+    RateLimitClient *lru_head;              // Most recently used
+    RateLimitClient *lru_tail;
+    int count;
+    uint64_t swept_ms;
+} RateLimitShard;
+
+static RateLimitShard shards[RATE_LIMIT_SHARDS];
+static atomic_uint_fast64_t limited[RATE_LIMIT_CLASSES];
+
+void ratelimit_init(void)
+{
+    for (int i = 0; i < RATE_LIMIT_SHARDS; i++)
+    {
+        pthread_mutex_init(&shards[i].mutex, NULL);
+    }
+}
+
+// The address, or the /64 of an IPv6 one (IPv4 mapped addresses count as IPv4)
+static void ratelimit_client_key(const struct sockaddr_storage *addr, uint64_t *key, int *family)
+{
+    if (addr->ss_family == AF_INET6)
+    {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+        const uint8_t *bytes = in6->sin6_addr.s6_addr;
+        if (!IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr))
+        {
+            memcpy(key, bytes, sizeof(*key));
+            *family = AF_INET6;
+            return;
+        }
+        *key = ((uint64_t)bytes[12] << 24) | (bytes[13] << 16) | (bytes[14] << 8) | bytes[15];
+        *family = AF_INET;
+        return;
+    }
+
+    const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+    *key = ntohl(in->sin_addr.s_addr);
+    *family = AF_INET;
+}
+
+// splitmix64, the addresses of one network only differ in a few bits
+static uint64_t ratelimit_hash(uint64_t key, int family)
+{
+    uint64_t x = key ^ ((uint64_t)family << 56);
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+static const RateLimitRule *ratelimit_rule(int class)
+{
+    if (class == RATE_LIMIT_DYNAMIC) { return &g_server_config.rate_limit_dynamic; }
+    return &g_server_config.rate_limit_static;
+}
+
+// Adds the tokens earned since the last refill, up to the burst
+static void ratelimit_refill(RateLimitClient *client, uint64_t now)
+{
+    double elapsed = (double)(now - client->refilled_us) / 1000000.0;
+    for (int i = 0; i < RATE_LIMIT_CLASSES; i++)
+    {
+        const RateLimitRule *rule = ratelimit_rule(i);
+        if (!rule->rate) { continue; }
+        client->tokens[i] += elapsed * rule->rate;
+        if (client->tokens[i] > rule->burst) { client->tokens[i] = rule->burst; }
+    }
+    client->refilled_us = now;
+}
+
+// Whether the buckets are full, the client can be forgotten then
+static bool ratelimit_is_idle(RateLimitClient *client, uint64_t now)
+{
+    ratelimit_refill(client, now);
+    for (int i = 0; i < RATE_LIMIT_CLASSES; i++)
+    {
+        const RateLimitRule *rule = ratelimit_rule(i);
+        if (rule->rate && client->tokens[i] < rule->burst) { return false; }
+    }
+    return true;
+}
+
+static void ratelimit_lru_unlink(RateLimitShard *shard, RateLimitClient *client)
+{
+    if (client->lru_prev) { client->lru_prev->lru_next = client->lru_next; }
+    else { shard->lru_head = client->lru_next; }
+    if (client->lru_next) { client->lru_next->lru_prev = client->lru_prev; }
+    else { shard->lru_tail = client->lru_prev; }
+    client->lru_prev = client->lru_next = NULL;
+}
+
+static void ratelimit_lru_push(RateLimitShard *shard, RateLimitClient *client)
+{
+    client->lru_prev = NULL;
+    client->lru_next = shard->lru_head;
+    if (shard->lru_head) { shard->lru_head->lru_prev = client; }
+    shard->lru_head = client;
+    if (!shard->lru_tail) { shard->lru_tail = client; }
+}
+
+// Drops the idle clients of the shard (mutex has to be held)
+static void ratelimit_sweep(RateLimitShard *shard, uint64_t now)
+{
+    for (int i = 0; i < RATE_LIMIT_SHARD_BUCKETS; i++)
+    {
+        RateLimitClient **link = &shard->buckets[i];
+        while (*link)
+        {
+            RateLimitClient *client = *link;
+            if (!ratelimit_is_idle(client, now))
+            {
+                link = &client->next;
+                continue;
+            }
+            *link = client->next;
+            ratelimit_lru_unlink(shard, client);
+            free(client);
+            shard->count--;
+        }
+    }
+    shard->swept_ms = now / 1000;
+}
+
+// Makes space in a full shard by dropping the least recently used client, only its bucket
+//  is walked (mutex has to be held)
+static void ratelimit_evict(RateLimitShard *shard)
+{
+    RateLimitClient *client = shard->lru_tail;
+    if (!client) { return; }
+
+    RateLimitClient **link = &shard->buckets[client->bucket];
+    while (*link && *link != client) { link = &(*link)->next; }
+    if (*link) { *link = client->next; }
+    ratelimit_lru_unlink(shard, client);
+    free(client);
+    shard->count--;
+}
+
+// Takes a token from the client's budget for the class, returns 0 if it got one or the seconds
+//  until it gets the next one (for Retry-After)
+int ratelimit_take(const struct sockaddr_storage *addr, int class)
+{
+    const RateLimitRule *rule = ratelimit_rule(class);
+    if (!rule->rate) { return 0; }
+
+    uint64_t key;
+    int family;
+    ratelimit_client_key(addr, &key, &family);
+    uint64_t hash = ratelimit_hash(key, family);
+    RateLimitShard *shard = &shards[hash % RATE_LIMIT_SHARDS];
+    unsigned bucket = (hash / RATE_LIMIT_SHARDS) % RATE_LIMIT_SHARD_BUCKETS;
+
+    // Read under the lock, an earlier time than the client's last refill would wrap around
+    pthread_mutex_lock(&shard->mutex);
+    uint64_t now = now_us();
+    if (now / 1000 - shard->swept_ms >= RATE_LIMIT_SWEEP_INTERVAL)
+    {
+        ratelimit_sweep(shard, now);
+    }
+
+    RateLimitClient *client = shard->buckets[bucket];
+    while (client && (client->key != key || client->family != family)) { client = client->next; }
+    if (!client)
+    {
+        if (shard->count >= RATE_LIMIT_SHARD_SIZE) { ratelimit_evict(shard); }
+
+        // A new client starts with full buckets
+        client = calloc(1, sizeof(RateLimitClient));
+        client->bucket = bucket;
+        client->key = key;
+        client->family = family;
+        client->refilled_us = now;
+        for (int i = 0; i < RATE_LIMIT_CLASSES; i++) { client->tokens[i] = ratelimit_rule(i)->burst; }
+        client->next = shard->buckets[bucket];
+        shard->buckets[bucket] = client;
+        shard->count++;
+    }
+    else
+    {
+        ratelimit_refill(client, now);
+        ratelimit_lru_unlink(shard, client);
+    }
+    ratelimit_lru_push(shard, client);
+
+    int retry_after = 0;
+    if (client->tokens[class] >= 1.0)
+    {
+        client->tokens[class] -= 1.0;
+    }
+    else
+    {
+        double wait = (1.0 - client->tokens[class]) / rule->rate;
+        retry_after = (int)wait;
+        if (retry_after < wait) { retry_after++; }
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (retry_after) { atomic_fetch_add(&limited[class], 1); }
+    return retry_after;
+}
+
+void ratelimit_free(void)
+{
+    for (int i = 0; i < RATE_LIMIT_SHARDS; i++)
+    {
+        RateLimitShard *shard = &shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        for (int j = 0; j < RATE_LIMIT_SHARD_BUCKETS; j++)
+        {
+            while (shard->buckets[j])
+            {
+                RateLimitClient *client = shard->buckets[j];
+                shard->buckets[j] = client->next;
+                free(client);
+            }
+        }
+        shard->lru_head = shard->lru_tail = NULL;
+        shard->count = 0;
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+void ratelimit_get_stats(RateLimitStats *stats)
+{
+    stats->clients = 0;
+    for (int i = 0; i < RATE_LIMIT_SHARDS; i++)
+    {
+        pthread_mutex_lock(&shards[i].mutex);
+        stats->clients += shards[i].count;
+        pthread_mutex_unlock(&shards[i].mutex);
+    }
+    stats->limited_static = atomic_load(&limited[RATE_LIMIT_STATIC]);
+    stats->limited_dynamic = atomic_load(&limited[RATE_LIMIT_DYNAMIC]);
+}
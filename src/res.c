@@ -8,20 +8,26 @@
  * 
  */
 #include "ssfhs.h"
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
-char *resource_resolve_url_path(const char *path)
+char *resource_resolve_url_path(Arena *arena, const char *path)
 {
+    char root_real_path[PATH_MAX];
+    char combined_path[PATH_MAX];
+    char resolved_path[PATH_MAX];
+
     // Combine the root and resource path
-    char *root_real_path = realpath(g_server_config.root_dir, NULL);
-    int combined_len = strlen(root_real_path) + strlen(path);
-    char *combined_path = malloc(combined_len + 1);
-    memcpy(combined_path, root_real_path, strlen(root_real_path));
-    memcpy(combined_path + strlen(root_real_path), path, strlen(path));
-    combined_path[combined_len] = '\0';
+    if (!realpath(g_server_config.root_dir, root_real_path)) { return NULL; }
+    size_t root_len = strlen(root_real_path);
+    int combined_len = snprintf(combined_path, sizeof(combined_path), "%s%s", root_real_path, path);
+    if (combined_len < 0 || combined_len >= (int)sizeof(combined_path)) { return NULL; }
 
     if (g_server_config.debug)
     {
@@ -29,29 +35,23 @@ char *resource_resolve_url_path(const char *path)
     }
 
     // Resolve the path
-    char *resolved_path = realpath(combined_path, NULL);
-    free(combined_path);
-    if (!resolved_path)
+    if (!realpath(combined_path, resolved_path))
     {
-        free(root_real_path);
         return NULL;
     }
     
     // Return NULL if we exited the root
-    if (strncmp(resolved_path, root_real_path, strlen(root_real_path)) != 0)
+    if (strncmp(resolved_path, root_real_path, root_len) != 0)
     {
-        free(resolved_path);
-        free(root_real_path);
         return NULL;
     }
-    free(root_real_path);
 
     if (g_server_config.debug)
     {
         printf("[RES:PathResolve] Generated final path: %s\n", resolved_path);
     }
 
-    return resolved_path;
+    return arena_strdup(arena, resolved_path);
 }
 
 // Path already has to be resolved
@@ -89,17 +89,43 @@ bool resource_is_dynamic(const char *path)
     return false;
 }
 
-static char* resource_get_extension(const char *path)
+// Path already has to be resolved
+bool resource_is_directory(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// The directory's own index page (named like INDEX_PAGE, or index.html), NULL if there's none
+const char *resource_find_directory_index(Arena *arena, const char *path)
+{
+    const char *name = "index.html";
+    if (g_server_config.index_page_file)
+    {
+        const char *sep = strrchr(g_server_config.index_page_file, '/');
+        name = (sep) ? sep + 1 : g_server_config.index_page_file;
+    }
+
+    char index_path[PATH_MAX];
+    int len = snprintf(index_path, sizeof(index_path), "%s/%s", path, name);
+    if (len < 0 || len >= (int)sizeof(index_path)) { return NULL; }
+
+    struct stat st;
+    if (stat(index_path, &st) != 0 || !S_ISREG(st.st_mode)) { return NULL; }
+    return arena_strdup(arena, index_path);
+}
+
+static const char* resource_get_extension(const char *path)
 {
     // Find the last separator
-    char *ptr = strrchr(path, '.');
+    const char *ptr = strrchr(path, '.');
     if (!ptr) { return NULL; }
 
-    // Duplicate the string after the separator
-    return strdup(ptr + 1);
+    // Return the string after the separator
+    return ptr + 1;
 }
 
-char* resource_get_content_type(const char *path)
+const char* resource_get_content_type(const char *path)
 {
     // Not even near all of them but ig it's good approximation for now
     // Even indices - keys, odd indices - values
@@ -133,54 +159,163 @@ char* resource_get_content_type(const char *path)
     const char *default_type = "application/octet-stream";
 
     // Try to map the extension
-    char *ext = resource_get_extension(path);
-    if (!ext) { goto fallback; }
+    const char *ext = resource_get_extension(path);
+    if (!ext) { return default_type; }
     for (size_t i = 0; i < sizeof(map) / sizeof(*map); i += 2)
     {
         if (strcmp(ext, map[i]) == 0)
         {
-            free(ext);
-            return strdup(map[i + 1]);
+            return map[i + 1];
         }
     }
 
     // If failed - fall back to octet-stream
-    fallback:
-    free(ext);
-    return strdup(default_type);
+    return default_type;
 }
 
-int resource_get(int request_id, void **buff, size_t *buffsz, const char *path, const char *request_str)
+// Strong validator of a file version, every encoding is a different representation
+const char *resource_get_etag(Arena *arena, const struct stat *st, const char *encoding)
 {
-    // Open the file
-    FILE *f = fopen(path, "r");
-    fseek(f, 0, SEEK_END);
-    *buffsz = ftell(f);
-    fseek(f, 0, SEEK_SET);
+    char buffer[96];
+    snprintf(buffer, sizeof(buffer), "\"%lx-%lx-%lx.%lx%s%s\"",
+        (unsigned long)st->st_ino, (unsigned long)st->st_size,
+        (unsigned long)st->st_mtim.tv_sec, (unsigned long)st->st_mtim.tv_nsec,
+        (encoding) ? "-" : "", (encoding) ? encoding : "");
+    return arena_strdup(arena, buffer);
+}
+
+// Precompressed siblings of the static files, in the order of preference on a tie
+static const char *encoding_map[] =
+{
+    "br",   ".br",
+    "gzip", ".gz",
+};
+_Static_assert(sizeof(encoding_map) / sizeof(*encoding_map) == 2 * RESOURCE_ENCODING_VARIANTS,
+    "RESOURCE_ENCODING_VARIANTS doesn't match the encoding map");
+
+// Encoding of the index-th precompressed sibling, the suffix is the one of its file name
+const char *resource_get_encoding_variant(int index, const char **suffix)
+{
+    *suffix = encoding_map[index * 2 + 1];
+    return encoding_map[index * 2];
+}
+
+// Picks the smallest variant of the file the client accepts ("file.br", "file.gz" or the file
+//  itself), has_variants is set if there are any so the response can be marked with Vary
+const char *resource_select_encoding(Arena *arena, const char *path, const char *accept_encoding,
+    const char **encoding, bool *has_variants)
+{
+    *encoding = NULL;
+    *has_variants = false;
 
-    // Allocate the space for the resource and get it
-    *buff = malloc(*buffsz);
-    int rb = fread(*buff, 1, *buffsz, f);
-    if (rb != (int)(*buffsz))
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) { return path; }
+
+    const char *best_path = path;
+    off_t best_size = st.st_size;
+    size_t path_len = strlen(path);
+    for (size_t i = 0; i < sizeof(encoding_map) / sizeof(*encoding_map); i += 2)
     {
-        fclose(f);
-        log_error(0, "Something went wrong when accessing resource, read %d/%ld\n", 
-            rb, *buffsz);
-        return rb;
+        // Only plain files are used, so a symlink can't point the sibling outside of the root
+        char variant[PATH_MAX];
+        if (path_len + strlen(encoding_map[i + 1]) >= sizeof(variant)) { continue; }
+        snprintf(variant, sizeof(variant), "%s%s", path, encoding_map[i + 1]);
+        if (lstat(variant, &st) != 0 || !S_ISREG(st.st_mode) || resource_is_protected(variant))
+        {
+            continue;
+        }
+        *has_variants = true;
+
+        if (!accept_encoding || http_accept_quality(accept_encoding, encoding_map[i]) <= 0.0)
+        {
+            continue;
+        }
+        if (st.st_size < best_size)
+        {
+            best_path = arena_strdup(arena, variant);
+            best_size = st.st_size;
+            *encoding = encoding_map[i];
+        }
     }
 
-    // Close the file
-    fclose(f);
+    if (g_server_config.debug && *encoding)
+    {
+        printf("[RES:SelectEncoding] Sending %s (%s)\n", best_path, *encoding);
+    }
+
+    return best_path;
+}
 
+// Appends the resource body to the response
+int resource_get(int request_id, Arena *arena, HTTPResponse *response, const char *path, 
+    const HTTPRequest *request)
+{
     // Process the file it it's a dynamic file
     if (resource_is_dynamic(path))
     {
-        if (dynamic_process(request_id, buff, buffsz, request_str))
+        int result = dynamic_process(request_id, arena, response, path, request);
+        if (result == 1)
         {
-            log_error(0, "Something went wrong when processing dynamic resource\n");
-            return 1;
+            log_error(request_id, "Something went wrong when processing dynamic resource\n");
         }
+        return result;
+    }
+
+    // Open the file
+    FILE *f = fopen(path, "r");
+    if (!f) { return 1; }
+    fseek(f, 0, SEEK_END);
+    size_t size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    // Read the resource straight into the body buffer
+    CharVector *body = response->body;
+    char_vector_reserve(body, size);
+    size_t rb = fread(&body->items[body->count], 1, size, f);
+    fclose(f);
+    if (rb != size)
+    {
+        log_error(request_id, "Something went wrong when accessing resource, read %zu/%zu\n", 
+            rb, size);
+        return 1;
     }
+    char_vector_commit(body, rb);
 
     return 0;
-}
\ No newline at end of file
+}
+
+static void resource_close_file(void *arg)
+{
+    close((int)(intptr_t)arg);
+}
+
+// Sets a part of the file as the body, it's sent straight from the file (not read into memory)
+int resource_get_window(int request_id, Arena *arena, HTTPResponse *response, 
+    const ResourceFile *file, off_t offset, size_t len)
+{
+    // The files kept open by the snapshot are shared, sendfile() doesn't move their offset
+    if (file->fd >= 0)
+    {
+        response->file_fd = file->fd;
+        response->file_offset = file->offset + offset;
+        response->file_len = len;
+        return 0;
+    }
+
+    int fd = open(file->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        log_error(request_id, "Something went wrong when opening resource: %s\n", strerror(errno));
+        return 1;
+    }
+    if (arena_defer(arena, resource_close_file, (void*)(intptr_t)fd))
+    {
+        close(fd);
+        return 1;
+    }
+
+    response->file_fd = fd;
+    response->file_offset = offset;
+    response->file_len = len;
+    return 0;
+}
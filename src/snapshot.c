@@ -0,0 +1,700 @@
+/**
+ * @file snapshot.c
+ * @author epsiii
+ * @brief Immutable index of the root directory (--snapshot)
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * The root is walked once and every file and directory gets an entry with
+ * its metadata, content type and flags, the static files are kept open. A
+ * request is then a single hash lookup, without any locks or path syscalls.
+ *
+ * With --archive the index comes from a site archive made by ssfhs-pack
+ * instead. The archive is mapped as a whole, the entries point into the
+ * mapping, so there is nothing to read or open when the server starts.
+ *
+ * SIGHUP builds a new index and swaps it in. Every worker publishes the
+ * index it took in its own slot for the time of the request, so the old
+ * index is only freed once none of the slots point to it anymore.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include "ssfhs.h"
+
+struct Snapshot {
+    SnapshotEntry **buckets;
+    size_t bucket_count;                    // Power of two
+    SnapshotEntry **entries;
+    size_t count;
+    size_t capacity;
+    SnapshotEntry *index_page;              // INDEX_PAGE, served for "/"
+    int open_files;
+    int max_open_files;
+    int archive_fd;                         // Shared by all the entries of an archive
+    void *map;
+    size_t map_size;
+};
+
+static _Atomic(Snapshot *) current = NULL;
+static _Atomic(Snapshot *) *readers = NULL;    // The index every worker is using
+static int reader_count = 0;
+
+static SnapshotEntry *snapshot_new_entry(Snapshot *snapshot, const char *url, const char *path,
+    const struct stat *st)
+{
+    SnapshotEntry *entry = calloc(1, sizeof(SnapshotEntry));
+    entry->url = strdup(url);
+    entry->file.path = strdup(path);
+    entry->file.st = *st;
+    entry->file.fd = -1;
+    entry->content_type = resource_get_content_type(path);
+    entry->is_protected = resource_is_protected(path);
+    entry->is_dynamic = resource_is_dynamic(path);
+    entry->is_directory = S_ISDIR(st->st_mode);
+
+    // Only the files that are sent as they are, the rest still goes through the path
+    bool is_static = S_ISREG(st->st_mode) && !entry->is_protected && !entry->is_dynamic;
+    if (is_static && snapshot->open_files < snapshot->max_open_files)
+    {
+        entry->file.fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (entry->file.fd >= 0) { snapshot->open_files++; }
+    }
+
+    return entry;
+}
+
+static void snapshot_free_entry(const Snapshot *snapshot, SnapshotEntry *entry)
+{
+    if (entry->file.fd >= 0 && entry->file.fd != snapshot->archive_fd) { close(entry->file.fd); }
+    free(entry->url);
+    free((char*)entry->file.path);
+    free(entry);
+}
+
+static void snapshot_add(Snapshot *snapshot, const char *url, const char *path, const struct stat *st)
+{
+    if (snapshot->count == snapshot->capacity)
+    {
+        snapshot->capacity = (snapshot->capacity) ? snapshot->capacity * 2 : 256;
+        snapshot->entries = realloc(snapshot->entries, snapshot->capacity * sizeof(SnapshotEntry*));
+    }
+    snapshot->entries[snapshot->count++] = snapshot_new_entry(snapshot, url, path, st);
+}
+
+// Adds everything under the directory, url is the directory's URL ("" for the root)
+static void snapshot_walk(Snapshot *snapshot, const char *root, const char *url)
+{
+    char dir_path[PATH_MAX];
+    snprintf(dir_path, sizeof(dir_path), "%s%s", root, url);
+    DIR *dir = opendir(dir_path);
+    if (!dir)
+    {
+        log_error(0, "Could not open directory %s for the snapshot: %s\n", dir_path, strerror(errno));
+        return;
+    }
+
+    size_t root_len = strlen(root);
+    char child_url[PATH_MAX];
+    char child_path[PATH_MAX];
+    char real_path[PATH_MAX];
+    struct dirent *ent;
+    while ((ent = readdir(dir)))
+    {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) { continue; }
+
+        int len = snprintf(child_url, sizeof(child_url), "%s/%s", url, ent->d_name);
+        if (len < 0 || len >= (int)sizeof(child_url)) { continue; }
+        len = snprintf(child_path, sizeof(child_path), "%s%s", root, child_url);
+        if (len < 0 || len >= (int)sizeof(child_path)) { continue; }
+
+        struct stat st;
+        if (lstat(child_path, &st) != 0) { continue; }
+
+        // Links have to stay inside the root, the linked directories aren't walked (no loops)
+        if (S_ISLNK(st.st_mode))
+        {
+            if (!realpath(child_path, real_path) || strncmp(real_path, root, root_len) != 0 ||
+                (real_path[root_len] != '/' && real_path[root_len] != '\0') ||
+                stat(real_path, &st) != 0 || !S_ISREG(st.st_mode))
+            {
+                continue;
+            }
+            snapshot_add(snapshot, child_url, real_path, &st);
+        }
+        else if (S_ISDIR(st.st_mode))
+        {
+            snapshot_add(snapshot, child_url, child_path, &st);
+            snapshot_walk(snapshot, root, child_url);
+        }
+        else if (S_ISREG(st.st_mode))
+        {
+            snapshot_add(snapshot, child_url, child_path, &st);
+        }
+    }
+    closedir(dir);
+}
+
+static SnapshotEntry *snapshot_find(const Snapshot *snapshot, const char *url, size_t len)
+{
+    uint32_t hash = hash_bytes(url, len);
+    SnapshotEntry *entry = snapshot->buckets[hash & (snapshot->bucket_count - 1)];
+    for ( ; entry; entry = entry->next)
+    {
+        if (strncmp(entry->url, url, len) == 0 && entry->url[len] == '\0') { return entry; }
+    }
+    return NULL;
+}
+
+// Looks up a sibling of the entry, "<url><suffix>" or "<url>/<suffix>" for directories
+static SnapshotEntry *snapshot_find_sibling(const Snapshot *snapshot, const SnapshotEntry *entry,
+    const char *separator, const char *suffix)
+{
+    char url[PATH_MAX];
+    const char *base = (strcmp(entry->url, "/") == 0) ? "" : entry->url;
+    int len = snprintf(url, sizeof(url), "%s%s%s", base, separator, suffix);
+    if (len < 0 || len >= (int)sizeof(url)) { return NULL; }
+    return snapshot_find(snapshot, url, len);
+}
+
+// Hashes the entries and links the directories to their index pages and the files to their
+//  precompressed copies
+static void snapshot_link(Snapshot *snapshot)
+{
+    snapshot->bucket_count = SNAPSHOT_MIN_BUCKETS;
+    while (snapshot->bucket_count < snapshot->count * 2) { snapshot->bucket_count *= 2; }
+    snapshot->buckets = calloc(snapshot->bucket_count, sizeof(SnapshotEntry*));
+    for (size_t i = 0; i < snapshot->count; i++)
+    {
+        SnapshotEntry *entry = snapshot->entries[i];
+        uint32_t hash = hash_string(entry->url);
+        entry->next = snapshot->buckets[hash & (snapshot->bucket_count - 1)];
+        snapshot->buckets[hash & (snapshot->bucket_count - 1)] = entry;
+    }
+
+    const char *index_name = "index.html";
+    if (g_server_config.index_page_file)
+    {
+        const char *sep = strrchr(g_server_config.index_page_file, '/');
+        index_name = (sep) ? sep + 1 : g_server_config.index_page_file;
+    }
+
+    for (size_t i = 0; i < snapshot->count; i++)
+    {
+        SnapshotEntry *entry = snapshot->entries[i];
+        if (entry->is_directory)
+        {
+            const SnapshotEntry *index = snapshot_find_sibling(snapshot, entry, "/", index_name);
+            if (index && !index->is_directory && !index->is_protected) { entry->index = index; }
+            continue;
+        }
+
+        for (int v = 0; v < RESOURCE_ENCODING_VARIANTS; v++)
+        {
+            const char *suffix;
+            resource_get_encoding_variant(v, &suffix);
+            const SnapshotEntry *variant = snapshot_find_sibling(snapshot, entry, "", suffix);
+            if (variant && !variant->is_directory && !variant->is_protected) { entry->variants[v] = variant; }
+        }
+    }
+}
+
+static void snapshot_destroy(Snapshot *snapshot)
+{
+    // The index page only has its own entry if it's outside of the root
+    if (snapshot->index_page && snapshot->index_page->url[0] == '\0')
+    {
+        snapshot_free_entry(snapshot, snapshot->index_page);
+    }
+    for (size_t i = 0; i < snapshot->count; i++) { snapshot_free_entry(snapshot, snapshot->entries[i]); }
+    if (snapshot->map) { munmap(snapshot->map, snapshot->map_size); }
+    if (snapshot->archive_fd >= 0) { close(snapshot->archive_fd); }
+    free(snapshot->entries);
+    free(snapshot->buckets);
+    free(snapshot);
+}
+
+// A string of the archive, NULL if it isn't inside of the mapping
+static const char *snapshot_archive_string(const Snapshot *snapshot, uint64_t offset)
+{
+    const ArchiveHeader *header = snapshot->map;
+    if (offset < header->strings_offset || offset >= snapshot->map_size) { return NULL; }
+    const char *str = (const char*)snapshot->map + offset;
+    return memchr(str, '\0', snapshot->map_size - offset) ? str : NULL;
+}
+
+// Maps the archive and makes the entries out of it, the paths are still the ones in the root
+//  (the dynamic files run from there)
+static int snapshot_load_archive(Snapshot *snapshot, const char *root)
+{
+    const char *file = g_server_config.archive_file;
+    snapshot->archive_fd = open(file, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (snapshot->archive_fd < 0 || fstat(snapshot->archive_fd, &st) != 0)
+    {
+        log_error(0, "Could not open the archive %s: %s\n", file, strerror(errno));
+        return 1;
+    }
+
+    snapshot->map_size = st.st_size;
+    snapshot->map = mmap(NULL, snapshot->map_size, PROT_READ, MAP_SHARED, snapshot->archive_fd, 0);
+    if (snapshot->map == MAP_FAILED || snapshot->map_size < sizeof(ArchiveHeader))
+    {
+        if (snapshot->map == MAP_FAILED) { snapshot->map = NULL; }
+        log_error(0, "Could not map the archive %s\n", file);
+        return 1;
+    }
+
+    const ArchiveHeader *header = snapshot->map;
+    size_t entries_size = (size_t)header->entry_count * sizeof(ArchiveEntry);
+    // Both offsets come from the file, subtracted so a huge one can't wrap around
+    if (memcmp(header->magic, ARCHIVE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != ARCHIVE_VERSION || header->size != snapshot->map_size ||
+        header->strings_offset > snapshot->map_size ||
+        header->entries_offset < sizeof(ArchiveHeader) ||
+        header->entries_offset % _Alignof(ArchiveEntry) != 0 ||
+        header->entries_offset > header->strings_offset ||
+        entries_size > header->strings_offset - header->entries_offset)
+    {
+        log_error(0, "%s is not a valid archive (version %d)\n", file, ARCHIVE_VERSION);
+        return 1;
+    }
+
+    // Warm the whole thing up in one go
+    madvise(snapshot->map, snapshot->map_size, MADV_WILLNEED);
+
+    snapshot->capacity = header->entry_count;
+    snapshot->entries = calloc(snapshot->capacity + 1, sizeof(SnapshotEntry*));
+    const ArchiveEntry *entries = (const ArchiveEntry*)((const char*)snapshot->map + header->entries_offset);
+    char path[PATH_MAX];
+    for (uint32_t i = 0; i < header->entry_count; i++)
+    {
+        const ArchiveEntry *ae = &entries[i];
+        const char *url = snapshot_archive_string(snapshot, ae->url);
+        const char *content_type = snapshot_archive_string(snapshot, ae->content_type);
+        bool has_data = ae->data_offset != 0;
+        if (!url || !content_type || (has_data && (ae->data_offset < header->strings_offset ||
+            ae->data_offset > snapshot->map_size || ae->size > snapshot->map_size - ae->data_offset)))
+        {
+            log_error(0, "Entry %u of the archive %s is broken\n", i, file);
+            return 1;
+        }
+        snprintf(path, sizeof(path), "%s%s", root, (strcmp(url, "/") == 0) ? "" : url);
+
+        SnapshotEntry *entry = calloc(1, sizeof(SnapshotEntry));
+        entry->url = strdup(url);
+        entry->file.path = strdup(path);
+        entry->file.fd = -1;
+        entry->file.st.st_mode = (ae->flags & ARCHIVE_DIRECTORY) ? S_IFDIR : S_IFREG;
+        entry->file.st.st_size = ae->size;
+        entry->file.st.st_ino = ae->ino;
+        entry->file.st.st_mtim.tv_sec = ae->mtime_sec;
+        entry->file.st.st_mtim.tv_nsec = ae->mtime_nsec;
+        entry->content_type = content_type;
+        entry->is_protected = ae->flags & ARCHIVE_PROTECTED;
+        entry->is_dynamic = ae->flags & ARCHIVE_DYNAMIC;
+        entry->is_directory = ae->flags & ARCHIVE_DIRECTORY;
+        if (has_data)
+        {
+            entry->file.fd = snapshot->archive_fd;
+            entry->file.offset = ae->data_offset;
+            entry->file.data = (const char*)snapshot->map + ae->data_offset;
+        }
+        snapshot->entries[snapshot->count++] = entry;
+    }
+
+    return 0;
+}
+
+static Snapshot *snapshot_create(void)
+{
+    char root[PATH_MAX];
+    struct stat st;
+    if (!realpath(g_server_config.root_dir, root) || stat(root, &st) != 0)
+    {
+        log_error(0, "Could not resolve the root directory for the snapshot: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    Snapshot *snapshot = calloc(1, sizeof(Snapshot));
+    snapshot->archive_fd = -1;
+    uint64_t start = now_us();
+    if (g_server_config.archive_file)
+    {
+        if (snapshot_load_archive(snapshot, root))
+        {
+            snapshot_destroy(snapshot);
+            return NULL;
+        }
+    }
+    else
+    {
+        // Two of them are open during a reload, and the connections need descriptors as well
+        struct rlimit limit;
+        snapshot->max_open_files = 256;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+        {
+            snapshot->max_open_files = limit.rlim_cur / 4;
+        }
+
+        snapshot_add(snapshot, "/", root, &st);
+        snapshot_walk(snapshot, root, "");
+    }
+    snapshot_link(snapshot);
+
+    // "/" is the INDEX_PAGE, wherever it is
+    const char *index_path = g_server_config.index_page_file;
+    for (size_t i = 0; index_path && i < snapshot->count && !snapshot->index_page; i++)
+    {
+        if (strcmp(snapshot->entries[i]->file.path, index_path) == 0)
+        {
+            snapshot->index_page = snapshot->entries[i];
+        }
+    }
+    if (index_path && !snapshot->index_page && stat(index_path, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        snapshot->index_page = snapshot_new_entry(snapshot, "", index_path, &st);
+    }
+
+    if (snapshot->map)
+    {
+        log_message(0, "Snapshot of %s: %zu entries (%zu bytes mapped), took %.1fms\n",
+            g_server_config.archive_file, snapshot->count, snapshot->map_size,
+            (float)(now_us() - start) / 1000.0);
+    }
+    else
+    {
+        log_message(0, "Snapshot of %s: %zu entries, %d files open, took %.1fms\n",
+            root, snapshot->count, snapshot->open_files, (float)(now_us() - start) / 1000.0);
+    }
+
+    return snapshot;
+}
+
+// Builds the first index before the workers start, a failure stops the server
+void snapshot_init(void)
+{
+    reader_count = g_server_config.worker_threads;
+    readers = calloc(reader_count, sizeof(*readers));
+
+    Snapshot *snapshot = snapshot_create();
+    if (!snapshot)
+    {
+        fprintf(stderr, "Could not build the snapshot of the root directory\n");
+        exit(EXIT_FAILURE);
+    }
+    atomic_store(&current, snapshot);
+}
+
+// Swaps in a fresh index, the old one is kept if the new one can't be built
+int snapshot_reload(void)
+{
+    Snapshot *fresh = snapshot_create();
+    if (!fresh) { return 1; }
+    Snapshot *old = atomic_exchange(&current, fresh);
+
+    // Wait for the requests that are still using the old one
+    struct timespec pause = { .tv_sec = 0, .tv_nsec = 1000000 };
+    for (int i = 0; i < reader_count; i++)
+    {
+        while (atomic_load(&readers[i]) == old) { nanosleep(&pause, NULL); }
+    }
+    snapshot_destroy(old);
+
+    return 0;
+}
+
+void snapshot_free(void)
+{
+    if (!readers) { return; }
+    Snapshot *snapshot = atomic_exchange(&current, NULL);
+    if (snapshot) { snapshot_destroy(snapshot); }
+    free(readers);
+    readers = NULL;
+}
+
+// Pins the current index for a request of the worker, NULL without --snapshot
+const Snapshot *snapshot_enter(int reader)
+{
+    if (!readers) { return NULL; }
+
+    // Publish it first and check it's still current, otherwise the reload might not see us
+    Snapshot *snapshot;
+    do {
+        snapshot = atomic_load(&current);
+        atomic_store(&readers[reader], snapshot);
+    } while (snapshot != atomic_load(&current));
+
+    return snapshot;
+}
+
+void snapshot_leave(int reader)
+{
+    if (readers) { atomic_store(&readers[reader], NULL); }
+}
+
+// URLs are matched as they are ("/dir/" is the same as "/dir"), NULL if there's no such entry
+const SnapshotEntry *snapshot_lookup(const Snapshot *snapshot, const char *url)
+{
+    if (strcmp(url, "/") == 0 && snapshot->index_page) { return snapshot->index_page; }
+
+    size_t len = strlen(url);
+    bool trailing_slash = (len > 1 && url[len - 1] == '/');
+    if (trailing_slash) { len--; }
+
+    const SnapshotEntry *entry = snapshot_find(snapshot, url, len);
+    if (entry && trailing_slash && !entry->is_directory) { return NULL; }
+    return entry;
+}
+
+// Same as resource_select_encoding(), from the copies found when the index was built
+const ResourceFile *snapshot_select_encoding(const SnapshotEntry *entry, const char *accept_encoding,
+    const char **encoding, bool *has_variants)
+{
+    *encoding = NULL;
+    *has_variants = false;
+
+    const ResourceFile *best = &entry->file;
+    for (int i = 0; i < RESOURCE_ENCODING_VARIANTS; i++)
+    {
+        const SnapshotEntry *variant = entry->variants[i];
+        if (!variant) { continue; }
+        *has_variants = true;
+
+        const char *suffix;
+        const char *name = resource_get_encoding_variant(i, &suffix);
+        if (!accept_encoding || http_accept_quality(accept_encoding, name) <= 0.0) { continue; }
+        if (variant->file.st.st_size < best->st.st_size)
+        {
+            best = &variant->file;
+            *encoding = name;
+        }
+    }
+
+    return best;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//                              Archive                                     //
+//////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    const SnapshotEntry *source;
+    const char *url;
+    const char *content_type;
+    uint32_t flags;
+    bool has_data;
+    const void *data;                       // Compressed copy, NULL if it comes from the file
+    size_t size;
+    uint64_t data_offset;
+} ArchiveItem;
+
+static int archive_item_compare(const void *a, const void *b)
+{
+    return strcmp(((const ArchiveItem*)a)->url, ((const ArchiveItem*)b)->url);
+}
+
+static uint64_t archive_align(uint64_t offset, uint64_t alignment)
+{
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+// Reads the whole file into the arena, NULL if it changed since it was indexed
+static void *archive_read_file(Arena *arena, const ResourceFile *file)
+{
+    int fd = (file->fd >= 0) ? file->fd : open(file->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { return NULL; }
+
+    size_t size = file->st.st_size;
+    char *data = arena_alloc(arena, size + 1);
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t n = pread(fd, data + done, size - done, done);
+        if (n <= 0) { break; }
+        done += n;
+    }
+    if (fd != file->fd) { close(fd); }
+
+    return (done == size) ? data : NULL;
+}
+
+// Adds the compressed copies the root doesn't have already (*.br, *.gz)
+static void archive_add_variants(Arena *arena, const SnapshotEntry *entry, ArchiveItem *items, size_t *count)
+{
+    if (!compression_is_compressible(entry->content_type)) { return; }
+    if ((size_t)entry->file.st.st_size < g_server_config.compression_min_size) { return; }
+
+    void *data = NULL;
+    for (int i = 0; i < RESOURCE_ENCODING_VARIANTS; i++)
+    {
+        if (entry->variants[i]) { continue; }
+        if (!data && !(data = archive_read_file(arena, &entry->file))) { return; }
+
+        const char *suffix;
+        const char *encoding = resource_get_encoding_variant(i, &suffix);
+        struct iovec in = { .iov_base = data, .iov_len = entry->file.st.st_size };
+        void *out;
+        size_t out_len = compression_compress(encoding, arena, &in, 1, in.iov_len, &out);
+        if (!out_len) { continue; }
+
+        char *url = arena_alloc(arena, strlen(entry->url) + strlen(suffix) + 1);
+        sprintf(url, "%s%s", entry->url, suffix);
+        ArchiveItem *item = &items[(*count)++];
+        item->source = entry;
+        item->url = url;
+        item->content_type = resource_get_content_type(url);
+        item->has_data = true;
+        item->data = out;
+        item->size = out_len;
+    }
+}
+
+// Copies the item's content to the archive, fails if the file changed in the meantime
+static int archive_write_data(FILE *out, const ArchiveItem *item)
+{
+    if (item->data) { return fwrite(item->data, 1, item->size, out) != item->size; }
+
+    const ResourceFile *file = &item->source->file;
+    int fd = (file->fd >= 0) ? file->fd : open(file->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { return 1; }
+
+    char buffer[65536];
+    size_t done = 0;
+    while (done < item->size)
+    {
+        size_t want = (item->size - done < sizeof(buffer)) ? item->size - done : sizeof(buffer);
+        ssize_t n = pread(fd, buffer, want, done);
+        if (n <= 0 || fwrite(buffer, 1, n, out) != (size_t)n) { break; }
+        done += n;
+    }
+    if (fd != file->fd) { close(fd); }
+
+    return done != item->size;
+}
+
+// Packs the root directory into an archive (ssfhs-pack), written next to the output and
+//  renamed over it at the end, so a running server never maps a half written one
+int snapshot_write_archive(const char *output, bool compress)
+{
+    Snapshot *snapshot = snapshot_create();
+    if (!snapshot) { return 1; }
+
+    Arena arena;
+    arena_init(&arena);
+    ArchiveItem *items = calloc(snapshot->count * (1 + RESOURCE_ENCODING_VARIANTS) + 1, sizeof(ArchiveItem));
+    size_t count = 0;
+    for (size_t i = 0; i < snapshot->count; i++)
+    {
+        const SnapshotEntry *entry = snapshot->entries[i];
+        ArchiveItem *item = &items[count++];
+        item->source = entry;
+        item->url = entry->url;
+        item->content_type = entry->content_type;
+        item->flags = (entry->is_protected ? ARCHIVE_PROTECTED : 0) |
+            (entry->is_dynamic ? ARCHIVE_DYNAMIC : 0) | (entry->is_directory ? ARCHIVE_DIRECTORY : 0);
+        item->has_data = !item->flags;
+        item->size = (item->has_data) ? (size_t)entry->file.st.st_size : 0;
+
+        if (compress && item->has_data) { archive_add_variants(&arena, entry, items, &count); }
+    }
+    qsort(items, count, sizeof(ArchiveItem), archive_item_compare);
+
+    // Strings first, then the offsets of the content can be laid out
+    ArchiveHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ARCHIVE_MAGIC, sizeof(header.magic));
+    header.version = ARCHIVE_VERSION;
+    header.entry_count = count;
+    header.entries_offset = sizeof(ArchiveHeader);
+    header.strings_offset = header.entries_offset + count * sizeof(ArchiveEntry);
+
+    CharVector strings;
+    char_vector_init(&strings, MIN_BUFFER_SIZE);
+    ArchiveEntry *entries = calloc(count + 1, sizeof(ArchiveEntry));
+    for (size_t i = 0; i < count; i++)
+    {
+        entries[i].url = header.strings_offset + strings.count;
+        char_vector_push_arr(&strings, items[i].url, strlen(items[i].url) + 1);
+
+        // There's only a handful of types, they're shared
+        entries[i].content_type = 0;
+        for (size_t j = 0; j < i && !entries[i].content_type; j++)
+        {
+            if (strcmp(items[j].content_type, items[i].content_type) == 0)
+            {
+                entries[i].content_type = entries[j].content_type;
+            }
+        }
+        if (!entries[i].content_type)
+        {
+            entries[i].content_type = header.strings_offset + strings.count;
+            char_vector_push_arr(&strings, items[i].content_type, strlen(items[i].content_type) + 1);
+        }
+    }
+
+    uint64_t offset = archive_align(header.strings_offset + strings.count, ARCHIVE_ALIGN);
+    for (size_t i = 0; i < count; i++)
+    {
+        const struct stat *st = &items[i].source->file.st;
+        entries[i].size = items[i].size;
+        entries[i].flags = items[i].flags;
+        entries[i].ino = st->st_ino;
+        entries[i].mtime_sec = st->st_mtim.tv_sec;
+        entries[i].mtime_nsec = st->st_mtim.tv_nsec;
+        if (!items[i].has_data) { continue; }
+
+        offset = archive_align(offset, (items[i].size >= ARCHIVE_PAGE_ALIGN) ? ARCHIVE_PAGE_ALIGN : ARCHIVE_ALIGN);
+        entries[i].data_offset = items[i].data_offset = offset;
+        offset += items[i].size;
+    }
+    header.size = offset;
+
+    char temp[PATH_MAX];
+    snprintf(temp, sizeof(temp), "%s.tmp", output);
+    FILE *out = fopen(temp, "wb");
+    int result = !out;
+    if (out)
+    {
+        result |= fwrite(&header, sizeof(header), 1, out) != 1;
+        result |= fwrite(entries, sizeof(ArchiveEntry), count, out) != count;
+        result |= fwrite(strings.items, 1, strings.count, out) != strings.count;
+        for (size_t i = 0; i < count && !result; i++)
+        {
+            if (!items[i].has_data) { continue; }
+            for (long pad = items[i].data_offset - ftell(out); pad > 0; pad--) { fputc(0, out); }
+            if (archive_write_data(out, &items[i]))
+            {
+                fprintf(stderr, "Could not pack %s, did it change?\n", items[i].source->file.path);
+                result = 1;
+            }
+        }
+        result |= fclose(out) != 0;
+    }
+    if (!result && rename(temp, output) != 0) { result = 1; }
+    if (result)
+    {
+        fprintf(stderr, "Could not write the archive %s: %s\n", output, strerror(errno));
+        unlink(temp);
+    }
+    else
+    {
+        printf("Packed %zu entries into %s (%lu bytes)\n", count, output, (unsigned long)header.size);
+    }
+
+    free(entries);
+    char_vector_free(&strings);
+    free(items);
+    arena_free(&arena);
+    snapshot_destroy(snapshot);
+    return result;
+}
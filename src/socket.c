@@ -7,27 +7,42 @@
  * @copyright Copyright (c) 2025
  * 
  */
+#define _GNU_SOURCE  // accept4(), pipe2()
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <poll.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include "ssfhs.h"
 
-// TODO: Use thread pool instead of creating a new thread for each connection
+// Accepted connections waiting for a free worker
+static ConnectionDescriptor *conn_queue[CONNECTION_QUEUE_SIZE];
+static int conn_queue_head = 0;
+static int conn_queue_count = 0;
+static pthread_mutex_t conn_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conn_queue_not_empty = PTHREAD_COND_INITIALIZER;
+static int conn_active = 0;             // Taken by a worker and not closed yet
+static uint64_t conn_rejected = 0;
+static int stop_pipe[2] = { -1, -1 };   // Written by socket_stop_accepting()
+
+static Worker *workers = NULL;
+static int accept_reader = 0;           // Config slot of the accepting thread, after the workers'
 
 int socket_open(uint16_t port)
 {
     int fd;
     struct sockaddr_in server_addr;
 
-    // Create socket (IPv4, TCP)
-    fd = socket(AF_INET, SOCK_STREAM, 0);
+    // Create socket (IPv4, TCP), non-blocking because another process might accept on it too
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
     if (fd < 0) {
         fprintf(stderr, "Failed to open socket: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
@@ -57,15 +72,26 @@ int socket_open(uint16_t port)
     return fd;
 }
 
-static int socket_send_response(const CharVector *vec, ConnectionDescriptor *cd)
+// The listening socket passed on by the previous process during an upgrade, -1 if there's none
+int socket_inherit(void)
 {
-    int sent = send(cd->conn_fd, vec->items, vec->count, 0);
-    if (sent < 0)
+    const char *value = getenv(LISTEN_FD_ENV);
+    if (!value) { return -1; }
+    int fd = atoi(value);
+    unsetenv(LISTEN_FD_ENV);
+
+    int listening = 0;
+    socklen_t len = sizeof(listening);
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) != 0 || !listening)
     {
-        log_error(cd->conn_id, "Something went wrong while sending response: %s\n", strerror(errno));
-        close(cd->conn_id);
+        fprintf(stderr, "%s=%s is not a listening socket\n", LISTEN_FD_ENV, value);
+        exit(EXIT_FAILURE);
     }
-    return sent;
+
+    // It had to survive the exec, the dynamic commands shouldn't get it though
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
 }
 
 static void socket_generate_ip_string(char *buff, size_t size, const struct sockaddr_storage *addr)
@@ -79,143 +105,511 @@ static void socket_generate_ip_string(char *buff, size_t size, const struct sock
     }
 }
 
-static int socket_receive_request(ConnectionDescriptor *cd, CharVector *request_vec)
+// A passed deadline shuts the socket down, that wakes up the poll() or the call waiting on it
+static void socket_deadline_passed(void *ctx)
 {
-    uint64_t receive_start_time = now_ms();
+    ConnectionDescriptor *cd = ctx;
+    shutdown(cd->conn_fd, SHUT_RDWR);
+}
+
+// Waits for the socket after a call that would have blocked, returns non-zero for the other errors
+static int socket_wait_ready(int fd, short events)
+{
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) { return 1; }
+    struct pollfd pfd = { .fd = fd, .events = events };
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) { return 1; }
+    return 0;
+}
+
+// The send deadline is pushed back whenever some of the data went out
+static void socket_send_progress(ConnectionDescriptor *cd)
+{
+    timer_arm(&cd->deadline, g_server_config.send_timeout_ms, socket_deadline_passed, cd);
+}
+
+// Logs why a send failed, the errno is only the result of the shutdown if the deadline passed
+static void socket_send_failed(ConnectionDescriptor *cd, const char *what, const char *reason)
+{
+    if (!timer_cancel(&cd->deadline))
+    {
+        char ipstr[64];
+        socket_generate_ip_string(ipstr, sizeof(ipstr) - 1, &cd->cliaddr);
+        log_error(cd->conn_id, "Sending to %s timed out, nothing went out for %d ms\n",
+            ipstr, g_server_config.send_timeout_ms);
+        return;
+    }
+    log_error(cd->conn_id, "Something went wrong while %s: %s\n", what, reason);
+}
+
+// Sends the head, the body buffer and the body parts with as few syscalls as possible
+static int socket_send_response(const HTTPResponse *response, ConnectionDescriptor *cd)
+{
+    struct iovec iov[SEND_IOV_BATCH];
+    int part_index = -2;  // -2 is the head, -1 the body buffer
+    int part_end = (response->head_only) ? -1 : response->part_count;
+    size_t sent = 0;
+
+    socket_send_progress(cd);
     for ( ;; )
     {
-        int time_elapsed = (int)(now_ms() - receive_start_time);
-        if (time_elapsed > g_server_config.request_timeout_ms)
+        // Gather the next batch of buffers
+        int count = 0;
+        for (int i = part_index; i < part_end && count < SEND_IOV_BATCH; i++)
         {
-            char ipstr[64];
-            socket_generate_ip_string(ipstr, sizeof(ipstr) - 1, &cd->cliaddr);
-            log_error(cd->conn_id, "Request from %s timed out after %d ms\n", 
-                ipstr, g_server_config.request_timeout_ms);
-            return 1;
+            const void *data;
+            size_t len;
+            if (i == -2) { data = response->head->items; len = response->head->count; }
+            else if (i == -1) { data = response->body->items; len = response->body->count; }
+            else { data = response->parts[i].iov_base; len = response->parts[i].iov_len; }
+
+            iov[count].iov_base = (void*)data;
+            iov[count].iov_len = len;
+            count++;
         }
+        if (count == 0) { break; }
 
-        struct pollfd pfd;
-        pfd.fd = cd->conn_fd;
-        pfd.events = POLLIN;
-        int poll_res = poll(&pfd, 1, RECEIVE_POLL_GRANULARITY_MS);
-        if (poll_res < 0)
+        // Skip what was already sent from the first buffer
+        iov[0].iov_base = (char*)iov[0].iov_base + sent;
+        iov[0].iov_len -= sent;
+
+        ssize_t res = writev(cd->conn_fd, iov, count);
+        if (res < 0)
         {
-            log_error(cd->conn_id, "Something went wrong while polling for data: %s\n", 
-                strerror(errno));
-            return 1;
+            if (!socket_wait_ready(cd->conn_fd, POLLOUT)) { continue; }
+            socket_send_failed(cd, "sending response", strerror(errno));
+            return -1;
         }
+        socket_send_progress(cd);
 
-        else if (poll_res == 0)
+        // Move past the fully sent buffers
+        size_t left = res;
+        for (int i = 0; i < count && left >= iov[i].iov_len; i++)
         {
-            // Timeout, no data yet
-            continue;
+            left -= iov[i].iov_len;
+            part_index++;
+            sent = 0;
         }
+        sent += left;
+    }
 
-        // Data is available to read
-        char buffer[1024];
-        size_t n = read(cd->conn_fd, buffer, sizeof(buffer)-1);
-        char_vector_push_arr(request_vec, buffer, n); 
-        if (http_got_whole_request(request_vec)) { break; }
+    // The file window goes straight from the page cache
+    off_t offset = response->file_offset;
+    size_t left = (response->head_only) ? 0 : response->file_len;
+    while (left > 0)
+    {
+        ssize_t res = sendfile(cd->conn_fd, response->file_fd, &offset, left);
+        if (res < 0 && !socket_wait_ready(cd->conn_fd, POLLOUT)) { continue; }
+        if (res <= 0)
+        {
+            socket_send_failed(cd, "sending file", (res < 0) ? strerror(errno) : "unexpected end of file");
+            return -1;
+        }
+        socket_send_progress(cd);
+        left -= res;
     }
 
+    timer_cancel(&cd->deadline);
     return 0;
 }
 
-static int socket_respond(ConnectionDescriptor *cd, HTTPRequest *request, CharVector *request_vec)
+// Used for the streamed responses, writes all of the buffers
+static int socket_stream_write(void *ctx, const struct iovec *iov, int count)
+{
+    ConnectionDescriptor *cd = ctx;
+    struct iovec pending[SEND_IOV_BATCH];
+    if (count > SEND_IOV_BATCH) { return 1; }
+    memcpy(pending, iov, count * sizeof(struct iovec));
+
+    // Only armed while writing, the commands between the writes have their own deadline
+    struct iovec *next = pending;
+    socket_send_progress(cd);
+    while (count > 0)
+    {
+        ssize_t res = writev(cd->conn_fd, next, count);
+        if (res < 0)
+        {
+            if (!socket_wait_ready(cd->conn_fd, POLLOUT)) { continue; }
+            socket_send_failed(cd, "streaming response", strerror(errno));
+            return 1;
+        }
+        socket_send_progress(cd);
+
+        // Move past the fully sent buffers
+        size_t left = res;
+        while (count > 0 && left >= next->iov_len)
+        {
+            left -= next->iov_len;
+            next++;
+            count--;
+        }
+        if (count > 0)
+        {
+            next->iov_base = (char*)next->iov_base + left;
+            next->iov_len -= left;
+        }
+    }
+
+    timer_cancel(&cd->deadline);
+    return 0;
+}
+
+// Returns 0 once the whole request is there, 1 on failure, or the status of the limit it's over
+static int socket_receive_request(ConnectionDescriptor *cd, CharVector *request_vec)
+{
+    int result = 0;
+    timer_arm(&cd->deadline, g_server_config.request_timeout_ms, socket_deadline_passed, cd);
+    for ( ;; )
+    {
+        // Read straight into the vector, the socket is only polled once there's nothing to read
+        char_vector_reserve(request_vec, RECEIVE_CHUNK_SIZE);
+        size_t spare = request_vec->max_size - request_vec->count - 1;
+        ssize_t n = read(cd->conn_fd, &request_vec->items[request_vec->count], spare);
+        if (n < 0 && !socket_wait_ready(cd->conn_fd, POLLIN)) { continue; }
+        if (n <= 0)
+        {
+            if (n < 0)
+            {
+                log_error(cd->conn_id, "Something went wrong while reading the request: %s\n", 
+                    strerror(errno));
+            }
+            result = 1;
+            break;
+        }
+        char_vector_commit(request_vec, n);
+
+        result = http_check_limits(request_vec);
+        if (result || http_got_whole_request(request_vec)) { break; }
+    }
+
+    // It fired, the socket is shut down already
+    if (!timer_cancel(&cd->deadline))
+    {
+        char ipstr[64];
+        socket_generate_ip_string(ipstr, sizeof(ipstr) - 1, &cd->cliaddr);
+        log_error(cd->conn_id, "Request from %s timed out after %d ms\n", 
+            ipstr, g_server_config.request_timeout_ms);
+        return 1;
+    }
+
+    return result;
+}
+
+static int socket_respond(Worker *w, ConnectionDescriptor *cd, HTTPRequest *request)
 {
     // Generate and send the response
-    CharVector response;
-    char_vector_init(&response, 16);
-    int status = http_response_generate(cd->conn_id, &response, request, request_vec->items);
-    socket_send_response(&response, cd);
-    char_vector_free(&response);
+    HTTPResponse response;
+    http_response_init(&response, &w->head_vec, &w->response_vec);
+    response.write = socket_stream_write;
+    response.write_ctx = cd;
+    int status = http_response_generate(cd->conn_id, &response, request);
+    if (!response.streaming)
+    {
+        socket_send_response(&response, cd);
+    }
 
     // Print log
-    char ipstr[64];
-    socket_generate_ip_string(ipstr, sizeof(ipstr) - 1, &cd->cliaddr);
     log_message(cd->conn_id, "%s %s %s %d %.1fms\n", 
-        ipstr, request->method, request->url, status, 
+        request->remote_addr, request->method, request->url, status, 
         (float)(now_us() - cd->start_us) / 1000.0);
 
     return 0;
 }
 
-static int socket_handle_connection(ConnectionDescriptor *cd)
+// Reads what's left of a refused request for a moment, closing the socket with unread data would
+//  reset the connection before the client gets the response
+static void socket_linger(ConnectionDescriptor *cd)
+{
+    shutdown(cd->conn_fd, SHUT_WR);
+
+    char buffer[RECEIVE_CHUNK_SIZE];
+    uint64_t deadline = now_ms() + LINGER_TIMEOUT_MS;
+    size_t total = 0;
+    while (total < LINGER_MAX_BYTES)
+    {
+        uint64_t now = now_ms();
+        if (now >= deadline) { break; }
+
+        struct pollfd pfd = { .fd = cd->conn_fd, .events = POLLIN };
+        if (poll(&pfd, 1, (int)(deadline - now)) <= 0) { break; }
+        ssize_t n = read(cd->conn_fd, buffer, sizeof(buffer));
+        if (n <= 0) { break; }
+        total += n;
+    }
+}
+
+// Smoothed size of the recent requests/responses (1/8 weight for the new one)
+static size_t socket_update_average(size_t avg, size_t size)
+{
+    return (avg * 7 + size) / 8;
+}
+
+// Keep the buffers around twice the usual size, so one huge request
+//  doesn't keep its memory pinned for the lifetime of the worker
+static size_t socket_buffer_target(size_t avg, size_t cap)
+{
+    size_t target = avg * 2;
+    if (target < MIN_BUFFER_SIZE) { target = MIN_BUFFER_SIZE; }
+    if (target > cap) { target = cap; }
+    return target;
+}
+
+static void socket_recycle_buffers(Worker *w)
+{
+    w->avg_request_size = socket_update_average(w->avg_request_size, w->request_vec.count);
+    w->avg_response_size = socket_update_average(w->avg_response_size, w->response_vec.count);
+
+    char_vector_clear(&w->request_vec);
+    char_vector_clear(&w->head_vec);
+    char_vector_clear(&w->response_vec);
+    char_vector_trim(&w->request_vec, 
+        socket_buffer_target(w->avg_request_size, RECEIVE_BUFFER_CAP));
+    char_vector_trim(&w->response_vec, 
+        socket_buffer_target(w->avg_response_size, RESPONSE_BUFFER_CAP));
+
+    // Request resources are released in one go
+    arena_reset(&w->arena);
+}
+
+static int socket_handle_connection(Worker *w, ConnectionDescriptor *cd)
 {
     int exit_code = 0;
-    CharVector request_vec;
     HTTPRequest request;
-    char_vector_init(&request_vec, 16);
-    http_request_init(&request);
+    http_request_init(&request, &w->arena);
+
+    // Start with the buffers sized for the usual request
+    char_vector_reserve(&w->request_vec, w->avg_request_size);
+    char_vector_reserve(&w->response_vec, w->avg_response_size);
 
-    if (socket_receive_request(cd, &request_vec))
+    int received = socket_receive_request(cd, &w->request_vec);
+    if (received == 1)
     {
         exit_code = 1;
         goto exit;
     }
 
-    if (http_request_parse(&request_vec, &request))
+    char ipstr[64];
+    socket_generate_ip_string(ipstr, sizeof(ipstr) - 1, &cd->cliaddr);
+    request.remote_addr = arena_strdup(&w->arena, ipstr);
+    request.remote_sockaddr = &cd->cliaddr;
+
+    // Over a limit, refused without looking at the request any further
+    if (received)
+    {
+        request.limit_status = received;
+        request.method = arena_strdup(&w->arena, "-");
+        request.url = arena_strdup(&w->arena, "-");
+        socket_respond(w, cd, &request);
+        socket_linger(cd);
+        exit_code = 1;
+        goto exit;
+    }
+
+    if (http_request_parse(&w->request_vec, &request))
     {
         log_error(cd->conn_id, "Something went wrong when parsing the request\n");
         exit_code = 1;
         goto exit;
     }
 
-    socket_respond(cd, &request, &request_vec);
+    // The snapshot of the root has to stay around until the response is sent
+    request.snapshot = snapshot_enter(w->index);
+    socket_respond(w, cd, &request);
+    snapshot_leave(w->index);
 
     exit:
     close(cd->conn_fd);
-    char_vector_free(&request_vec);
     http_request_free(&request);
+    socket_recycle_buffers(w);
     free(cd);
     return exit_code;
 }
 
-static void* socket_handle_connection_thread(void *arg)
+static void* socket_worker_thread(void *arg)
 {
-    socket_handle_connection((ConnectionDescriptor*)(arg));
+    Worker *w = arg;
+
+    for ( ;; )
+    {
+        // Wait for a connection
+        pthread_mutex_lock(&conn_queue_mutex);
+        while (conn_queue_count == 0)
+        {
+            pthread_cond_wait(&conn_queue_not_empty, &conn_queue_mutex);
+        }
+        ConnectionDescriptor *cd = conn_queue[conn_queue_head];
+        conn_queue_head = (conn_queue_head + 1) % CONNECTION_QUEUE_SIZE;
+        conn_queue_count--;
+        conn_active++;
+        pthread_mutex_unlock(&conn_queue_mutex);
+
+        // The whole connection is handled with the config that was current when it started
+        config_enter(w->index);
+        if (g_server_config.debug)
+        {
+            printf("[Socket:Worker:%d] Handling connection %d\n", w->index, cd->conn_id);
+        }
+
+        socket_handle_connection(w, cd);
+        config_leave(w->index);
+
+        pthread_mutex_lock(&conn_queue_mutex);
+        conn_active--;
+        pthread_mutex_unlock(&conn_queue_mutex);
+    }
+
     return NULL;
 }
 
+void socket_start_workers(void)
+{
+    int count = g_server_config.worker_threads;
+    workers = calloc(count, sizeof(Worker));
+    accept_reader = count;
+    timer_start();
+    if (pipe2(stop_pipe, O_CLOEXEC))
+    {
+        fprintf(stderr, "Failed to create the stop pipe: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        Worker *w = &workers[i];
+        w->index = i;
+        w->avg_request_size = MIN_BUFFER_SIZE;
+        w->avg_response_size = MIN_BUFFER_SIZE;
+        arena_init(&w->arena);
+        char_vector_init(&w->request_vec, MIN_BUFFER_SIZE);
+        char_vector_init(&w->head_vec, MIN_BUFFER_SIZE);
+        char_vector_init(&w->response_vec, MIN_BUFFER_SIZE);
+
+        int res = pthread_create(&w->tid, NULL, socket_worker_thread, w);
+        if (res)
+        {
+            fprintf(stderr, "Failed to create worker thread %d, err: %d\n", i, res);
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(w->tid);
+    }
+
+    if (g_server_config.debug)
+    {
+        printf("[Socket:Workers] Started %d worker threads\n", count);
+    }
+}
+
+// Over capacity, answered right away by the accepting thread without a worker or any buffers
+static void socket_reject(int conn_fd)
+{
+    char buffer[RECEIVE_CHUNK_SIZE];
+
+    // The request that arrived already is dropped, so the close doesn't reset the connection
+    recv(conn_fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+
+    int len = snprintf(buffer, sizeof(buffer),
+        "HTTP/1.1 503 Service Unavailable\r\n"
+        "Server: " SERVER_NAME " " SERVER_VERSION "\r\n"
+        "Retry-After: %d\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: Close\r\n\r\n", CONNECTION_RETRY_AFTER);
+    send(conn_fd, buffer, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    close(conn_fd);
+
+    if (g_server_config.debug)
+    {
+        printf("[Socket:Accept] Over capacity, refused a connection\n");
+    }
+}
+
+// Waits for the next connection, returns -1 once socket_stop_accepting() was called
 int socket_accept_connection(int listen_fd)
 {
     static int conn_id = 0;
 
+    struct pollfd pfds[2] = {
+        { .fd = listen_fd, .events = POLLIN },
+        { .fd = stop_pipe[0], .events = POLLIN },
+    };
+    if (poll(pfds, 2, -1) < 0) { return 0; }
+    if (pfds[1].revents) { return -1; }
+
+    // Non-blocking as well, the workers only wait in poll() and the deadlines are kept by the timers
     struct sockaddr_storage cliaddr;
     socklen_t addrlen = sizeof(cliaddr);
+    int conn_fd = accept4(listen_fd, (struct sockaddr*)&cliaddr, &addrlen, SOCK_CLOEXEC | SOCK_NONBLOCK);
 
+    // Another process sharing the socket might have been faster
+    if (conn_fd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) { return 0; }
+
+    // Not pinned while waiting in poll(), that would hold up a reload until the next connection
     conn_id++;
-    int conn_fd = accept(listen_fd, (struct sockaddr*)&cliaddr, &addrlen);
+    config_enter(accept_reader);
     if (conn_fd < 0) 
     { 
         log_error(conn_id, "Something went wrong when accepting a connection\n");
+        config_leave(accept_reader);
         return 1; 
     }
 
-    ConnectionDescriptor *cd = malloc(sizeof(ConnectionDescriptor));
+    ConnectionDescriptor *cd = calloc(1, sizeof(ConnectionDescriptor));
     cd->conn_id = conn_id;
     cd->conn_fd = conn_fd;
     cd->start_us = now_us();
     memcpy(&cd->cliaddr, &cliaddr, sizeof(struct sockaddr_storage));
 
-    // Create a thread for the new connection
-    pthread_t tid;
-    int res = pthread_create(&tid, NULL, socket_handle_connection_thread, cd);
-    pthread_detach(tid);
+    // Hand the connection over to the workers, unless there are too many already
+    pthread_mutex_lock(&conn_queue_mutex);
+    if (conn_queue_count == CONNECTION_QUEUE_SIZE ||
+        conn_queue_count + conn_active >= g_server_config.max_connections)
+    {
+        conn_rejected++;
+        pthread_mutex_unlock(&conn_queue_mutex);
+        socket_reject(conn_fd);
+        free(cd);
+        config_leave(accept_reader);
+        return 0;
+    }
+    int tail = (conn_queue_head + conn_queue_count) % CONNECTION_QUEUE_SIZE;
+    conn_queue[tail] = cd;
+    conn_queue_count++;
+    pthread_cond_signal(&conn_queue_not_empty);
+    pthread_mutex_unlock(&conn_queue_mutex);
+    config_leave(accept_reader);
 
-    if (!res)
+    return 0;
+}
+
+// Makes socket_accept_connection() return -1, the listening socket itself stays open
+void socket_stop_accepting(void)
+{
+    char byte = 0;
+    if (write(stop_pipe[1], &byte, 1) < 0)
     {
-        if (g_server_config.debug)
-        {
-            printf("[Socket:Accept] Created a thread for connection %d, tid: %ld\n",
-                conn_id, tid);
-        }
+        log_error(0, "Could not stop accepting connections: %s\n", strerror(errno));
     }
-    else
+}
+
+// Waits until the accepted connections are closed, returns how many are still open after the timeout
+int socket_drain(int timeout_ms)
+{
+    uint64_t deadline = now_ms() + timeout_ms;
+    struct timespec pause = { .tv_sec = 0, .tv_nsec = DRAIN_POLL_GRANULARITY_MS * 1000000 };
+    for ( ;; )
     {
-        log_error(conn_id, "Failed to create a thread for connection %d, err: %d\n",
-            conn_id, res);
+        pthread_mutex_lock(&conn_queue_mutex);
+        int open = conn_queue_count + conn_active;
+        pthread_mutex_unlock(&conn_queue_mutex);
+
+        if (open == 0 || now_ms() >= deadline) { return open; }
+        nanosleep(&pause, NULL);
     }
+}
 
-    return 0;
+void socket_get_stats(SocketStats *stats)
+{
+    pthread_mutex_lock(&conn_queue_mutex);
+    stats->open = conn_active;
+    stats->queued = conn_queue_count;
+    stats->rejected = conn_rejected;
+    pthread_mutex_unlock(&conn_queue_mutex);
 }
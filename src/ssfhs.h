@@ -13,6 +13,12 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "ssfhs_plugin.h"
 
 //////////////////////////////////////////////////////////////////////////////
 //                                 Defines                                  //
@@ -22,24 +28,119 @@
 #define SERVER_VERSION "v0.1"
 
 #define DYNAMIC_TAG "ssfhs-dyn"
-
-#define RECEIVE_POLL_GRANULARITY_MS    50     // ms
-#define SUBPROCESS_POLL_GRANULARITY_MS 5      // ms
+#define INCLUDE_TAG "ssfhs-include"
+#define VAR_TAG     "ssfhs-var"
+#define DATE_TAG    "ssfhs-date"
+#define PLUGIN_TAG  "ssfhs-plugin"
+#define DEFAULT_DATE_FORMAT "%Y-%m-%d %H:%M:%S"
+#define ALLOWED_METHODS "GET, HEAD, POST, OPTIONS"
+
+#define SUBPROCESS_POLL_GRANULARITY_MS 5      // ms (only without pidfd support)
 #define DEFAULT_REQUEST_TIMEOUT        5000   // ms
+#define DEFAULT_SEND_TIMEOUT           10000  // ms (without any progress)
+#define TIMER_TICK_MS                  1      // ms
+#define TIMER_WHEEL_BITS               6
+#define TIMER_WHEEL_SLOTS              (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS             4      // 2^24 ticks, longer timers go round again
 #define DEFAULT_DYNAMIC_TIMEOUT        100    // ms
+#define DEFAULT_WORKER_THREADS         32
+#define DEFAULT_DYNAMIC_WORKERS        4
+#define DEFAULT_DYNAMIC_WORKER_MAX_REQUESTS 1000
+#define DEFAULT_DYNAMIC_MAX_PROCS      64
+#define DEFAULT_DYNAMIC_QUEUE_SIZE     128
+#define DEFAULT_DYNAMIC_QUEUE_TIMEOUT  1000   // ms
+#define DYNAMIC_RETRY_AFTER            1      // s (sent with 503 Service Unavailable)
+#define DEFAULT_DRAIN_TIMEOUT          10000  // ms
+#define DRAIN_POLL_GRANULARITY_MS      10     // ms
+#define UPGRADE_READY_TIMEOUT          30000  // ms
+#define LISTEN_FD_ENV                  "SSFHS_LISTEN_FD"
+#define READY_FD_ENV                   "SSFHS_READY_FD"
+#define CONNECTION_QUEUE_SIZE          256
+#define DEFAULT_MAX_CONNECTIONS        256
+#define CONNECTION_RETRY_AFTER         1      // s (sent with 503 when over MAX_CONNECTIONS)
+#define DEFAULT_MAX_HEADER_SIZE        16384  // bytes
+#define DEFAULT_MAX_HEADER_COUNT       100
+#define DEFAULT_MAX_URL_LENGTH         8192   // bytes
+#define DEFAULT_MAX_BODY_SIZE          1048576 // bytes
+#define LINGER_TIMEOUT_MS              100    // ms (reading the rest of a refused request)
+#define LINGER_MAX_BYTES               262144 // bytes
+#define RATE_LIMIT_SHARDS              64
+#define RATE_LIMIT_SHARD_BUCKETS       256
+#define RATE_LIMIT_SHARD_SIZE          4096   // clients
+#define RATE_LIMIT_SWEEP_INTERVAL      10000  // ms
+#define SEND_IOV_BATCH                 64
+#define RECEIVE_CHUNK_SIZE             4096   // bytes
+#define MIN_BUFFER_SIZE                4096   // bytes
+#define RECEIVE_BUFFER_CAP             65536  // bytes
+#define RESPONSE_BUFFER_CAP            1048576 // bytes
 #define LOG_BUFFER_SIZE                8192   // bytes
+#define TEMPLATE_CACHE_BUCKETS         64
+#define DYNAMIC_CACHE_BUCKETS          256
+#define DEFAULT_COMPRESSION_LEVEL      6
+#define DEFAULT_COMPRESSION_MIN_SIZE   1024   // bytes
+#define DEFAULT_COMPRESSION_CACHE_SIZE 16777216 // bytes
+#define COMPRESSION_CACHE_BUCKETS      256
+#define DEFAULT_LISTING_PAGE_SIZE      200
+#define LISTING_CACHE_BUCKETS          64
+#define LISTING_CACHE_SIZE             256    // directories
+#define SNAPSHOT_MIN_BUCKETS           64
+#define RESOURCE_ENCODING_VARIANTS     2      // Precompressed siblings (.br, .gz)
+#define ARENA_CHUNK_SIZE               16384  // bytes
+#define ARENA_LARGE_BLOCK              8192   // bytes (bigger blocks go to the heap)
+
+// Returned by the resource functions when the dynamic executor is saturated
+#define RESOURCE_BUSY 2
+// Returned when the client's cached copy is still valid (304 Not Modified)
+#define RESOURCE_NOT_MODIFIED 3
+// Returned when only a range of the resource is sent (206 Partial Content)
+#define RESOURCE_PARTIAL 4
+// Returned when the requested range is outside of the resource (416 Range Not Satisfiable)
+#define RESOURCE_BAD_RANGE 5
 
 //////////////////////////////////////////////////////////////////////////////
 //                            Data Structures                               //
 //////////////////////////////////////////////////////////////////////////////
 
+typedef struct ArenaChunk ArenaChunk;
+typedef struct ArenaCleanup ArenaCleanup;
+
+// Bump allocator, everything allocated from it is released at once by a reset
+typedef struct {
+    ArenaChunk *chunks;
+    ArenaCleanup *cleanups;
+    size_t used;
+    size_t high_water;
+} Arena;
+
+typedef struct {
+    size_t high_water;
+    uint64_t resets;
+    uint64_t chunk_allocs;
+    uint64_t large_allocs;
+} ArenaStats;
+
+void  arena_init(Arena *arena);
+void* arena_alloc(Arena *arena, size_t size);
+int   arena_defer(Arena *arena, void (*fn)(void *arg), void *arg);
+int   arena_adopt(Arena *arena, void *ptr);
+char* arena_strdup(Arena *arena, const char *str);
+char* arena_strndup(Arena *arena, const char *str, size_t len);
+void  arena_reset(Arena *arena);
+void  arena_free(Arena *arena);
+void  arena_get_stats(ArenaStats *stats);
+
+// If the arena is set the items are allocated from it and never freed
 typedef struct {
     char **items;
     size_t count;
+    size_t capacity;
+    Arena *arena;
 } StringArray;
 
 void string_array_init(StringArray *array);
+void string_array_init_arena(StringArray *array, Arena *arena);
 void string_array_add(StringArray *array, const char *item);
+void string_array_add_len(StringArray *array, const char *item, size_t len);
 char* string_array_get(StringArray *array, size_t index);
 void string_array_free(StringArray *array);
 
@@ -52,6 +153,10 @@ typedef struct {
 void  char_vector_init(CharVector *vec, int initial_size);
 void  char_vector_push(CharVector *vec, char c);
 void  char_vector_push_arr(CharVector *vec, const char *arr, size_t len);
+void  char_vector_reserve(CharVector *vec, size_t len);
+void  char_vector_commit(CharVector *vec, size_t len);
+void  char_vector_clear(CharVector *vec);
+void  char_vector_trim(CharVector *vec, size_t max_size);
 char  char_vector_get_char(const CharVector *vec, size_t index);
 int   char_vector_get(const CharVector *vec, void *dst, size_t index, size_t len);
 char* char_vector_get_alloc(const CharVector *vec, size_t index, size_t len);
@@ -65,6 +170,27 @@ void  char_vector_free(CharVector *vec);
 //  at the end
 char *strtrim(const char *str);
 
+// Same as above but in place, moves the start and shrinks the length
+void strtrim_span(const char **str, size_t *len);
+
+// Percent-encodes everything except the unreserved characters and the ones in keep (can be NULL)
+//  into dst, which has to hold 3 * strlen(str) + 1 bytes. Returns the encoded length
+size_t url_encode(char *dst, const char *str, const char *keep);
+
+// Shell like pattern matching, '*' matches any run of characters (including '/'),
+//  '?' exactly one
+bool glob_match(const char *pattern, const char *str);
+
+// Hashes used by the caches
+uint32_t hash_bytes(const void *data, size_t len);
+uint32_t hash_string(const char *str);
+
+// Parses a duration like "10s" or "500ms" into milliseconds (-1 on error)
+int parse_duration_ms(const char *str, int default_unit_ms);
+
+// Parses a size like "64k" or "16M" into bytes (-1 on error)
+long parse_size_bytes(const char *str);
+
 // Returns current time in milliseconds (used for timeouts)
 uint64_t now_ms(void);
 
@@ -75,6 +201,36 @@ uint64_t now_us(void);
 //                      CLI Arguments & Config File                         //
 //////////////////////////////////////////////////////////////////////////////
 
+typedef enum {
+    DYNAMIC_BACKEND_FORK,     // fork + exec /bin/sh for every command
+    DYNAMIC_BACKEND_WORKER,   // persistent worker processes
+} DynamicBackend;
+
+// Serves the URL with a handler from a plugin
+typedef struct {
+    char *url;
+    char *handler;
+} PluginUrlRule;
+
+// Cache-Control sent for the URLs matching the pattern (compiled when the config is loaded)
+typedef struct {
+    char *pattern;              // Without the leading '/', '*' and '?' are wildcards
+    char *header;               // The whole "Cache-Control: ...\r\n" line
+    int max_age;                // Seconds, for Expires (-1 if there's no max-age)
+} CacheControlRule;
+
+// Token bucket of a client, rate tokens a second up to burst (rate 0 means no limit)
+typedef struct {
+    int rate;
+    int burst;
+} RateLimitRule;
+
+// Caches the output of a dynamic command (matched by its trimmed text, "*" matches all)
+typedef struct {
+    char *cmd;
+    int ttl_ms;
+} DynamicCacheRule;
+
 typedef struct {
     // Settings coming from the CLI
     uint16_t port;
@@ -82,6 +238,8 @@ typedef struct {
     char *root_dir;
     char *log_file;
     char *config_file;
+    bool snapshot;
+    char *archive_file;                 // Served instead of the root (implies snapshot)
 
     // Settings coming from the config
     StringArray protected_files;
@@ -91,15 +249,54 @@ typedef struct {
     char *forbidden_page_file;
     char *not_found_page_file;
     char *server_error_page_file;
+    char *service_unavailable_page_file;
+    char *status_url;
     int request_timeout_ms;
+    int send_timeout_ms;
+    int drain_timeout_ms;
+    int max_connections;
+    size_t max_header_size;
+    int max_header_count;
+    int max_url_length;
+    size_t max_body_size;
+    RateLimitRule rate_limit_static;
+    RateLimitRule rate_limit_dynamic;
     int dynamic_timeout;
+    int worker_threads;
     bool ignore_dynamic_errors;
+    bool dynamic_streaming;
+    bool dynamic_head;
+    DynamicCacheRule *dynamic_cache_rules;
+    int dynamic_cache_rule_count;
+    DynamicBackend dynamic_backend;
+    char *dynamic_worker;
+    int dynamic_workers;
+    int dynamic_worker_max_requests;
+    int dynamic_max_procs;
+    int dynamic_queue_size;
+    int dynamic_queue_timeout_ms;
+    StringArray plugin_files;
+    PluginUrlRule *plugin_urls;
+    int plugin_url_count;
+    bool directory_listing;
+    int listing_page_size;
+    CacheControlRule *cache_control_rules;
+    int cache_control_rule_count;
+    bool compression;
+    int compression_level;
+    size_t compression_min_size;
+    size_t compression_cache_size;
 } ServerConfig;
 
 void cli_args_parse(ServerConfig *config, int argc, const char **argv);
 
-void config_load(ServerConfig *config);
+int config_load(ServerConfig *config);
 void config_free(ServerConfig *config);
+void config_publish(ServerConfig *config, int reader_slots);
+ServerConfig *config_get(void);
+void config_enter(int reader);
+void config_leave(int reader);
+int config_reload(void);
 
 //////////////////////////////////////////////////////////////////////////////
 //                               Logging                                    //
@@ -110,78 +307,401 @@ void log_close_file(void);
 void log_error(int conn_id, const char *format, ...);
 void log_message(int conn_id, const char *format, ...);
 
+//////////////////////////////////////////////////////////////////////////////
+//                                Timers                                    //
+//////////////////////////////////////////////////////////////////////////////
+
+// Owned by whoever arms it, has to stay around until it fired or was cancelled
+typedef struct Timer {
+    struct Timer *next;
+    struct Timer *prev;
+    uint64_t expires;           // Tick
+    void (*fire)(void *ctx);    // Called from the timer thread, must not arm or cancel timers
+    void *ctx;
+    int level;
+    int slot;
+    bool armed;
+} Timer;
+
+typedef struct {
+    int armed;
+    uint64_t fired;
+} TimerStats;
+
+void timer_start(void);
+void timer_arm(Timer *timer, int timeout_ms, void (*fire)(void *ctx), void *ctx);
+bool timer_cancel(Timer *timer);
+void timer_get_stats(TimerStats *stats);
+
 //////////////////////////////////////////////////////////////////////////////
 //                               Network                                    //
 //////////////////////////////////////////////////////////////////////////////
 
+typedef struct {
+    int open;                   // Taken by a worker
+    int queued;
+    uint64_t rejected;          // Over MAX_CONNECTIONS, answered with 503 right away
+} SocketStats;
+
 typedef struct {
     uint64_t start_us;
     int conn_fd;
     int conn_id;
     struct sockaddr_storage cliaddr;
+    Timer deadline;             // Receive and send deadlines, shuts the socket down
 } ConnectionDescriptor;
 
+// Each worker thread owns buffers that are reused across the connections
+typedef struct {
+    int index;
+    pthread_t tid;
+    Arena arena;
+    CharVector request_vec;
+    CharVector head_vec;
+    CharVector response_vec;
+    size_t avg_request_size;
+    size_t avg_response_size;
+} Worker;
+
 int socket_open(uint16_t port);
+int socket_inherit(void);
+void socket_start_workers(void);
 int socket_accept_connection(int listen_fd);
+void socket_stop_accepting(void);
+int socket_drain(int timeout_ms);
+void socket_get_stats(SocketStats *stats);
 
 //////////////////////////////////////////////////////////////////////////////
 //                                 HTTP                                     //
 //////////////////////////////////////////////////////////////////////////////
 
+typedef enum {
+    HTTP_METHOD_GET,
+    HTTP_METHOD_HEAD,
+    HTTP_METHOD_POST,
+    HTTP_METHOD_OPTIONS,
+    HTTP_METHOD_UNSUPPORTED,    // Known, but nothing here handles it (405 Method Not Allowed)
+    HTTP_METHOD_UNKNOWN,        // 501 Not Implemented
+} HTTPMethod;
+
 typedef struct {
     bool okay;
+    Arena *arena;
+    const char *raw;            // The whole request as received
     char *method;
+    HTTPMethod method_type;
     char *url;
+    char *query;                // Without the '?', empty if there's none
     char *version;
+    char *remote_addr;
     StringArray header_keys;
     StringArray header_values;
     void *data;
     size_t data_len;
+    const struct Snapshot *snapshot;    // Index of the root pinned for the request (--snapshot)
+    int limit_status;           // 413/414/431 if it was over a limit (it isn't parsed then)
+    const struct sockaddr_storage *remote_sockaddr;     // For the rate limits
 } HTTPRequest;
 
+// The body is the body buffer followed by the parts and the file window (all may be used)
+typedef struct {
+    CharVector *head;
+    CharVector *body;
+    struct iovec *parts;
+    int part_count;
+    int part_capacity;
+    size_t part_len;
+    char **headers;             // Extra "Name: value\r\n" lines
+    int header_count;
+    int header_capacity;
+    int file_fd;                // A window of a file sent after the parts (-1 if none)
+    off_t file_offset;
+    size_t file_len;
+
+    // Set by the socket layer, lets the body be sent in chunks while it's generated
+    int (*write)(void *ctx, const struct iovec *iov, int count);
+    void *write_ctx;
+    bool streaming;             // The head was sent already
+    bool head_only;             // HEAD, the body is generated at most for its length
+    bool unknown_length;        // HEAD of a dynamic page that wasn't generated
+} HTTPResponse;
+
 bool http_got_whole_request(const CharVector *vec);
-void http_request_init(HTTPRequest *request);
+int http_check_limits(const CharVector *vec);
+void http_request_init(HTTPRequest *request, Arena *arena);
 int http_request_parse(const CharVector *vec, HTTPRequest *request);
 void http_request_free(HTTPRequest *request);
-int http_response_generate(int request_id, CharVector *response, HTTPRequest *request, const char *request_str);
+const char *http_request_get_header(const HTTPRequest *request, const char *name);
+double http_accept_quality(const char *accept, const char *token);
+void http_response_init(HTTPResponse *response, CharVector *head, CharVector *body);
+void http_response_add_part(HTTPResponse *response, Arena *arena, const void *data, size_t len);
+void http_response_add_header(HTTPResponse *response, Arena *arena, const char *name, const char *value);
+void http_response_add_header_line(HTTPResponse *response, Arena *arena, const char *line);
+size_t http_response_body_len(const HTTPResponse *response);
+int http_response_stream_start(HTTPResponse *response, const char *content_type);
+int http_response_stream_write(HTTPResponse *response, const struct iovec *iov, int count);
+int http_response_stream_end(HTTPResponse *response);
+int http_response_generate(int request_id, HTTPResponse *response, HTTPRequest *request);
 
 //////////////////////////////////////////////////////////////////////////////
 //                              Resource                                    //
 //////////////////////////////////////////////////////////////////////////////
 
-char *resource_resolve_url_path(const char *path);
+// A file the response is made of, fd is -1 if it isn't open yet
+typedef struct {
+    const char *path;
+    struct stat st;
+    int fd;
+    off_t offset;                       // Where the content starts in the descriptor
+    const void *data;                   // Mapped content, NULL if it has to be read
+} ResourceFile;
+
+char *resource_resolve_url_path(Arena *arena, const char *path);
 bool resource_is_accessible(const char *path);
 bool resource_is_protected(const char *path);
 bool resource_is_dynamic(const char *path);
-char* resource_get_content_type(const char *path);
-int resource_get(int request_id, void **buff, size_t *buffsz, const char *path, const char *request_str);
+bool resource_is_directory(const char *path);
+const char *resource_find_directory_index(Arena *arena, const char *path);
+const char* resource_get_content_type(const char *path);
+const char *resource_get_etag(Arena *arena, const struct stat *st, const char *encoding);
+const char *resource_select_encoding(Arena *arena, const char *path, const char *accept_encoding,
+    const char **encoding, bool *has_variants);
+int resource_get(int request_id, Arena *arena, HTTPResponse *response, const char *path, 
+    const HTTPRequest *request);
+int resource_get_window(int request_id, Arena *arena, HTTPResponse *response, 
+    const ResourceFile *file, off_t offset, size_t len);
+const char *resource_get_encoding_variant(int index, const char **suffix);
+
+//////////////////////////////////////////////////////////////////////////////
+//                              Snapshot                                    //
+//////////////////////////////////////////////////////////////////////////////
+
+typedef struct SnapshotEntry {
+    struct SnapshotEntry *next;             // Next one in the bucket
+    char *url;                              // Without the trailing '/'
+    ResourceFile file;                      // The static files are kept open
+    const char *content_type;
+    bool is_protected;
+    bool is_dynamic;
+    bool is_directory;
+    const struct SnapshotEntry *index;      // Index page of a directory
+    const struct SnapshotEntry *variants[RESOURCE_ENCODING_VARIANTS]; // Precompressed siblings
+} SnapshotEntry;
+
+typedef struct Snapshot Snapshot;
+
+// Site archive (ssfhs-pack), all offsets are from the start of the file
+#define ARCHIVE_MAGIC       "SSFHSPK1"
+#define ARCHIVE_VERSION     1
+#define ARCHIVE_ALIGN       64          // Content of the small files
+#define ARCHIVE_PAGE_ALIGN  4096        // Content of the files of at least a page
+
+#define ARCHIVE_PROTECTED   1
+#define ARCHIVE_DYNAMIC     2           // Not packed, still runs from the root directory
+#define ARCHIVE_DIRECTORY   4
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_count;
+    uint64_t entries_offset;            // ArchiveEntry[entry_count], sorted by URL
+    uint64_t strings_offset;            // NUL terminated URLs and content types
+    uint64_t size;                      // Of the whole archive, catches truncated copies
+} ArchiveHeader;
+
+typedef struct {
+    uint64_t url;                       // Offsets into the strings
+    uint64_t content_type;
+    uint64_t data_offset;               // 0 if there's no content
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t ino;                       // Of the source file, the ETags stay the same
+    uint32_t flags;                     // ARCHIVE_*
+    uint32_t reserved;
+} ArchiveEntry;
+
+void snapshot_init(void);
+int snapshot_reload(void);
+void snapshot_free(void);
+const Snapshot *snapshot_enter(int reader);
+void snapshot_leave(int reader);
+const SnapshotEntry *snapshot_lookup(const Snapshot *snapshot, const char *url);
+const ResourceFile *snapshot_select_encoding(const SnapshotEntry *entry, const char *accept_encoding,
+    const char **encoding, bool *has_variants);
+int snapshot_write_archive(const char *output, bool compress);
 
 //////////////////////////////////////////////////////////////////////////////
 //                          Dynamic Resource                                //
 //////////////////////////////////////////////////////////////////////////////
 
+typedef enum {
+    SEGMENT_LITERAL,
+    SEGMENT_COMMAND,
+    SEGMENT_INCLUDE,            // Contents of a file under the root dir
+    SEGMENT_VAR,                // Value of a request/environment variable
+    SEGMENT_DATE,               // Current time formatted with strftime()
+    SEGMENT_PLUGIN,             // Output of a plugin handler
+} SegmentType;
+
+// Literals point into the template text, the rest is null terminated
+//  (the command, the file, the variable name or the date format)
+typedef struct {
+    SegmentType type;
+    const char *text;
+    size_t len;
+    int cache_ms;
+    bool escape;                // Variables are HTML escaped unless encoding="none"
+    SsfhsHandler handler;       // Resolved when the template is compiled
+} TemplateSegment;
+
+typedef struct DynamicTemplate {
+    struct DynamicTemplate *next;
+    char *path;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    char *text;
+    size_t text_len;
+    TemplateSegment *segments;
+    int segment_count;
+    int command_count;
+    int refs;
+    bool raw;                   // Not compiled, just the file contents (for includes)
+} DynamicTemplate;
+
+DynamicTemplate* template_acquire(const char *path);
+DynamicTemplate* template_acquire_raw(const char *path);
+void template_release(void *tmpl);
+void template_cache_flush(void);
+
 typedef struct {
     CharVector out_vec;
     CharVector err_vec;
     const char *cmd;
     int pipe_out_fd[2];
     int pipe_err_fd[2];
+    int pidfd;
     pid_t pid;
-    int status;
+    bool exited;
+    int status;                 // -1 if it was killed
 } DynamicSubprocess;
 
+// Notifications about the execution, used for streaming (indexes are relative to base)
+typedef struct {
+    void (*started)(void *ctx);
+    void (*done)(void *ctx, int index, const void *data, size_t len, int status);
+    void *ctx;
+    int base;
+} DynamicProgress;
+
 typedef struct {
     DynamicSubprocess *processes;
     int count;
     int request_id;
+    const DynamicProgress *progress;
+    Timer deadline;             // Kills the processes that are still running
+    _Atomic bool timed_out;
 } DynamicSubprocesses;
 
-int dynamic_process(int request_id, void **buff, size_t *buffsz, const char *request_str);
+typedef struct {
+    int running;                // Slots in use
+    int queued;                 // Requests waiting for slots
+    int peak_queued;
+    uint64_t admitted;
+    uint64_t queued_total;      // Admitted or rejected after waiting
+    uint64_t rejected_full;
+    uint64_t rejected_timeout;
+    uint64_t wait_total_us;     // Of the admitted requests that had to wait
+    uint64_t wait_max_us;
+} DynamicExecutorStats;
+
+int  dynamic_executor_acquire(int request_id, int count, int *granted);
+void dynamic_executor_release(int count);
+void dynamic_executor_get_stats(DynamicExecutorStats *stats);
+
+void dynamic_workers_start(void);
+void dynamic_workers_stop(void);
+int dynamic_workers_execute(int request_id, Arena *arena, const char **cmds, int count,
+    struct iovec *outputs, int *statuses, char **vars, int var_count, const DynamicProgress *progress);
+
+bool dynamic_cache_get(Arena *arena, const char *cmd, struct iovec *output);
+void dynamic_cache_put(const char *cmd, int ttl_ms, const void *data, size_t len);
+
+void dynamic_environment_init(void);
+void dynamic_environment_free(void);
+int dynamic_process(int request_id, Arena *arena, HTTPResponse *response, const char *path, 
+    const HTTPRequest *request);
+
+//////////////////////////////////////////////////////////////////////////////
+//                             Compression                                  //
+//////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t size;                // Bytes held by the cache
+    int entries;
+} CompressionCacheStats;
+
+bool compression_is_compressible(const char *content_type);
+const char *compression_select_encoding(const char *accept_encoding);
+size_t compression_compress(const char *encoding, Arena *arena, const struct iovec *in, int count,
+    size_t in_len, void **out);
+bool compression_cache_get(Arena *arena, const char *path, const struct stat *st,
+    const char *encoding, struct iovec *data);
+void compression_cache_put(const char *path, const struct stat *st, const char *encoding,
+    const void *data, size_t len);
+void compression_cache_free(void);
+void compression_cache_get_stats(CompressionCacheStats *stats);
+
+//////////////////////////////////////////////////////////////////////////////
+//                              Rate Limits                                 //
+//////////////////////////////////////////////////////////////////////////////
+
+// Every client has a separate budget for each class
+enum {
+    RATE_LIMIT_STATIC,
+    RATE_LIMIT_DYNAMIC,         // Dynamic files and plugin URLs
+    RATE_LIMIT_CLASSES,
+};
+
+typedef struct {
+    int clients;
+    uint64_t limited_static;
+    uint64_t limited_dynamic;
+} RateLimitStats;
+
+void ratelimit_init(void);
+int ratelimit_take(const struct sockaddr_storage *addr, int class);
+void ratelimit_free(void);
+void ratelimit_get_stats(RateLimitStats *stats);
+
+//////////////////////////////////////////////////////////////////////////////
+//                          Directory Listing                               //
+//////////////////////////////////////////////////////////////////////////////
+
+int listing_generate(int request_id, const char *path, const char *url, int page, CharVector *out);
+void listing_cache_free(void);
+
+//////////////////////////////////////////////////////////////////////////////
+//                               Plugins                                    //
+//////////////////////////////////////////////////////////////////////////////
+
+void plugin_load_all(void);
+void plugin_unload_all(void);
+SsfhsHandler plugin_find_handler(const char *name);
+SsfhsHandler plugin_find_url(const char *url);
+int plugin_run(int request_id, SsfhsHandler handler, const HTTPRequest *request, 
+    CharVector *out, const char **content_type);
 
 //////////////////////////////////////////////////////////////////////////////
 //                           Global Variables                               //
 //////////////////////////////////////////////////////////////////////////////
 
-extern ServerConfig g_server_config;
+// The config of the running request (the current one outside of requests), it's
+// swapped on a reload, so a thread that keeps using it has to pin it with config_enter()
+#define g_server_config (*config_get())
 
 #endif
\ No newline at end of file
@@ -0,0 +1,66 @@
+/**
+ * @file ssfhs_plugin.h
+ * @author epsiii
+ * @brief Interface between SSFHS and the handlers loaded from shared objects
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * A plugin is a shared object that exports:
+ *
+ *   const int ssfhs_plugin_api_version = SSFHS_PLUGIN_API_VERSION;
+ *   const SsfhsHandlerEntry ssfhs_plugin_handlers[] = {
+ *       { "name", handler },
+ *       { NULL, NULL }
+ *   };
+ *   int  ssfhs_plugin_init(void);   (optional, non-zero refuses to load)
+ *   void ssfhs_plugin_fini(void);   (optional, called on shutdown)
+ *
+ * A handler is referenced by its name in the table, either from the config
+ * (PLUGIN_URL) or from a template (<ssfhs-plugin name="..."/>). Only the table
+ * is searched, so a misspelled name can't resolve to some other symbol the
+ * plugin happens to link against.
+ *
+ * Handlers are called from all the worker threads at once, so they have to
+ * be thread safe. The request and everything it points to are only valid
+ * during the call.
+ */
+#ifndef SSFHS_PLUGIN_H
+#define SSFHS_PLUGIN_H
+
+#include <stddef.h>
+
+// Bumped on every incompatible change of the structures below
+#define SSFHS_PLUGIN_API_VERSION 2
+
+// Read only view of the parsed request
+typedef struct {
+    int request_id;
+    const char *method;
+    const char *url;                    // Without the query string
+    const char *query;                  // Empty if there's none
+    const char *remote_addr;
+    const char *const *header_keys;
+    const char *const *header_values;
+    size_t header_count;
+    const void *body;
+    size_t body_len;
+} SsfhsRequest;
+
+// The output of a handler, write() copies the data (returns non-zero on failure)
+typedef struct SsfhsWriter {
+    int (*write)(struct SsfhsWriter *writer, const void *data, size_t len);
+    const char *content_type;           // Can be set for URL handlers (has to be static)
+    void *internal;
+} SsfhsWriter;
+
+// Returns 0 on success, anything else turns into 500 Internal Server Error
+typedef int (*SsfhsHandler)(const SsfhsRequest *request, SsfhsWriter *writer);
+
+// An entry of ssfhs_plugin_handlers[], the table ends with a NULL name
+typedef struct {
+    const char *name;
+    SsfhsHandler handler;
+} SsfhsHandlerEntry;
+
+#endif
@@ -0,0 +1,243 @@
+/**
+ * @file timer.c
+ * @author epsiii
+ * @brief Hierarchical timing wheel for the receive, send and dynamic deadlines
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * TIMER_WHEEL_LEVELS wheels of TIMER_WHEEL_SLOTS slots, a slot of the first
+ * one is a TIMER_TICK_MS tick and a slot of every next one is a whole turn of
+ * the previous. A timer goes into the slot of the lowest wheel that reaches
+ * its expiry, so arming and cancelling are a list insert and unlink. When the
+ * first wheel comes around, the timers of the next slot up are moved down.
+ * The timer thread only wakes up for the ticks that have something to fire or
+ * move down, and sleeps for good while nothing is armed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "ssfhs.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+static Timer *wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+static uint64_t occupied[TIMER_WHEEL_LEVELS];   // Bit per non-empty slot
+static uint64_t current_tick = 0;               // Everything up to this one has fired
+static uint64_t wakeup_tick = UINT64_MAX;       // The timer thread sleeps until this one
+static int armed_count = 0;
+static uint64_t fired_count = 0;
+static pthread_mutex_t wheel_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wheel_changed = PTHREAD_COND_INITIALIZER;
+
+static uint64_t timer_now_tick(void)
+{
+    return now_ms() / TIMER_TICK_MS;
+}
+
+// Ticks covered by the wheels up to the level (inclusive)
+static uint64_t timer_level_span(int level)
+{
+    return (uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1));
+}
+
+// Puts the timer into the slot of the lowest wheel that reaches its expiry (mutex has to be held)
+static void timer_insert(Timer *timer)
+{
+    uint64_t expires = timer->expires;
+    if (expires <= current_tick) { expires = current_tick + 1; }
+
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && expires - current_tick >= timer_level_span(level)) { level++; }
+
+    // Past the last wheel, it's moved down again once that slot comes around
+    uint64_t last = current_tick + timer_level_span(level) - 1;
+    if (expires > last) { expires = last; }
+
+    int slot = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    timer->level = level;
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = wheel[level][slot];
+    if (timer->next) { timer->next->prev = timer; }
+    wheel[level][slot] = timer;
+    occupied[level] |= (uint64_t)1 << slot;
+}
+
+// (mutex has to be held)
+static void timer_unlink(Timer *timer)
+{
+    if (timer->prev) { timer->prev->next = timer->next; }
+    else { wheel[timer->level][timer->slot] = timer->next; }
+    if (timer->next) { timer->next->prev = timer->prev; }
+    if (!wheel[timer->level][timer->slot]) { occupied[timer->level] &= ~((uint64_t)1 << timer->slot); }
+}
+
+// Moves the timers of a slot into the lower wheels (mutex has to be held)
+static void timer_cascade(int level, int slot)
+{
+    Timer *timer = wheel[level][slot];
+    wheel[level][slot] = NULL;
+    occupied[level] &= ~((uint64_t)1 << slot);
+    while (timer)
+    {
+        Timer *next = timer->next;
+        timer_insert(timer);
+        timer = next;
+    }
+}
+
+// Fires everything up to the tick, the callbacks run with the mutex held (mutex has to be held)
+static void timer_advance(uint64_t tick)
+{
+    while (current_tick < tick)
+    {
+        current_tick++;
+
+        // A turn of the first wheel is done, bring the next slots down
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++)
+        {
+            if (current_tick & (timer_level_span(level - 1) - 1)) { break; }
+            timer_cascade(level, (current_tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+        }
+
+        int slot = current_tick & TIMER_WHEEL_MASK;
+        while (wheel[0][slot])
+        {
+            Timer *timer = wheel[0][slot];
+            timer_unlink(timer);
+            timer->armed = false;
+            armed_count--;
+            fired_count++;
+            timer->fire(timer->ctx);
+        }
+
+        // Nothing left, skip straight to the end
+        if (armed_count == 0) { current_tick = tick; }
+    }
+}
+
+// The next tick with something to fire or to move down, UINT64_MAX if nothing is armed (mutex has to be held)
+static uint64_t timer_next_tick(void)
+{
+    if (armed_count == 0) { return UINT64_MAX; }
+
+    // The next turn of the first wheel, if there's anything to move down
+    uint64_t next = UINT64_MAX;
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        if (occupied[level])
+        {
+            next = (current_tick | TIMER_WHEEL_MASK) + 1;
+            break;
+        }
+    }
+
+    uint64_t pending = occupied[0];
+    if (pending)
+    {
+        // Rotate so the bit of the next tick comes first
+        int shift = (current_tick + 1) & TIMER_WHEEL_MASK;
+        uint64_t rotated = (pending >> shift) | ((shift) ? pending << (TIMER_WHEEL_SLOTS - shift) : 0);
+        uint64_t first = current_tick + 1 + __builtin_ctzll(rotated);
+        if (first < next) { next = first; }
+    }
+    return next;
+}
+
+static void* timer_thread(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&wheel_mutex);
+    for ( ;; )
+    {
+        timer_advance(timer_now_tick());
+
+        wakeup_tick = timer_next_tick();
+        if (wakeup_tick == UINT64_MAX)
+        {
+            pthread_cond_wait(&wheel_changed, &wheel_mutex);
+            continue;
+        }
+
+        uint64_t wakeup_ms = wakeup_tick * TIMER_TICK_MS;
+        struct timespec ts = {
+            .tv_sec = wakeup_ms / 1000,
+            .tv_nsec = (wakeup_ms % 1000) * 1000000,
+        };
+        pthread_cond_timedwait(&wheel_changed, &wheel_mutex, &ts);
+    }
+    return NULL;
+}
+
+void timer_start(void)
+{
+    // The ticks are counted on the same clock as now_ms()
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wheel_changed, &attr);
+    pthread_condattr_destroy(&attr);
+    current_tick = timer_now_tick();
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, timer_thread, NULL))
+    {
+        fprintf(stderr, "Failed to create the timer thread\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(tid);
+}
+
+// Calls fire(ctx) from the timer thread after timeout_ms, unless the timer is cancelled before that.
+//  Arming an armed timer moves it to the new expiry
+void timer_arm(Timer *timer, int timeout_ms, void (*fire)(void *ctx), void *ctx)
+{
+    uint64_t now = timer_now_tick();
+
+    pthread_mutex_lock(&wheel_mutex);
+    if (timer->armed) { timer_unlink(timer); }
+    else { armed_count++; }
+
+    // The wheel stands still while it's empty
+    if (armed_count == 1 && current_tick < now) { current_tick = now; }
+
+    timer->expires = now + (timeout_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    timer->fire = fire;
+    timer->ctx = ctx;
+    timer->armed = true;
+    timer_insert(timer);
+
+    // Earlier than the timer thread is going to wake up
+    if (timer->expires < wakeup_tick)
+    {
+        wakeup_tick = timer->expires;
+        pthread_cond_signal(&wheel_changed);
+    }
+    pthread_mutex_unlock(&wheel_mutex);
+}
+
+// Returns true if the timer was cancelled, false if it has fired already (or was never armed).
+//  The callback is never running anymore once this returns
+bool timer_cancel(Timer *timer)
+{
+    pthread_mutex_lock(&wheel_mutex);
+    bool was_armed = timer->armed;
+    if (was_armed)
+    {
+        timer_unlink(timer);
+        timer->armed = false;
+        armed_count--;
+    }
+    pthread_mutex_unlock(&wheel_mutex);
+    return was_armed;
+}
+
+void timer_get_stats(TimerStats *stats)
+{
+    pthread_mutex_lock(&wheel_mutex);
+    stats->armed = armed_count;
+    stats->fired = fired_count;
+    pthread_mutex_unlock(&wheel_mutex);
+}
@@ -0,0 +1,401 @@
+/**
+ * @file tmpl.c
+ * @author epsiii
+ * @brief Compiled dynamic templates, included files and their cache
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "ssfhs.h"
+
+static const char *tag_prefix = "<ssfhs-";
+static const char *closing_tag = "</" DYNAMIC_TAG ">";
+
+// Prefixes of the variables that differ for every request
+static const char *request_variables[] = { 
+    "REQUEST_", "QUERY_STRING", "REMOTE_ADDR", "HTTP_" 
+};
+
+static DynamicTemplate *template_cache[TEMPLATE_CACHE_BUCKETS];
+static pthread_mutex_t template_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static bool template_is_current(const DynamicTemplate *tmpl, const struct stat *st)
+{
+    return tmpl->ino == st->st_ino &&
+        tmpl->size == st->st_size &&
+        tmpl->mtime.tv_sec == st->st_mtim.tv_sec &&
+        tmpl->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static void template_free(DynamicTemplate *tmpl)
+{
+    free(tmpl->path);
+    free(tmpl->text);
+    free(tmpl->segments);
+    free(tmpl);
+}
+
+static TemplateSegment* template_add_segment(DynamicTemplate *tmpl, int *capacity,
+    SegmentType type, char *text, size_t len)
+{
+    // Skip the empty literals
+    if (type == SEGMENT_LITERAL && len == 0) { return NULL; }
+
+    if (tmpl->segment_count == *capacity)
+    {
+        *capacity = (*capacity) ? *capacity * 2 : 8;
+        tmpl->segments = realloc(tmpl->segments, *capacity * sizeof(TemplateSegment));
+    }
+
+    TemplateSegment *seg = &tmpl->segments[tmpl->segment_count++];
+    seg->type = type;
+    seg->text = text;
+    seg->len = len;
+    seg->cache_ms = 0;
+    seg->escape = false;
+    seg->handler = NULL;
+
+    if (type == SEGMENT_COMMAND) { tmpl->command_count++; }
+    return seg;
+}
+
+// Finds the value of name="value" in the tag attributes (not null terminated)
+static bool template_find_attribute(const char *attrs, size_t len, const char *name, 
+    const char **out, size_t *out_len)
+{
+    const char *ptr = attrs;
+    const char *end = attrs + len;
+    size_t name_len = strlen(name);
+
+    while (ptr < end)
+    {
+        // Skip the whitespaces
+        while (ptr < end && isspace((unsigned char)*ptr)) { ptr++; }
+        if (ptr >= end) { break; }
+
+        // Get the attribute name
+        const char *attr = ptr;
+        while (ptr < end && *ptr != '=' && !isspace((unsigned char)*ptr)) { ptr++; }
+        size_t attr_len = ptr - attr;
+        if (ptr + 1 >= end || ptr[0] != '=' || ptr[1] != '"') { return false; }
+        ptr += 2;
+
+        // Get the value
+        const char *value = ptr;
+        while (ptr < end && *ptr != '"') { ptr++; }
+        if (ptr >= end) { return false; }
+        size_t value_len = ptr - value;
+        ptr++;
+
+        if (attr_len == name_len && strncmp(attr, name, name_len) == 0)
+        {
+            *out = value;
+            *out_len = value_len;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Copies the value of name="value" from the tag attributes into out
+static bool template_get_attribute(const char *attrs, size_t len, const char *name, 
+    char *out, size_t out_size)
+{
+    const char *value;
+    size_t value_len;
+    if (!template_find_attribute(attrs, len, name, &value, &value_len)) { return false; }
+    if (value_len >= out_size) { return false; }
+
+    memcpy(out, value, value_len);
+    out[value_len] = '\0';
+    return true;
+}
+
+// The cache attribute always wins, the config rules skip the commands that use
+//  the request variables (their output differs for every request)
+static int template_command_cache_ms(const DynamicTemplate *tmpl, const char *attrs, 
+    size_t attrs_len, const char *cmd, size_t cmd_len)
+{
+    char value[32];
+    if (template_get_attribute(attrs, attrs_len, "cache", value, sizeof(value)))
+    {
+        int ttl = parse_duration_ms(value, 1000);
+        if (ttl < 0)
+        {
+            log_error(0, "Invalid cache attribute \"%s\" in: %s (ignored)\n", value, tmpl->path);
+            return 0;
+        }
+        return ttl;
+    }
+
+    strtrim_span(&cmd, &cmd_len);
+    for (int i = 0; i < g_server_config.dynamic_cache_rule_count; i++)
+    {
+        const DynamicCacheRule *rule = &g_server_config.dynamic_cache_rules[i];
+        bool match = (strcmp(rule->cmd, "*") == 0) ||
+            (strlen(rule->cmd) == cmd_len && strncmp(rule->cmd, cmd, cmd_len) == 0);
+        if (!match) { continue; }
+
+        for (size_t j = 0; j < sizeof(request_variables) / sizeof(request_variables[0]); j++)
+        {
+            if (strstr(cmd, request_variables[j])) { return 0; }
+        }
+        return rule->ttl_ms;
+    }
+
+    return 0;
+}
+
+static bool template_tag_is(const char *name, size_t len, const char *tag)
+{
+    return strlen(tag) == len && strncmp(name, tag, len) == 0;
+}
+
+// Directives have no body, the value of their main attribute becomes the segment text
+static int template_compile_directive(DynamicTemplate *tmpl, TemplateSegment *seg, 
+    char *attrs, size_t attrs_len)
+{
+    const char *names[] = { 
+        [SEGMENT_INCLUDE] = "file", [SEGMENT_VAR] = "name", [SEGMENT_DATE] = "fmt", [SEGMENT_PLUGIN] = "name" 
+    };
+    const char *value;
+    size_t value_len;
+
+    // Self closing tags are fine too
+    if (attrs_len && attrs[attrs_len - 1] == '/') { attrs_len--; }
+
+    char encoding[16];
+    seg->escape = !(template_get_attribute(attrs, attrs_len, "encoding", encoding, sizeof(encoding)) &&
+        strcmp(encoding, "none") == 0);
+
+    if (!template_find_attribute(attrs, attrs_len, names[seg->type], &value, &value_len))
+    {
+        if (seg->type == SEGMENT_DATE)
+        {
+            seg->text = DEFAULT_DATE_FORMAT;
+            seg->len = strlen(DEFAULT_DATE_FORMAT);
+            return 0;
+        }
+        log_error(0, "Missing %s attribute in a directive in: %s\n", names[seg->type], tmpl->path);
+        return 1;
+    }
+
+    // The closing quote becomes the terminator
+    ((char*)value)[value_len] = '\0';
+    seg->text = value;
+    seg->len = value_len;
+
+    if (seg->type == SEGMENT_PLUGIN)
+    {
+        seg->handler = plugin_find_handler(value);
+        if (!seg->handler)
+        {
+            log_error(0, "Unknown plugin handler \"%s\" in: %s\n", value, tmpl->path);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Splits the text into the literals, commands and directives (null terminated in place)
+static int template_compile(DynamicTemplate *tmpl)
+{
+    int capacity = 0;
+    char *ptr = tmpl->text;
+    char *end = tmpl->text + tmpl->text_len;
+
+    char *search = ptr;
+    while (search < end)
+    {
+        // Find the next tag and get its name
+        char *opening = strstr(search, tag_prefix);
+        if (!opening) { break; }
+        char *name = opening + 1;
+        size_t name_len = strcspn(name, " \t\r\n/>");
+        char *attrs = name + name_len;
+
+        SegmentType type;
+        if (template_tag_is(name, name_len, DYNAMIC_TAG))      { type = SEGMENT_COMMAND; }
+        else if (template_tag_is(name, name_len, INCLUDE_TAG)) { type = SEGMENT_INCLUDE; }
+        else if (template_tag_is(name, name_len, VAR_TAG))     { type = SEGMENT_VAR; }
+        else if (template_tag_is(name, name_len, DATE_TAG))    { type = SEGMENT_DATE; }
+        else if (template_tag_is(name, name_len, PLUGIN_TAG))  { type = SEGMENT_PLUGIN; }
+        else
+        {
+            search = attrs;
+            continue;
+        }
+
+        // Find the end of the opening tag
+        char *tag_end = strchr(attrs, '>');
+        if (!tag_end)
+        {
+            log_error(0, "Unclosed <%.*s> tag in: %s\n", (int)name_len, name, tmpl->path);
+            return 1;
+        }
+
+        template_add_segment(tmpl, &capacity, SEGMENT_LITERAL, ptr, opening - ptr);
+        if (type != SEGMENT_COMMAND)
+        {
+            TemplateSegment *seg = template_add_segment(tmpl, &capacity, type, NULL, 0);
+            if (template_compile_directive(tmpl, seg, attrs, tag_end - attrs)) { return 1; }
+            ptr = search = tag_end + 1;
+            continue;
+        }
+
+        // Commands go up to the closing tag
+        char *cmd = tag_end + 1;
+        char *closing = strstr(cmd, closing_tag);
+        if (!closing)
+        {
+            log_error(0, "Unclosed <%s> tag in: %s\n", DYNAMIC_TAG, tmpl->path);
+            return 1;
+        }
+
+        TemplateSegment *seg = 
+            template_add_segment(tmpl, &capacity, SEGMENT_COMMAND, cmd, closing - cmd);
+        *closing = '\0';
+        seg->cache_ms = template_command_cache_ms(tmpl, attrs, tag_end - attrs, cmd, closing - cmd);
+
+        ptr = search = closing + strlen(closing_tag);
+    }
+
+    // Copy the remaining text
+    template_add_segment(tmpl, &capacity, SEGMENT_LITERAL, ptr, end - ptr);
+
+    if (g_server_config.debug)
+    {
+        printf("[TEMPLATE:Compile] %s: %d segments, %d commands\n",
+            tmpl->path, tmpl->segment_count, tmpl->command_count);
+    }
+
+    return 0;
+}
+
+static DynamicTemplate* template_load(const char *path, const struct stat *st, bool raw)
+{
+    DynamicTemplate *tmpl = calloc(1, sizeof(DynamicTemplate));
+    tmpl->path = strdup(path);
+    tmpl->raw = raw;
+    tmpl->ino = st->st_ino;
+    tmpl->size = st->st_size;
+    tmpl->mtime = st->st_mtim;
+    tmpl->refs = 1;
+
+    // Read the whole file (+1 for a null terminator)
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        log_error(0, "Could not open template %s: %s\n", path, strerror(errno));
+        template_free(tmpl);
+        return NULL;
+    }
+    tmpl->text = malloc(st->st_size + 1);
+    tmpl->text_len = fread(tmpl->text, 1, st->st_size, f);
+    tmpl->text[tmpl->text_len] = '\0';
+    fclose(f);
+
+    if ((off_t)tmpl->text_len != st->st_size || (!raw && template_compile(tmpl)))
+    {
+        log_error(0, "Failed to compile template: %s\n", path);
+        template_free(tmpl);
+        return NULL;
+    }
+
+    return tmpl;
+}
+
+static DynamicTemplate* template_acquire_mode(const char *path, bool raw)
+{
+    struct stat st;
+    if (stat(path, &st)) { return NULL; }
+
+    unsigned bucket = hash_string(path) % TEMPLATE_CACHE_BUCKETS;
+
+    // Look for an up to date template in the cache
+    pthread_mutex_lock(&template_cache_mutex);
+    for (DynamicTemplate *tmpl = template_cache[bucket]; tmpl; tmpl = tmpl->next)
+    {
+        if (tmpl->raw == raw && strcmp(tmpl->path, path) == 0 && template_is_current(tmpl, &st))
+        {
+            tmpl->refs++;
+            pthread_mutex_unlock(&template_cache_mutex);
+            return tmpl;
+        }
+    }
+    pthread_mutex_unlock(&template_cache_mutex);
+
+    // Compile it outside of the lock
+    DynamicTemplate *fresh = template_load(path, &st, raw);
+    if (!fresh) { return NULL; }
+
+    // Replace the stale entry, the cache holds one reference
+    pthread_mutex_lock(&template_cache_mutex);
+    DynamicTemplate **link = &template_cache[bucket];
+    while (*link)
+    {
+        DynamicTemplate *tmpl = *link;
+        if (tmpl->raw == raw && strcmp(tmpl->path, path) == 0)
+        {
+            *link = tmpl->next;
+            if (--tmpl->refs == 0) { template_free(tmpl); }
+            continue;
+        }
+        link = &tmpl->next;
+    }
+    fresh->next = template_cache[bucket];
+    template_cache[bucket] = fresh;
+    fresh->refs++;
+    pthread_mutex_unlock(&template_cache_mutex);
+
+    return fresh;
+}
+
+// Returns a compiled template (recompiled if the file changed), has to be released
+DynamicTemplate* template_acquire(const char *path)
+{
+    return template_acquire_mode(path, false);
+}
+
+// Same as above, but the file is not compiled (used for the included files)
+DynamicTemplate* template_acquire_raw(const char *path)
+{
+    return template_acquire_mode(path, true);
+}
+
+void template_release(void *arg)
+{
+    DynamicTemplate *tmpl = arg;
+
+    pthread_mutex_lock(&template_cache_mutex);
+    bool last = (--tmpl->refs == 0);
+    pthread_mutex_unlock(&template_cache_mutex);
+
+    if (last) { template_free(tmpl); }
+}
+
+// Drops the cache's references, the templates in use are freed once they are released
+//  (the DYNAMIC_CACHE rules are applied when a template is compiled)
+void template_cache_flush(void)
+{
+    pthread_mutex_lock(&template_cache_mutex);
+    for (int i = 0; i < TEMPLATE_CACHE_BUCKETS; i++)
+    {
+        while (template_cache[i])
+        {
+            DynamicTemplate *tmpl = template_cache[i];
+            template_cache[i] = tmpl->next;
+            if (--tmpl->refs == 0) { template_free(tmpl); }
+        }
+    }
+    pthread_mutex_unlock(&template_cache_mutex);
+}
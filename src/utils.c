@@ -8,6 +8,7 @@
  * 
  */
 #include <ctype.h>
+#include <limits.h>
 #include <time.h>
 #include <string.h>
 #include <stdlib.h>
@@ -21,15 +22,49 @@ void string_array_init(StringArray *array)
 {
     array->items = NULL;
     array->count = 0;
+    array->capacity = 0;
+    array->arena = NULL;
 }
 
-void string_array_add(StringArray *array, const char *item)
+void string_array_init_arena(StringArray *array, Arena *arena)
 {
-    array->items = realloc(array->items, sizeof(char*) * (array->count + 1));
-    array->items[array->count] = strdup(item);
+    string_array_init(array);
+    array->arena = arena;
+}
+
+static void string_array_grow(StringArray *array)
+{
+    size_t new_capacity = array->capacity ? array->capacity * 2 : 8;
+    if (array->arena)
+    {
+        char **items = arena_alloc(array->arena, sizeof(char*) * new_capacity);
+        if (array->count) { memcpy(items, array->items, sizeof(char*) * array->count); }
+        array->items = items;
+    }
+    else
+    {
+        array->items = realloc(array->items, sizeof(char*) * new_capacity);
+    }
+    array->capacity = new_capacity;
+}
+
+void string_array_add_len(StringArray *array, const char *item, size_t len)
+{
+    if (array->count == array->capacity)
+    {
+        string_array_grow(array);
+    }
+
+    array->items[array->count] = (array->arena) ?
+        arena_strndup(array->arena, item, len) : strndup(item, len);
     array->count++;
 }
 
+void string_array_add(StringArray *array, const char *item)
+{
+    string_array_add_len(array, item, strlen(item));
+}
+
 char* string_array_get(StringArray *array, size_t index)
 {
     if (index >= array->count) {
@@ -40,21 +75,32 @@ char* string_array_get(StringArray *array, size_t index)
 
 void string_array_free(StringArray *array)
 {
+    // Arena backed arrays are released with the arena
+    if (array->arena)
+    {
+        string_array_init_arena(array, array->arena);
+        return;
+    }
+
     for (size_t i = 0; i < array->count; i++) {
         free(array->items[i]);
     }
 
     free(array->items);
+    array->items = NULL;
     array->count = 0;
+    array->capacity = 0;
 }
 
 //////////////////////////////////////////////////////////////////////////////
 //                              Char Vector                                 //
 //////////////////////////////////////////////////////////////////////////////
 
-static void char_vector_realloc(CharVector *vec)
+// Grows the vector so it can hold at least min_size bytes
+static void char_vector_realloc(CharVector *vec, size_t min_size)
 {
     size_t new_size = vec->max_size * 2;
+    if (new_size < min_size) { new_size = min_size; }
     vec->items = realloc(vec->items, new_size);
     vec->max_size = new_size;
 }
@@ -73,7 +119,7 @@ void char_vector_push(CharVector *vec, char c)
 {
     if (vec->count + 1 >= vec->max_size)
     {
-        char_vector_realloc(vec);
+        char_vector_realloc(vec, vec->count + 2);
     }
 
     vec->items[vec->count++] = c;
@@ -83,9 +129,9 @@ void char_vector_push(CharVector *vec, char c)
 // Adds a null terminator at the end
 void char_vector_push_arr(CharVector *vec, const char *arr, size_t len)
 {
-    while (vec->count + len >= vec->max_size)
+    if (vec->count + len >= vec->max_size)
     {
-        char_vector_realloc(vec);
+        char_vector_realloc(vec, vec->count + len + 1);
     }
 
     memcpy(&vec->items[vec->count], arr, len);
@@ -93,6 +139,40 @@ void char_vector_push_arr(CharVector *vec, const char *arr, size_t len)
     vec->items[vec->count] = '\0';
 }
 
+// Makes sure there's space for at least len more bytes (and a null terminator)
+void char_vector_reserve(CharVector *vec, size_t len)
+{
+    if (vec->count + len >= vec->max_size)
+    {
+        char_vector_realloc(vec, vec->count + len + 1);
+    }
+}
+
+// Marks len bytes written directly into the spare capacity as used
+//  Adds a null terminator at the end
+void char_vector_commit(CharVector *vec, size_t len)
+{
+    vec->count += len;
+    vec->items[vec->count] = '\0';
+}
+
+void char_vector_clear(CharVector *vec)
+{
+    vec->count = 0;
+    vec->items[0] = '\0';
+}
+
+// Gives the memory back if the vector grew above max_size (has to be empty)
+void char_vector_trim(CharVector *vec, size_t max_size)
+{
+    if (vec->count == 0 && vec->max_size > max_size)
+    {
+        vec->items = realloc(vec->items, max_size);
+        vec->max_size = max_size;
+        vec->items[0] = '\0';
+    }
+}
+
 char char_vector_get_char(const CharVector *vec, size_t index)
 {
     if (index > vec->count)
@@ -156,6 +236,121 @@ char *strtrim(const char *str)
     return newstr;
 }
 
+void strtrim_span(const char **str, size_t *len)
+{
+    while (*len && isspace((unsigned char)(*str)[0])) { (*str)++; (*len)--; }
+    while (*len && isspace((unsigned char)(*str)[*len - 1])) { (*len)--; }
+}
+
+size_t url_encode(char *dst, const char *str, const char *keep)
+{
+    const char *hex = "0123456789ABCDEF";
+    size_t len = 0;
+    for ( ; *str; str++)
+    {
+        unsigned char c = *str;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+            c == '-' || c == '.' || c == '_' || c == '~' || (keep && strchr(keep, c)))
+        {
+            dst[len++] = c;
+            continue;
+        }
+        dst[len++] = '%';
+        dst[len++] = hex[c >> 4];
+        dst[len++] = hex[c & 15];
+    }
+    dst[len] = '\0';
+    return len;
+}
+
+bool glob_match(const char *pattern, const char *str)
+{
+    // Where to retry when the last star should swallow one more character
+    const char *star = NULL;
+    const char *retry = NULL;
+
+    while (*str)
+    {
+        if (*pattern == '*')
+        {
+            star = pattern++;
+            retry = str;
+        }
+        else if (*pattern == '?' || *pattern == *str)
+        {
+            pattern++;
+            str++;
+        }
+        else if (star)
+        {
+            pattern = star + 1;
+            str = ++retry;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    while (*pattern == '*') { pattern++; }
+    return *pattern == '\0';
+}
+
+// FNV-1a
+uint32_t hash_bytes(const void *data, size_t len)
+{
+    const uint8_t *bytes = data;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+uint32_t hash_string(const char *str)
+{
+    return hash_bytes(str, strlen(str));
+}
+
+// Accepts "<number>[ms|s|m|h]", plain numbers are multiplied by default_unit_ms
+//  Returns -1 if the string is not a valid duration
+int parse_duration_ms(const char *str, int default_unit_ms)
+{
+    char *end;
+    long value = strtol(str, &end, 10);
+    if (end == str || value < 0) { return -1; }
+
+    long unit;
+    if (*end == '\0') { unit = default_unit_ms; }
+    else if (strcmp(end, "ms") == 0) { unit = 1; }
+    else if (strcmp(end, "s") == 0) { unit = 1000; }
+    else if (strcmp(end, "m") == 0) { unit = 60 * 1000; }
+    else if (strcmp(end, "h") == 0) { unit = 60 * 60 * 1000; }
+    else { return -1; }
+
+    if (value > INT32_MAX / unit) { return -1; }
+    return value * unit;
+}
+
+// Accepts "<number>[k|M|G]" (powers of 1024), returns -1 if the string is not a valid size
+long parse_size_bytes(const char *str)
+{
+    char *end;
+    long value = strtol(str, &end, 10);
+    if (end == str || value < 0) { return -1; }
+
+    long unit;
+    if (*end == '\0') { unit = 1; }
+    else if (strcmp(end, "k") == 0 || strcmp(end, "K") == 0) { unit = 1024L; }
+    else if (strcmp(end, "M") == 0) { unit = 1024L * 1024; }
+    else if (strcmp(end, "G") == 0) { unit = 1024L * 1024 * 1024; }
+    else { return -1; }
+
+    if (value > LONG_MAX / unit) { return -1; }
+    return value * unit;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //                                  Time                                    //
 //////////////////////////////////////////////////////////////////////////////